@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include "extralite.h"
+#include "extralite_api.h"
+
+static VALUE api_synchronize(VALUE db, VALUE (*fn)(VALUE), VALUE arg) {
+  return Database_synchronize(Database_open_struct(db), fn, arg);
+}
+
+static sqlite3_stmt *api_prepare(VALUE db, VALUE sql) {
+  sqlite3_stmt *stmt = NULL;
+
+  StringValue(sql);
+  prepare_single_stmt(Database_sqlite3_db(db), &stmt, sql);
+  return stmt;
+}
+
+static int api_step(sqlite3_stmt *stmt) {
+  return stmt_iterate(stmt, sqlite3_db_handle(stmt));
+}
+
+static void api_reset(sqlite3_stmt *stmt) {
+  sqlite3_reset(stmt);
+}
+
+static void api_finalize(sqlite3_stmt *stmt) {
+  sqlite3_finalize(stmt);
+}
+
+// The API table is exported so it can be found using rb_ext_resolve_symbol.
+RUBY_FUNC_EXPORTED const extralite_api_t extralite_api;
+
+const extralite_api_t extralite_api = {
+  EXTRALITE_API_VERSION,
+  Database_sqlite3_db,
+  PreparedStatement_sqlite3_stmt,
+  api_synchronize,
+  api_prepare,
+  bind_all_parameters,
+  api_step,
+  api_reset,
+  api_finalize,
+  stmt_column_names,
+  stmt_column_value,
+  stmt_row_to_hash,
+  stmt_row_to_ary
+};
+
+void Init_ExtraliteAPI(void) {
+  VALUE mExtralite = rb_define_module("Extralite");
+
+  rb_define_const(mExtralite, "C_API", ULL2NUM((uintptr_t)&extralite_api));
+  rb_define_const(mExtralite, "C_API_VERSION", INT2FIX(EXTRALITE_API_VERSION));
+}
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE 1 // for copy_file_range
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "extralite.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+Cloning copies a template database file (and its WAL file, if in WAL mode)
+while holding a read transaction on the template, which guarantees a consistent
+snapshot: in rollback journal mode, the shared lock keeps writers from
+modifying the database file, and in WAL mode, the read mark keeps checkpointers
+from copying frames newer than the snapshot into the database file and from
+restarting the WAL, so the copied WAL covers any database pages modified during
+the copy. Files are copied using a reflink (FICLONE) where supported by the
+filesystem, falling back to copy_file_range and then to pread/write. The whole
+operation runs without holding the GVL.
+
+The template files are read through the file descriptors opened by SQLite for
+the read transaction: opening and then closing another descriptor for the same
+file would release the POSIX locks held by any connection in the process. If
+the descriptors are not available (when using the system SQLite library, or
+when the default VFS is not a unix VFS), the snapshot is copied using the
+backup API instead.
+*/
+
+#define CLONE_CHUNK_SIZE (1 << 20)
+
+enum clone_method {
+  CLONE_REFLINK,
+  CLONE_COPY_FILE_RANGE,
+  CLONE_COPY
+};
+
+typedef struct {
+  const char *src_path;
+  const char *dst_path;
+  const char *dst_wal_path;
+  volatile int interrupted;
+  int rc;
+  int err;
+  const char *failed_op;
+  const char *failed_path;
+  char errmsg[256];
+  enum clone_method method;
+  int dst_created;
+  int dst_wal_created;
+} clone_ctx;
+
+// records the slowest method used for any of the copied files
+static inline void clone_set_method(clone_ctx *ctx, enum clone_method method) {
+  if (method > ctx->method) ctx->method = method;
+}
+
+static int clone_copy_fd(clone_ctx *ctx, int src, int dst) {
+  struct stat st;
+  if (fstat(src, &st)) return -1;
+
+#if defined(HAVE_LINUX_FS_H) && defined(FICLONE)
+  if (!ioctl(dst, FICLONE, src)) return 0;
+#endif
+
+  // the source is read at explicit offsets, leaving the file offset used by
+  // SQLite untouched
+  off_t ofs = 0;
+  off_t remaining = st.st_size;
+#ifdef HAVE_COPY_FILE_RANGE
+  int copy_file_range_ok = 1;
+  while (remaining > 0 && !ctx->interrupted) {
+    size_t len = remaining > CLONE_CHUNK_SIZE * 16 ? CLONE_CHUNK_SIZE * 16 : remaining;
+    ssize_t n = copy_file_range(src, &ofs, dst, NULL, len, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (remaining == st.st_size && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+        copy_file_range_ok = 0;
+        break;
+      }
+      return -1;
+    }
+    if (n == 0) break;
+    remaining -= n;
+  }
+  if (copy_file_range_ok) {
+    clone_set_method(ctx, CLONE_COPY_FILE_RANGE);
+    return 0;
+  }
+#endif
+
+  char *buf = malloc(CLONE_CHUNK_SIZE);
+  if (!buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+  clone_set_method(ctx, CLONE_COPY);
+  while (remaining > 0 && !ctx->interrupted) {
+    ssize_t n = pread(src, buf, CLONE_CHUNK_SIZE, ofs);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      goto error;
+    }
+    if (n == 0) break;
+    ofs += n;
+    for (ssize_t ofs = 0; ofs < n;) {
+      ssize_t written = write(dst, buf + ofs, n - ofs);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        goto error;
+      }
+      ofs += written;
+    }
+    remaining -= n;
+  }
+  free(buf);
+  return 0;
+error:
+  free(buf);
+  return -1;
+}
+
+static int clone_create_file(clone_ctx *ctx, const char *dst_path, int *created) {
+  int dst = open(dst_path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+  if (dst < 0) {
+    ctx->failed_op = "open";
+    ctx->failed_path = dst_path;
+    return -1;
+  }
+  *created = 1;
+  return dst;
+}
+
+// The source file descriptor belongs to SQLite and is not closed
+static int clone_copy_file(clone_ctx *ctx, int src, const char *dst_path, int *created) {
+  int dst = clone_create_file(ctx, dst_path, created);
+  if (dst < 0) return -1;
+
+  int rc = clone_copy_fd(ctx, src, dst);
+  if (!rc) rc = fsync(dst);
+  ctx->err = errno;
+  close(dst);
+  errno = ctx->err;
+  if (rc) {
+    ctx->failed_op = "copy";
+    ctx->failed_path = dst_path;
+  }
+  return rc;
+}
+
+static void clone_sqlite_error(clone_ctx *ctx, sqlite3 *db, int rc) {
+  ctx->rc = rc;
+  snprintf(ctx->errmsg, sizeof(ctx->errmsg), "%s", db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+}
+
+static int clone_is_wal(sqlite3 *db) {
+  sqlite3_stmt *stmt = NULL;
+  int wal = 0;
+
+  if (sqlite3_prepare_v2(db, "pragma journal_mode", -1, &stmt, NULL) != SQLITE_OK) return 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    wal = !sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0), "wal");
+  sqlite3_finalize(stmt);
+  return wal;
+}
+
+// Returns the descriptor of the main database file (op = SQLITE_FCNTL_FILE_POINTER)
+// or of the WAL file (op = SQLITE_FCNTL_JOURNAL_POINTER), or -1.
+static int clone_file_fd(sqlite3 *db, int op) {
+  sqlite3_vfs *vfs = NULL;
+  sqlite3_file *file = NULL;
+
+  if (sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs) != SQLITE_OK) return -1;
+  if (sqlite3_file_control(db, "main", op, &file) != SQLITE_OK) return -1;
+  return unix_file_fd(vfs, file);
+}
+
+#define CLONE_BACKUP_PAGES 1024
+
+static void clone_backup(clone_ctx *ctx, sqlite3 *src) {
+  sqlite3 *dst = NULL;
+  sqlite3_backup *backup = NULL;
+
+  int fd = clone_create_file(ctx, ctx->dst_path, &ctx->dst_created);
+  if (fd < 0) {
+    ctx->err = errno;
+    return;
+  }
+  close(fd);
+  clone_set_method(ctx, CLONE_COPY);
+
+  int rc = sqlite3_open_v2(ctx->dst_path, &dst, SQLITE_OPEN_READWRITE, NULL);
+  if (rc == SQLITE_OK) {
+    backup = sqlite3_backup_init(dst, "main", src, "main");
+    if (!backup) rc = sqlite3_errcode(dst);
+  }
+  while (rc == SQLITE_OK && !ctx->interrupted)
+    rc = sqlite3_backup_step(backup, CLONE_BACKUP_PAGES);
+  if (backup) sqlite3_backup_finish(backup);
+  if (rc != SQLITE_OK && rc != SQLITE_DONE && !ctx->interrupted)
+    clone_sqlite_error(ctx, dst, rc);
+  sqlite3_close_v2(dst);
+}
+
+static void *clone_without_gvl(void *ptr) {
+  clone_ctx *ctx = (clone_ctx *)ptr;
+  sqlite3 *db = NULL;
+
+  int rc = sqlite3_open_v2(ctx->src_path, &db, SQLITE_OPEN_READONLY, NULL);
+  if (rc != SQLITE_OK) {
+    clone_sqlite_error(ctx, db, rc);
+    goto done;
+  }
+
+  // the read transaction starts with the first read
+  rc = sqlite3_exec(db, "begin; select count(*) from sqlite_master", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    clone_sqlite_error(ctx, db, rc);
+    goto done;
+  }
+
+  int src = clone_file_fd(db, SQLITE_FCNTL_FILE_POINTER);
+  if (src < 0) {
+    clone_backup(ctx, db);
+    goto done;
+  }
+
+  if (clone_copy_file(ctx, src, ctx->dst_path, &ctx->dst_created)) {
+    ctx->err = errno;
+    goto done;
+  }
+
+  // in WAL mode, the WAL file is opened by the read transaction
+  int src_wal = clone_is_wal(db) ? clone_file_fd(db, SQLITE_FCNTL_JOURNAL_POINTER) : -1;
+  if (src_wal >= 0) {
+    if (clone_copy_file(ctx, src_wal, ctx->dst_wal_path, &ctx->dst_wal_created)) {
+      ctx->err = errno;
+      goto done;
+    }
+  }
+
+done:
+  if (db) sqlite3_close_v2(db);
+  return NULL;
+}
+
+static void clone_ubf(void *ptr) {
+  clone_ctx *ctx = (clone_ctx *)ptr;
+  ctx->interrupted = 1;
+}
+
+static ID ID_reflink;
+static ID ID_copy_file_range;
+static ID ID_copy;
+
+/* call-seq:
+ *   Extralite.clone_database(template_path, new_path) -> method
+ *
+ * Creates a new database at `new_path` by copying a consistent snapshot of the
+ * database at `template_path`, which may be concurrently used by other
+ * connections. The file is copied using a reflink where supported by the
+ * filesystem (e.g. Btrfs, XFS), which takes constant time regardless of the
+ * database size, falling back to `copy_file_range` and then to a regular copy.
+ * Runs without holding the GVL. Raises an error if `new_path` already exists.
+ * Returns the method used: `:reflink`, `:copy_file_range` or `:copy`.
+ */
+VALUE Extralite_clone_database(VALUE self, VALUE template_path, VALUE new_path) {
+  FilePathValue(template_path);
+  FilePathValue(new_path);
+  VALUE dst_wal_path = rb_str_plus(new_path, rb_str_new_literal("-wal"));
+
+  clone_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.src_path = StringValueCStr(template_path);
+  ctx.dst_path = StringValueCStr(new_path);
+  ctx.dst_wal_path = StringValueCStr(dst_wal_path);
+  ctx.method = CLONE_REFLINK;
+
+  rb_thread_call_without_gvl(clone_without_gvl, (void *)&ctx, clone_ubf, (void *)&ctx);
+  RB_GC_GUARD(template_path);
+  RB_GC_GUARD(new_path);
+  RB_GC_GUARD(dst_wal_path);
+
+  if (ctx.rc || ctx.failed_op || ctx.interrupted) {
+    // a failed open of an existing destination must not remove it
+    if (ctx.dst_created) unlink(ctx.dst_path);
+    if (ctx.dst_wal_created) unlink(ctx.dst_wal_path);
+
+    if (ctx.rc == SQLITE_BUSY)
+      rb_raise(cBusyError, "Database is busy");
+    if (ctx.rc)
+      rb_raise(cError, "%s", ctx.errmsg);
+    if (ctx.failed_op)
+      rb_syserr_fail_str(ctx.err, rb_sprintf("%s %s", ctx.failed_op, ctx.failed_path));
+    rb_thread_check_ints();
+    rb_raise(cInterruptError, "Clone was interrupted");
+  }
+
+  switch (ctx.method) {
+    case CLONE_REFLINK:
+      return ID2SYM(ID_reflink);
+    case CLONE_COPY_FILE_RANGE:
+      return ID2SYM(ID_copy_file_range);
+    default:
+      return ID2SYM(ID_copy);
+  }
+}
+
+void Init_ExtraliteClone(void) {
+  VALUE mExtralite = rb_define_module("Extralite");
+  rb_define_singleton_method(mExtralite, "clone_database", Extralite_clone_database, 2);
+
+  ID_reflink          = rb_intern("reflink");
+  ID_copy_file_range  = rb_intern("copy_file_range");
+  ID_copy             = rb_intern("copy");
+}
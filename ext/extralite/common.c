@@ -100,22 +100,153 @@ static inline VALUE get_column_names(sqlite3_stmt *stmt, int column_count) {
   return arr;
 }
 
-static inline VALUE row_to_hash(sqlite3_stmt *stmt, int column_count, VALUE column_names) {
+static inline VALUE row_to_hash(sqlite3_stmt *stmt, int column_count, VALUE column_names, int freeze) {
   VALUE row = rb_hash_new();
   for (int i = 0; i < column_count; i++) {
     VALUE value = get_column_value(stmt, i, sqlite3_column_type(stmt, i));
+    if (freeze) rb_obj_freeze(value);
     rb_hash_aset(row, RARRAY_AREF(column_names, i), value);
   }
-  return row;
+  return freeze ? rb_obj_freeze(row) : row;
 }
 
-static inline VALUE row_to_ary(sqlite3_stmt *stmt, int column_count) {
+static inline VALUE row_to_ary(sqlite3_stmt *stmt, int column_count, int freeze) {
   VALUE row = rb_ary_new2(column_count);
   for (int i = 0; i < column_count; i++) {
     VALUE value = get_column_value(stmt, i, sqlite3_column_type(stmt, i));
+    if (freeze) rb_obj_freeze(value);
     rb_ary_push(row, value);
   }
-  return row;
+  return freeze ? rb_obj_freeze(row) : row;
+}
+
+/*
+Specialized row converters are used by query_ary and query_hash for common
+narrow result shapes. The converter is chosen once per query from the column
+types of the first row. Each converter checks the column types of the current
+row against its signature, and converts the row with no per-cell switch. When
+a row does not match the signature (e.g. a NULL value), the query falls back to
+the generic conversion for the remaining rows.
+*/
+
+#define COLUMN_VALUE_INTEGER(stmt, i) LL2NUM(sqlite3_column_int64(stmt, i))
+#define COLUMN_VALUE_FLOAT(stmt, i)   DBL2NUM(sqlite3_column_double(stmt, i))
+#define COLUMN_VALUE_TEXT(stmt, i)    rb_str_new_cstr((char *)sqlite3_column_text(stmt, i))
+
+#define COLUMN_IS(i, T)       (sqlite3_column_type(stmt, i) == SQLITE_##T)
+#define COLUMN_CONVERT(i, T)  values[i] = COLUMN_VALUE_##T(stmt, i)
+
+#define DEFINE_ROW_CONVERTER_1(T0) \
+  static int convert_row_##T0(sqlite3_stmt *stmt, VALUE *values) { \
+    if (!COLUMN_IS(0, T0)) return 0; \
+    COLUMN_CONVERT(0, T0); \
+    return 1; \
+  }
+
+#define DEFINE_ROW_CONVERTER_2(T0, T1) \
+  static int convert_row_##T0##_##T1(sqlite3_stmt *stmt, VALUE *values) { \
+    if (!(COLUMN_IS(0, T0) && COLUMN_IS(1, T1))) return 0; \
+    COLUMN_CONVERT(0, T0); COLUMN_CONVERT(1, T1); \
+    return 1; \
+  }
+
+#define DEFINE_ROW_CONVERTER_3(T0, T1, T2) \
+  static int convert_row_##T0##_##T1##_##T2(sqlite3_stmt *stmt, VALUE *values) { \
+    if (!(COLUMN_IS(0, T0) && COLUMN_IS(1, T1) && COLUMN_IS(2, T2))) return 0; \
+    COLUMN_CONVERT(0, T0); COLUMN_CONVERT(1, T1); COLUMN_CONVERT(2, T2); \
+    return 1; \
+  }
+
+#define DEFINE_ROW_CONVERTER_4(T0, T1, T2, T3) \
+  static int convert_row_##T0##_##T1##_##T2##_##T3(sqlite3_stmt *stmt, VALUE *values) { \
+    if (!(COLUMN_IS(0, T0) && COLUMN_IS(1, T1) && COLUMN_IS(2, T2) && COLUMN_IS(3, T3))) return 0; \
+    COLUMN_CONVERT(0, T0); COLUMN_CONVERT(1, T1); COLUMN_CONVERT(2, T2); COLUMN_CONVERT(3, T3); \
+    return 1; \
+  }
+
+DEFINE_ROW_CONVERTER_1(INTEGER)
+DEFINE_ROW_CONVERTER_1(FLOAT)
+DEFINE_ROW_CONVERTER_1(TEXT)
+DEFINE_ROW_CONVERTER_2(INTEGER, INTEGER)
+DEFINE_ROW_CONVERTER_2(INTEGER, FLOAT)
+DEFINE_ROW_CONVERTER_2(INTEGER, TEXT)
+DEFINE_ROW_CONVERTER_2(TEXT, INTEGER)
+DEFINE_ROW_CONVERTER_2(TEXT, TEXT)
+DEFINE_ROW_CONVERTER_3(INTEGER, INTEGER, INTEGER)
+DEFINE_ROW_CONVERTER_3(INTEGER, TEXT, INTEGER)
+DEFINE_ROW_CONVERTER_3(INTEGER, TEXT, FLOAT)
+DEFINE_ROW_CONVERTER_3(INTEGER, TEXT, TEXT)
+DEFINE_ROW_CONVERTER_4(INTEGER, INTEGER, INTEGER, INTEGER)
+DEFINE_ROW_CONVERTER_4(INTEGER, TEXT, INTEGER, TEXT)
+DEFINE_ROW_CONVERTER_4(INTEGER, TEXT, TEXT, INTEGER)
+DEFINE_ROW_CONVERTER_4(INTEGER, TEXT, TEXT, TEXT)
+
+#define ROW_CONVERTER_MAX_COLUMNS 4
+
+typedef int (*row_converter_fn)(sqlite3_stmt *stmt, VALUE *values);
+
+typedef struct {
+  int column_count;
+  int types[ROW_CONVERTER_MAX_COLUMNS];
+  row_converter_fn fn;
+} row_converter;
+
+#define I SQLITE_INTEGER
+#define F SQLITE_FLOAT
+#define T SQLITE_TEXT
+static const row_converter row_converters[] = {
+  { 1, { I },          convert_row_INTEGER },
+  { 1, { F },          convert_row_FLOAT },
+  { 1, { T },          convert_row_TEXT },
+  { 2, { I, I },       convert_row_INTEGER_INTEGER },
+  { 2, { I, F },       convert_row_INTEGER_FLOAT },
+  { 2, { I, T },       convert_row_INTEGER_TEXT },
+  { 2, { T, I },       convert_row_TEXT_INTEGER },
+  { 2, { T, T },       convert_row_TEXT_TEXT },
+  { 3, { I, I, I },    convert_row_INTEGER_INTEGER_INTEGER },
+  { 3, { I, T, I },    convert_row_INTEGER_TEXT_INTEGER },
+  { 3, { I, T, F },    convert_row_INTEGER_TEXT_FLOAT },
+  { 3, { I, T, T },    convert_row_INTEGER_TEXT_TEXT },
+  { 4, { I, I, I, I }, convert_row_INTEGER_INTEGER_INTEGER_INTEGER },
+  { 4, { I, T, I, T }, convert_row_INTEGER_TEXT_INTEGER_TEXT },
+  { 4, { I, T, T, I }, convert_row_INTEGER_TEXT_TEXT_INTEGER },
+  { 4, { I, T, T, T }, convert_row_INTEGER_TEXT_TEXT_TEXT },
+};
+#undef I
+#undef F
+#undef T
+
+// Returns the converter matching the column types of the current row, or NULL.
+static row_converter_fn select_row_converter(sqlite3_stmt *stmt, int column_count) {
+  if (column_count > ROW_CONVERTER_MAX_COLUMNS) return NULL;
+
+  int types[ROW_CONVERTER_MAX_COLUMNS];
+  for (int i = 0; i < column_count; i++) types[i] = sqlite3_column_type(stmt, i);
+
+  for (size_t i = 0; i < sizeof(row_converters) / sizeof(row_converter); i++) {
+    const row_converter *c = row_converters + i;
+    if (c->column_count == column_count && !memcmp(c->types, types, sizeof(int) * column_count))
+      return c->fn;
+  }
+  return NULL;
+}
+
+// Non-inlined versions of the row conversion helpers, used by the C API.
+
+VALUE stmt_column_value(sqlite3_stmt *stmt, int col) {
+  return get_column_value(stmt, col, sqlite3_column_type(stmt, col));
+}
+
+VALUE stmt_column_names(sqlite3_stmt *stmt) {
+  return get_column_names(stmt, sqlite3_column_count(stmt));
+}
+
+VALUE stmt_row_to_hash(sqlite3_stmt *stmt, VALUE column_names) {
+  return row_to_hash(stmt, sqlite3_column_count(stmt), column_names, 0);
+}
+
+VALUE stmt_row_to_ary(sqlite3_stmt *stmt) {
+  return row_to_ary(stmt, sqlite3_column_count(stmt), 0);
 }
 
 typedef struct {
@@ -146,6 +277,7 @@ void *prepare_multi_stmt_without_gvl(void *ptr) {
     sqlite3_finalize(*ctx->stmt);
     switch (ctx->rc) {
     case SQLITE_BUSY:
+    case SQLITE_LOCKED_SHAREDCACHE:
     case SQLITE_ERROR:
     case SQLITE_MISUSE:
       return NULL;
@@ -170,6 +302,7 @@ void prepare_multi_stmt(sqlite3 *db, sqlite3_stmt **stmt, VALUE sql) {
   case 0:
     return;
   case SQLITE_BUSY:
+  case SQLITE_LOCKED_SHAREDCACHE:
     rb_raise(cBusyError, "Database is busy");
   case SQLITE_ERROR:
     rb_raise(cSQLError, "%s", sqlite3_errmsg(db));
@@ -189,9 +322,19 @@ void *prepare_single_stmt_without_gvl(void *ptr) {
   ctx->rc = sqlite3_prepare_v2(ctx->db, str, end - str, ctx->stmt, &rest);
   if (ctx->rc)
     goto discard_stmt;
-  else if (rest != end) {
-    ctx->rc = SQLITE_MULTI_STMT;
-    goto discard_stmt;
+
+  // the remainder is accepted if it consists only of whitespace, comments and
+  // semicolons, which prepare to no statement
+  while (rest != end) {
+    sqlite3_stmt *tail = NULL;
+    const char *next = NULL;
+    int rc = sqlite3_prepare_v2(ctx->db, rest, end - rest, &tail, &next);
+    if (rc || tail || next == rest) {
+      sqlite3_finalize(tail);
+      ctx->rc = SQLITE_MULTI_STMT;
+      goto discard_stmt;
+    }
+    rest = next;
   }
   goto end;
 discard_stmt:
@@ -212,6 +355,7 @@ void prepare_single_stmt(sqlite3 *db, sqlite3_stmt **stmt, VALUE sql) {
   case 0:
     return;
   case SQLITE_BUSY:
+  case SQLITE_LOCKED_SHAREDCACHE:
     rb_raise(cBusyError, "Database is busy");
   case SQLITE_ERROR:
     rb_raise(cSQLError, "%s", sqlite3_errmsg(db));
@@ -242,6 +386,7 @@ int stmt_iterate(sqlite3_stmt *stmt, sqlite3 *db) {
     case SQLITE_DONE:
       return 0;
     case SQLITE_BUSY:
+    case SQLITE_LOCKED_SHAREDCACHE:
       rb_raise(cBusyError, "Database is busy");
     case SQLITE_INTERRUPT:
       rb_raise(cInterruptError, "Query was interrupted");
@@ -272,8 +417,54 @@ VALUE safe_query_hash(query_ctx *ctx) {
   // block not given, so prepare the array of records to be returned
   if (!yield_to_block) result = rb_ary_new();
 
+  VALUE values[ROW_CONVERTER_MAX_COLUMNS];
+  VALUE pairs[ROW_CONVERTER_MAX_COLUMNS * 2];
+  row_converter_fn converter = NULL;
+  int first_row = !ctx->freeze;
+
+  while (stmt_iterate(ctx->stmt, ctx->sqlite3_db)) {
+    if (first_row) {
+      converter = select_row_converter(ctx->stmt, column_count);
+      first_row = 0;
+    }
+    if (converter && converter(ctx->stmt, values)) {
+      for (int i = 0; i < column_count; i++) {
+        pairs[i * 2] = RARRAY_AREF(column_names, i);
+        pairs[i * 2 + 1] = values[i];
+      }
+      row = rb_hash_new();
+      rb_hash_bulk_insert(column_count * 2, pairs, row);
+    }
+    else {
+      converter = NULL;
+      row = row_to_hash(ctx->stmt, column_count, column_names, ctx->freeze);
+    }
+    if (yield_to_block) rb_yield(row);
+    else                rb_ary_push(result, row);
+  }
+
+  RB_GC_GUARD(column_names);
+  RB_GC_GUARD(row);
+  RB_GC_GUARD(result);
+  return (ctx->freeze && !yield_to_block) ? rb_obj_freeze(result) : result;
+}
+
+VALUE safe_query_rows(query_ctx *ctx) {
+  VALUE result = ctx->self;
+  int yield_to_block = rb_block_given_p();
+  VALUE row;
+  int column_count;
+  VALUE column_names;
+
+  column_count = sqlite3_column_count(ctx->stmt);
+  // column names are shared by all rows
+  column_names = rb_obj_freeze(get_column_names(ctx->stmt, column_count));
+
+  // block not given, so prepare the array of records to be returned
+  if (!yield_to_block) result = rb_ary_new();
+
   while (stmt_iterate(ctx->stmt, ctx->sqlite3_db)) {
-    row = row_to_hash(ctx->stmt, column_count, column_names);
+    row = row_new(ctx->stmt, column_count, column_names, ctx->freeze);
     if (yield_to_block) rb_yield(row);
     else                rb_ary_push(result, row);
   }
@@ -281,7 +472,7 @@ VALUE safe_query_hash(query_ctx *ctx) {
   RB_GC_GUARD(column_names);
   RB_GC_GUARD(row);
   RB_GC_GUARD(result);
-  return result;
+  return (ctx->freeze && !yield_to_block) ? rb_obj_freeze(result) : result;
 }
 
 VALUE safe_query_ary(query_ctx *ctx) {
@@ -295,15 +486,28 @@ VALUE safe_query_ary(query_ctx *ctx) {
   // block not given, so prepare the array of records to be returned
   if (!yield_to_block) result = rb_ary_new();
 
+  VALUE values[ROW_CONVERTER_MAX_COLUMNS];
+  row_converter_fn converter = NULL;
+  int first_row = !ctx->freeze;
+
   while (stmt_iterate(ctx->stmt, ctx->sqlite3_db)) {
-    row = row_to_ary(ctx->stmt, column_count);
+    if (first_row) {
+      converter = select_row_converter(ctx->stmt, column_count);
+      first_row = 0;
+    }
+    if (converter && converter(ctx->stmt, values))
+      row = rb_ary_new_from_values(column_count, values);
+    else {
+      converter = NULL;
+      row = row_to_ary(ctx->stmt, column_count, ctx->freeze);
+    }
     if (yield_to_block) rb_yield(row);
     else                rb_ary_push(result, row);
   }
 
   RB_GC_GUARD(row);
   RB_GC_GUARD(result);
-  return result;
+  return (ctx->freeze && !yield_to_block) ? rb_obj_freeze(result) : result;
 }
 
 VALUE safe_query_single_row(query_ctx *ctx) {
@@ -315,7 +519,7 @@ VALUE safe_query_single_row(query_ctx *ctx) {
   column_names = get_column_names(ctx->stmt, column_count);
 
   if (stmt_iterate(ctx->stmt, ctx->sqlite3_db))
-    row = row_to_hash(ctx->stmt, column_count, column_names);
+    row = row_to_hash(ctx->stmt, column_count, column_names, ctx->freeze);
 
   RB_GC_GUARD(row);
   RB_GC_GUARD(column_names);
@@ -337,12 +541,13 @@ VALUE safe_query_single_column(query_ctx *ctx) {
 
   while (stmt_iterate(ctx->stmt, ctx->sqlite3_db)) {
     value = get_column_value(ctx->stmt, 0, sqlite3_column_type(ctx->stmt, 0));
+    if (ctx->freeze) rb_obj_freeze(value);
     if (yield_to_block) rb_yield(value); else rb_ary_push(result, value);
   }
 
   RB_GC_GUARD(value);
   RB_GC_GUARD(result);
-  return result;
+  return (ctx->freeze && !yield_to_block) ? rb_obj_freeze(result) : result;
 }
 
 VALUE safe_query_single_value(query_ctx *ctx) {
@@ -353,8 +558,10 @@ VALUE safe_query_single_value(query_ctx *ctx) {
   if (column_count != 1)
     rb_raise(cError, "Expected query result to have 1 column");
 
-  if (stmt_iterate(ctx->stmt, ctx->sqlite3_db))
+  if (stmt_iterate(ctx->stmt, ctx->sqlite3_db)) {
     value = get_column_value(ctx->stmt, 0, sqlite3_column_type(ctx->stmt, 0));
+    if (ctx->freeze) rb_obj_freeze(value);
+  }
 
   RB_GC_GUARD(value);
   return value;
@@ -377,5 +584,6 @@ VALUE safe_execute_multi(query_ctx *ctx) {
 }
 
 VALUE safe_query_columns(query_ctx *ctx) {
-  return get_column_names(ctx->stmt, sqlite3_column_count(ctx->stmt));
+  VALUE columns = get_column_names(ctx->stmt, sqlite3_column_count(ctx->stmt));
+  return ctx->freeze ? rb_obj_freeze(columns) : columns;
 }
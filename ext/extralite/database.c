@@ -1,6 +1,16 @@
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
 #include "extralite.h"
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 VALUE cDatabase;
 VALUE cError;
 VALUE cSQLError;
@@ -10,28 +20,108 @@ VALUE cInterruptError;
 ID ID_call;
 ID ID_keys;
 ID ID_new;
+ID ID_shift;
 ID ID_strip;
 ID ID_to_s;
 
+VALUE SYM_frozen;
+
+static VALUE SYM_on_fork;
+static VALUE SYM_reopen;
+static VALUE SYM_thread_safe;
+static VALUE SYM_vfs;
+static VALUE SYM_shared_cache;
+static VALUE SYM_immutable;
+static VALUE SYM_io_stats;
+static VALUE SYM_columns;
+static VALUE SYM_foreign_keys;
+static VALUE SYM_indexes;
+static VALUE SYM_table_info;
+static VALUE SYM_tables;
+
+#ifdef HAVE_WORKING_FORK
+#include <pthread.h>
+
+// The pid of the current process, updated in forked child processes.
+static rb_pid_t current_pid;
+
+static void Extralite_after_fork_child(void) {
+  current_pid = getpid();
+}
+
+#define DATABASE_INHERITED(db) ((db)->pid != current_pid)
+#else
+#define DATABASE_INHERITED(db) 0
+#endif
+
+// Returns true if an object created by the given pid was inherited from a
+// parent process.
+int Database_inherited_p(rb_pid_t pid) {
+#ifdef HAVE_WORKING_FORK
+  return pid != current_pid;
+#else
+  return 0;
+#endif
+}
+
 static size_t Database_size(const void *ptr) {
   return sizeof(Database_t);
 }
 
+static void Database_mark(void *ptr) {
+  Database_t *db = ptr;
+  rb_gc_mark(db->trace_block);
+  rb_gc_mark(db->path);
+  rb_gc_mark(db->vfs);
+  rb_gc_mark(db->lock);
+  rb_gc_mark(db->lock_owner);
+  rb_gc_mark(db->schema_cache);
+  rb_gc_mark(db->scan_report);
+  rb_gc_mark(db->commit_hooks);
+}
+
+static void Database_finalize_schema_stmts(Database_t *db) {
+  if (db->schema_version_stmts[0]) sqlite3_finalize(db->schema_version_stmts[0]);
+  if (db->schema_version_stmts[1]) sqlite3_finalize(db->schema_version_stmts[1]);
+  db->schema_version_stmts[0] = db->schema_version_stmts[1] = NULL;
+}
+
 static void Database_free(void *ptr) {
   Database_t *db = ptr;
-  if (db->sqlite3_db) sqlite3_close_v2(db->sqlite3_db);
+  // A connection inherited from a parent process must not be closed, as doing
+  // so might corrupt the state of the parent's connection.
+  if (db->sqlite3_db && !DATABASE_INHERITED(db)) {
+    Database_finalize_schema_stmts(db);
+    sqlite3_close_v2(db->sqlite3_db);
+  }
   free(ptr);
 }
 
 static const rb_data_type_t Database_type = {
     "Database",
-    {0, Database_free, Database_size,},
+    {Database_mark, Database_free, Database_size,},
     0, 0, RUBY_TYPED_FREE_IMMEDIATELY
 };
 
 static VALUE Database_allocate(VALUE klass) {
   Database_t *db = ALLOC(Database_t);
   db->sqlite3_db = 0;
+  db->trace_block = Qnil;
+  db->freeze_results = 0;
+  db->path = Qnil;
+  db->vfs = Qnil;
+  db->reopen_on_fork = 0;
+  db->shared_cache = 0;
+  db->immutable = 0;
+  db->busy_timeout_ms = 0;
+  db->pid = 0;
+  db->lock = Qnil;
+  db->lock_owner = Qnil;
+  db->schema_version_stmts[0] = db->schema_version_stmts[1] = NULL;
+  db->schema_cache = Qnil;
+  db->scan_report = Qnil;
+  db->commit_hooks = Qnil;
+  db->commits_pending = 0;
   return TypedData_Wrap_Struct(klass, &Database_type, db);
 }
 
@@ -44,6 +134,25 @@ static VALUE Database_allocate(VALUE klass) {
   if (!(database)->sqlite3_db) { \
     rb_raise(cError, "Database is closed"); \
   } \
+  if (DATABASE_INHERITED(database)) Database_handle_fork(database); \
+}
+
+static void Database_open(Database_t *db);
+
+/*
+Handles a database connection inherited from a parent process. The inherited
+connection is dropped without being closed. If the database was opened with the
+`on_fork: :reopen` option, a new connection is opened using the same path and
+options. Prepared statements are reprepared lazily on their next use.
+*/
+static void Database_handle_fork(Database_t *db) {
+  db->sqlite3_db = NULL;
+  db->schema_version_stmts[0] = db->schema_version_stmts[1] = NULL;
+  db->schema_cache = Qnil;
+  if (!db->reopen_on_fork)
+    rb_raise(cError, "Database connection was inherited from a parent process");
+
+  Database_open(db);
 }
 
 Database_t *Database_struct(VALUE self) {
@@ -52,12 +161,77 @@ Database_t *Database_struct(VALUE self) {
   return db;
 }
 
+Database_t *Database_open_struct(VALUE self) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+  return db;
+}
+
 sqlite3 *Database_sqlite3_db(VALUE self) {
   Database_t *db;
-  GetDatabase(self, db);
+  GetOpenDatabase(self, db);
   return db->sqlite3_db;
 }
 
+/*
+Commit hooks are invoked after the committing statement has returned. The
+native commit hook is called by SQLite while the statement is being stepped
+without holding the GVL, and before the commit is complete, so it only marks the
+commit as pending. Pending commits are dispatched to the Ruby hooks by
+Database_synchronize, after the operation performing the commit is done (and,
+in thread-safe mode, the database lock is released).
+*/
+static int Database_commit_hook(void *ptr) {
+  Database_t *db = (Database_t *)ptr;
+  db->commits_pending++;
+  return 0;
+}
+
+static void Database_install_commit_hook(Database_t *db) {
+  int active = db->commit_hooks != Qnil && RARRAY_LEN(db->commit_hooks) > 0;
+  sqlite3_commit_hook(db->sqlite3_db, active ? Database_commit_hook : NULL, active ? db : NULL);
+}
+
+static void Database_dispatch_commits(Database_t *db) {
+  db->commits_pending = 0;
+  if (db->commit_hooks == Qnil) return;
+
+  // hooks may be added or removed by a hook
+  VALUE hooks = rb_ary_dup(db->commit_hooks);
+  for (long i = 0; i < RARRAY_LEN(hooks); i++)
+    rb_funcall(RARRAY_AREF(hooks, i), ID_call, 0);
+  RB_GC_GUARD(hooks);
+}
+
+static VALUE Database_unlock(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  db->lock_owner = Qnil;
+  rb_mutex_unlock(db->lock);
+  return Qnil;
+}
+
+/*
+Calls the given function while holding the database lock. If the database was
+not opened in thread-safe mode, the function is called directly. The lock is
+reentrant, so a query may be performed from within a block iterating over the
+results of another query.
+*/
+VALUE Database_synchronize(Database_t *db, VALUE (*fn)(VALUE), VALUE arg) {
+  VALUE result;
+  if (db->lock == Qnil)
+    result = fn(arg);
+  else {
+    VALUE fiber = rb_fiber_current();
+    if (db->lock_owner == fiber) return fn(arg);
+
+    rb_mutex_lock(db->lock);
+    db->lock_owner = fiber;
+    result = rb_ensure(fn, arg, Database_unlock, (VALUE)db);
+  }
+  if (db->commits_pending) Database_dispatch_commits(db);
+  return result;
+}
+
 /* call-seq:
  *   Extralite.sqlite3_version -> version
  *
@@ -68,40 +242,201 @@ VALUE Extralite_sqlite3_version(VALUE self) {
   return rb_str_new_cstr(sqlite3_version);
 }
 
-/* call-seq:
- *   db.initialize(path)
- *
- * Initializes a new SQLite database with the given path.
- */
+// Number of pages cached by immutable databases, whose pages are read directly
+// from the memory-mapped file.
+#define IMMUTABLE_CACHE_SIZE 16
+
+/*
+Returns a URI filename for opening the given path with the `immutable` query
+parameter, which tells SQLite the file cannot change, so it is read without
+any locking or change detection.
+*/
+static char *Database_immutable_uri(const char *path) {
+  sqlite3_str *uri = sqlite3_str_new(NULL);
+  // an empty authority, so paths starting with // are not taken for one
+  sqlite3_str_appendall(uri, path[0] == '/' ? "file://" : "file:");
+  for (const char *c = path; *c; c++) {
+    if (*c == '%' || *c == '?' || *c == '#')
+      sqlite3_str_appendf(uri, "%%%02x", (unsigned char)*c);
+    else
+      sqlite3_str_appendchar(uri, 1, *c);
+  }
+  sqlite3_str_appendall(uri, "?immutable=1");
+  return sqlite3_str_finish(uri);
+}
 
-VALUE Database_initialize(VALUE self, VALUE path) {
-  int rc;
-  Database_t *db;
-  GetDatabase(self, db);
+/*
+Maps the whole database file into memory, so pages are read from the OS page
+cache, shared by all processes opening the file (including forked processes),
+instead of being copied into a private page cache, which is kept small.
+*/
+static int Database_setup_immutable(sqlite3 *sqlite3_db) {
+  sqlite3_file *file = NULL;
+  sqlite3_int64 size = 0;
+  int rc = sqlite3_file_control(sqlite3_db, "main", SQLITE_FCNTL_FILE_POINTER, &file);
+  if (rc) return rc;
+  if (file && file->pMethods) {
+    rc = file->pMethods->xFileSize(file, &size);
+    if (rc) return rc;
+  }
+
+  char *sql = sqlite3_mprintf(
+    "pragma mmap_size=%lld; pragma cache_size=%d", size, IMMUTABLE_CACHE_SIZE
+  );
+  if (!sql) return SQLITE_NOMEM;
+  rc = sqlite3_exec(sqlite3_db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  return rc;
+}
 
-  rc = sqlite3_open(StringValueCStr(path), &db->sqlite3_db);
+static void Database_open(Database_t *db) {
+  int rc;
+  sqlite3 *sqlite3_db;
+
+  // In thread-safe mode, access to the connection is serialized by the database
+  // lock, so SQLite's own per-call mutexes are not needed.
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  if (db->immutable) flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_URI;
+  if (db->lock != Qnil) flags |= SQLITE_OPEN_NOMUTEX;
+  if (db->shared_cache) flags |= SQLITE_OPEN_SHAREDCACHE;
+
+  const char *vfs = (db->vfs != Qnil) ? StringValueCStr(db->vfs) : NULL;
+  if (db->immutable) {
+    char *uri = Database_immutable_uri(StringValueCStr(db->path));
+    if (!uri) rb_raise(rb_eNoMemError, "Failed to allocate database URI");
+    rc = sqlite3_open_v2(uri, &sqlite3_db, flags, vfs);
+    sqlite3_free(uri);
+  }
+  else
+    rc = sqlite3_open_v2(StringValueCStr(db->path), &sqlite3_db, flags, vfs);
   if (rc) {
-    sqlite3_close_v2(db->sqlite3_db);
+    sqlite3_close_v2(sqlite3_db);
     rb_raise(cError, "%s", sqlite3_errstr(rc));
   }
 
   // Enable extended result codes
-  rc = sqlite3_extended_result_codes(db->sqlite3_db, 1);
-  if (rc) {
-    sqlite3_close_v2(db->sqlite3_db);
-    rb_raise(cError, "%s", sqlite3_errmsg(db->sqlite3_db));
-  }
+  rc = sqlite3_extended_result_codes(sqlite3_db, 1);
+  if (rc) goto error;
 
 #ifdef HAVE_SQLITE3_ENABLE_LOAD_EXTENSION
-  rc = sqlite3_enable_load_extension(db->sqlite3_db, 1);
-  if (rc) {
-    sqlite3_close_v2(db->sqlite3_db);
-    rb_raise(cError, "%s", sqlite3_errmsg(db->sqlite3_db));
+  rc = sqlite3_enable_load_extension(sqlite3_db, 1);
+  if (rc) goto error;
+#endif
+
+  if (db->busy_timeout_ms) {
+    rc = sqlite3_busy_timeout(sqlite3_db, db->busy_timeout_ms);
+    if (rc) goto error;
+  }
+
+  if (db->immutable) {
+    rc = Database_setup_immutable(sqlite3_db);
+    if (rc) goto error;
   }
+
+  db->sqlite3_db = sqlite3_db;
+  // reinstall the commit hook when reopening after a fork
+  if (db->commit_hooks != Qnil) Database_install_commit_hook(db);
+#ifdef HAVE_WORKING_FORK
+  db->pid = current_pid;
 #endif
+  return;
+error:
+  {
+    VALUE msg = rb_str_new_cstr(sqlite3_errmsg(sqlite3_db));
+    sqlite3_close_v2(sqlite3_db);
+    rb_raise(cError, "%"PRIsVALUE, msg);
+  }
+}
 
-  db->trace_block = Qnil;
+/* call-seq:
+ *   db.initialize(path)
+ *   db.initialize(path, frozen: true)
+ *   db.initialize(path, immutable: true)
+ *   db.initialize(path, io_stats: true)
+ *   db.initialize(path, on_fork: :reopen)
+ *   db.initialize(path, shared_cache: true)
+ *   db.initialize(path, thread_safe: true)
+ *   db.initialize(path, vfs: name)
+ *
+ * Initializes a new SQLite database with the given path. The following options
+ * are supported:
+ *
+ * - `frozen`: if true, all query results are deeply frozen, and are thus
+ *   shareable between Ractors.
+ * - `immutable`: if true, the database file is opened read-only, with the
+ *   `immutable` URI parameter, and is assumed not to change while open (see
+ *   `Extralite::Database.open_immutable`).
+ * - `io_stats`: if true, the database is opened using the `extralite-stats`
+ *   VFS, which collects I/O statistics (see `#io_stats`).
+ * - `on_fork`: determines what happens when the database is used in a process
+ *   forked from the process that opened it. By default (`:raise`), an
+ *   `Extralite::Error` is raised. When set to `:reopen`, the database is
+ *   transparently reopened using the same path and options. In both cases the
+ *   inherited connection is dropped without being closed.
+ * - `shared_cache`: if true, the database is opened in SQLite's shared-cache
+ *   mode, in which all connections to the same file in the process that were
+ *   opened with this option share a single page cache. This is useful for
+ *   pools of connections to read-mostly databases (see
+ *   `Extralite.soft_heap_limit=` for limiting the total memory used).
+ * - `thread_safe`: if true, the database can be safely shared between
+ *   threads. Queries, statement preparation and closing are serialized using
+ *   a lock held while binding parameters, stepping through results and
+ *   converting rows. The underlying connection is opened in SQLite's
+ *   multi-thread mode, avoiding the overhead of SQLite's internal locking.
+ * - `vfs`: the name of the SQLite VFS to use for opening the database, e.g.
+ *   `"extralite-uring"` (see `Extralite.io_uring_available?`).
+ */
+
+VALUE Database_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE path;
+  VALUE opts;
+  Database_t *db;
+  GetDatabase(self, db);
+
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  if (opts != Qnil) {
+    Check_Type(opts, T_HASH);
+    db->freeze_results = RTEST(rb_hash_aref(opts, SYM_frozen));
+    db->reopen_on_fork = rb_hash_aref(opts, SYM_on_fork) == SYM_reopen;
+    if (RTEST(rb_hash_aref(opts, SYM_thread_safe))) db->lock = rb_mutex_new();
+    db->shared_cache = RTEST(rb_hash_aref(opts, SYM_shared_cache));
+    db->immutable = RTEST(rb_hash_aref(opts, SYM_immutable));
+
+    VALUE vfs = rb_hash_aref(opts, SYM_vfs);
+    if (RTEST(rb_hash_aref(opts, SYM_io_stats))) {
+      if (vfs != Qnil) rb_raise(rb_eArgError, "The io_stats option cannot be combined with the vfs option");
+      vfs = rb_str_new_literal("extralite-stats");
+    }
+    if (vfs != Qnil) {
+      db->vfs = rb_str_new_frozen(rb_funcall(vfs, ID_to_s, 0));
+      if (!sqlite3_vfs_find(StringValueCStr(db->vfs)))
+        rb_raise(cError, "Unknown VFS: %"PRIsVALUE, db->vfs);
+    }
+  }
+
+  db->path = rb_str_new_frozen(path);
+  StringValueCStr(db->path);
+  Database_open(db);
+
+  return Qnil;
+}
+
+static VALUE Database_close_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  int rc;
+
+  // an inherited connection is dropped without closing it
+  if (db->sqlite3_db && !DATABASE_INHERITED(db)) {
+    Database_finalize_schema_stmts(db);
+    rc = sqlite3_close_v2(db->sqlite3_db);
+    if (rc) {
+      rb_raise(cError, "%s", sqlite3_errmsg(db->sqlite3_db));
+    }
+  }
 
+  db->sqlite3_db = 0;
+  db->schema_version_stmts[0] = db->schema_version_stmts[1] = NULL;
+  db->schema_cache = Qnil;
   return Qnil;
 }
 
@@ -111,19 +446,38 @@ VALUE Database_initialize(VALUE self, VALUE path) {
  * Closes the database.
  */
 VALUE Database_close(VALUE self) {
-  int rc;
   Database_t *db;
   GetDatabase(self, db);
 
-  rc = sqlite3_close_v2(db->sqlite3_db);
-  if (rc) {
-    rb_raise(cError, "%s", sqlite3_errmsg(db->sqlite3_db));
-  }
-
-  db->sqlite3_db = 0;
+  Database_synchronize(db, Database_close_locked, (VALUE)db);
   return self;
 }
 
+/* call-seq:
+ *   db.frozen_results? -> bool
+ *
+ * Returns true if the database was opened with the `frozen: true` option, in
+ * which case query results are deeply frozen and shareable between Ractors.
+ */
+VALUE Database_frozen_results_p(VALUE self) {
+  Database_t *db;
+  GetDatabase(self, db);
+
+  return db->freeze_results ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *   db.thread_safe? -> bool
+ *
+ * Returns true if the database was opened with the `thread_safe: true` option.
+ */
+VALUE Database_thread_safe_p(VALUE self) {
+  Database_t *db;
+  GetDatabase(self, db);
+
+  return db->lock != Qnil ? Qtrue : Qfalse;
+}
+
 /* call-seq:
  *   db.closed? -> bool
  *
@@ -138,9 +492,197 @@ VALUE Database_closed_p(VALUE self) {
   return db->sqlite3_db ? Qfalse : Qtrue;
 }
 
-static inline VALUE Database_perform_query(int argc, VALUE *argv, VALUE self, VALUE (*call)(query_ctx *)) {
+typedef struct {
+  VALUE self;
   Database_t *db;
+  VALUE sql;
+  int argc;
+  VALUE *argv;
+  VALUE params;
+  VALUE (*call)(query_ctx *);
+  int freeze;
+} perform_query_args;
+
+/*
+The scan report aggregates the full scan step, sort and automatic index counters
+of all statements run on the database, keyed by SQL. Counters are harvested
+when an ad-hoc statement is finalized, and after each run of a prepared
+statement. Since prepared statement counters are not reset (so as not to
+interfere with PreparedStatement#status), the last harvested values are kept in
+the prepared statement, and only the difference is added to the report.
+Statements with no full scan steps, sorts or automatic indexes are not recorded.
+*/
+
+#define SCAN_REPORT_MAX_ENTRIES 1000
+
+static const int scan_status_ops[3] = {
+  SQLITE_STMTSTATUS_FULLSCAN_STEP,
+  SQLITE_STMTSTATUS_SORT,
+  SQLITE_STMTSTATUS_AUTOINDEX
+};
+
+// Reads the scan counters of the given statement into deltas. This does not
+// allocate Ruby objects, and can therefore be safely called in ensure paths
+// before the statement is reset or finalized. Returns true if any of the
+// counters has changed.
+int Database_sample_scan_status(sqlite3_stmt *stmt, int *last, int *deltas) {
+  int any = 0;
+
+  for (int i = 0; i < 3; i++) {
+    int value = sqlite3_stmt_status(stmt, scan_status_ops[i], 0);
+    // the counter might have been reset using PreparedStatement#status
+    deltas[i] = (last && value >= last[i]) ? value - last[i] : value;
+    if (last) last[i] = value;
+    if (deltas[i]) any = 1;
+  }
+  return any;
+}
+
+void Database_record_scan_status(Database_t *db, VALUE sql, int *deltas) {
+  if (db->scan_report == Qnil) db->scan_report = rb_hash_new();
+  VALUE entry = rb_hash_aref(db->scan_report, sql);
+  if (entry == Qnil) {
+    if (RHASH_SIZE(db->scan_report) >= SCAN_REPORT_MAX_ENTRIES) return;
+
+    entry = rb_ary_new_from_args(4, INT2FIX(0), INT2FIX(0), INT2FIX(0), INT2FIX(0));
+    rb_hash_aset(db->scan_report, sql, entry);
+  }
+  for (int i = 0; i < 3; i++)
+    rb_ary_store(entry, i, LL2NUM(NUM2LL(RARRAY_AREF(entry, i)) + deltas[i]));
+  rb_ary_store(entry, 3, LL2NUM(NUM2LL(RARRAY_AREF(entry, 3)) + 1));
+}
+
+void Database_harvest_scan_status(Database_t *db, sqlite3_stmt *stmt, int *last) {
+  int deltas[3];
+
+  if (Database_sample_scan_status(stmt, last, deltas))
+    Database_record_scan_status(db, rb_str_new_cstr(sqlite3_sql(stmt)), deltas);
+}
+
+// The statement is finalized before the scan report is updated, so that an
+// exception raised while allocating does not leak it. The SQL is copied using
+// the SQLite allocator, which does not raise.
+static VALUE Database_cleanup_stmt(query_ctx *ctx) {
+  int deltas[3];
+  char *sql = NULL;
+
+  if (ctx->stmt && Database_sample_scan_status(ctx->stmt, NULL, deltas))
+    sql = sqlite3_mprintf("%s", sqlite3_sql(ctx->stmt));
+  cleanup_stmt(ctx);
+  if (sql) {
+    VALUE str = rb_str_new_cstr(sql);
+    sqlite3_free(sql);
+    Database_record_scan_status(Database_struct(ctx->self), str, deltas);
+  }
+  return Qnil;
+}
+
+typedef struct {
+  VALUE sql;
+  long long counters[4];
+} scan_report_entry;
+
+typedef struct {
+  scan_report_entry *entries;
+  long count;
+} scan_report_ctx;
+
+static int scan_report_collect(VALUE sql, VALUE counters, VALUE ptr) {
+  scan_report_ctx *ctx = (scan_report_ctx *)ptr;
+  scan_report_entry *entry = ctx->entries + ctx->count++;
+
+  entry->sql = sql;
+  for (int i = 0; i < 4; i++) entry->counters[i] = NUM2LL(RARRAY_AREF(counters, i));
+  return ST_CONTINUE;
+}
+
+// orders entries by full scan steps, automatic indexes, then sorts, descending
+static int scan_report_compare(const void *a, const void *b) {
+  const long long *ca = ((const scan_report_entry *)a)->counters;
+  const long long *cb = ((const scan_report_entry *)b)->counters;
+  static const int order[3] = {0, 2, 1};
+
+  for (int i = 0; i < 3; i++) {
+    int idx = order[i];
+    if (ca[idx] != cb[idx]) return ca[idx] < cb[idx] ? 1 : -1;
+  }
+  return 0;
+}
+
+/* call-seq:
+ *   db.scan_report -> [...]
+ *   db.scan_report(limit) -> [...]
+ *
+ * Returns a report of the statements doing full table scans, sorts or using
+ * automatic indexes, which usually indicate a missing index. Counters are
+ * collected automatically for all statements run on the database, both ad-hoc
+ * and prepared, and aggregated by SQL. The report is an array of hashes with
+ * `:sql`, `:fullscan_steps`, `:sorts`, `:autoindexes` and `:runs` keys,
+ * ordered by full scan steps, automatic indexes and sorts, and optionally
+ * limited to the given number of entries. At most 1000 distinct statements are
+ * tracked.
+ */
+VALUE Database_scan_report(int argc, VALUE *argv, VALUE self) {
+  VALUE limit;
+  Database_t *db;
+
+  rb_scan_args(argc, argv, "01", &limit);
+  GetDatabase(self, db);
+
+  VALUE result = rb_ary_new();
+  if (db->scan_report == Qnil) return result;
+
+  VALUE report = rb_hash_dup(db->scan_report);
+  scan_report_ctx ctx = { ALLOCA_N(scan_report_entry, RHASH_SIZE(report)), 0 };
+  rb_hash_foreach(report, scan_report_collect, (VALUE)&ctx);
+  qsort(ctx.entries, ctx.count, sizeof(scan_report_entry), scan_report_compare);
+
+  long count = (limit == Qnil) ? ctx.count : NUM2LONG(limit);
+  if (count > ctx.count) count = ctx.count;
+  for (long i = 0; i < count; i++) {
+    scan_report_entry *entry = ctx.entries + i;
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("sql")), entry->sql);
+    rb_hash_aset(hash, ID2SYM(rb_intern("fullscan_steps")), LL2NUM(entry->counters[0]));
+    rb_hash_aset(hash, ID2SYM(rb_intern("sorts")), LL2NUM(entry->counters[1]));
+    rb_hash_aset(hash, ID2SYM(rb_intern("autoindexes")), LL2NUM(entry->counters[2]));
+    rb_hash_aset(hash, ID2SYM(rb_intern("runs")), LL2NUM(entry->counters[3]));
+    rb_ary_push(result, hash);
+  }
+
+  RB_GC_GUARD(report);
+  return result;
+}
+
+/* call-seq:
+ *   db.reset_scan_report -> db
+ *
+ * Clears the scan report.
+ */
+VALUE Database_reset_scan_report(VALUE self) {
+  Database_t *db;
+  GetDatabase(self, db);
+
+  db->scan_report = Qnil;
+  return self;
+}
+
+static VALUE Database_perform_query_locked(VALUE ptr) {
+  perform_query_args *args = (perform_query_args *)ptr;
+  Database_t *db = args->db;
   sqlite3_stmt *stmt;
+
+  CHECK_STILL_OPEN(db);
+  prepare_multi_stmt(db->sqlite3_db, &stmt, args->sql);
+
+  bind_all_parameters(stmt, args->argc, args->argv);
+  query_ctx ctx = { args->self, db->sqlite3_db, stmt, Qnil, args->freeze };
+
+  return rb_ensure(SAFE(args->call), (VALUE)&ctx, SAFE(Database_cleanup_stmt), (VALUE)&ctx);
+}
+
+static inline VALUE Database_perform_query(int argc, VALUE *argv, VALUE self, VALUE (*call)(query_ctx *)) {
+  Database_t *db;
   VALUE sql;
 
   // extract query from args
@@ -151,13 +693,11 @@ static inline VALUE Database_perform_query(int argc, VALUE *argv, VALUE self, VA
   // prepare query ctx
   GetOpenDatabase(self, db);
   if (db->trace_block != Qnil) rb_funcall(db->trace_block, ID_call, 1, sql);
-  prepare_multi_stmt(db->sqlite3_db, &stmt, sql);
-  RB_GC_GUARD(sql);
 
-  bind_all_parameters(stmt, argc - 1, argv + 1);
-  query_ctx ctx = { self, db->sqlite3_db, stmt };
-
-  return rb_ensure(SAFE(call), (VALUE)&ctx, SAFE(cleanup_stmt), (VALUE)&ctx);
+  perform_query_args args = { self, db, sql, argc - 1, argv + 1, Qnil, call, db->freeze_results };
+  VALUE result = Database_synchronize(db, Database_perform_query_locked, (VALUE)&args);
+  RB_GC_GUARD(sql);
+  return result;
 }
 
 /* call-seq:
@@ -212,6 +752,27 @@ VALUE Database_query_ary(int argc, VALUE *argv, VALUE self) {
   return Database_perform_query(argc, argv, self, safe_query_ary);
 }
 
+/* call-seq:
+ *   db.query_rows(sql, *parameters, &block) -> [...]
+ *
+ * Runs a query returning rows as `Extralite::Row` objects. If a block is given,
+ * it will be called for each row. Otherwise, an array containing all rows is
+ * returned.
+ *
+ * Row objects keep the raw column values in a compact buffer, and convert them
+ * to Ruby values only when accessed. This is useful for queries returning wide
+ * rows of which only a few columns are actually read:
+ *
+ *     row = db.query_rows('select * from foo where x = ?', 42).first
+ *     row[:y] #=> 43
+ *     row.to_h #=> { x: 42, y: 43, ... }
+ *
+ * Query parameters are specified in the same way as for `#query`.
+ */
+VALUE Database_query_rows(int argc, VALUE *argv, VALUE self) {
+  return Database_perform_query(argc, argv, self, safe_query_rows);
+}
+
 /* call-seq:
  *   db.query_single_row(sql, *parameters) -> {...}
  *
@@ -299,27 +860,286 @@ VALUE Database_query_single_value(int argc, VALUE *argv, VALUE self) {
  *     db.execute_multi_query('insert into foo values (?, ?, ?)', records)
  *
  */
+static VALUE Database_execute_multi_locked(VALUE ptr) {
+  perform_query_args *args = (perform_query_args *)ptr;
+  Database_t *db = args->db;
+  sqlite3_stmt *stmt;
+
+  CHECK_STILL_OPEN(db);
+  prepare_single_stmt(db->sqlite3_db, &stmt, args->sql);
+  query_ctx ctx = { args->self, db->sqlite3_db, stmt, args->params, db->freeze_results };
+
+  return rb_ensure(SAFE(safe_execute_multi), (VALUE)&ctx, SAFE(Database_cleanup_stmt), (VALUE)&ctx);
+}
+
 VALUE Database_execute_multi(VALUE self, VALUE sql, VALUE params_array) {
   Database_t *db;
-  sqlite3_stmt *stmt;
 
   if (RSTRING_LEN(sql) == 0) return Qnil;
 
   // prepare query ctx
   GetOpenDatabase(self, db);
-  prepare_single_stmt(db->sqlite3_db, &stmt, sql);
-  query_ctx ctx = { self, db->sqlite3_db, stmt, params_array };
+  perform_query_args args = { self, db, sql, 0, NULL, params_array, NULL, 0 };
+  return Database_synchronize(db, Database_execute_multi_locked, (VALUE)&args);
+}
 
-  return rb_ensure(SAFE(safe_execute_multi), (VALUE)&ctx, SAFE(cleanup_stmt), (VALUE)&ctx);
+/*
+The schema cache holds information about tables, columns, indexes and foreign
+keys, as well as the result columns of queries. The cache is divided into
+sections, each being a hash. Before each lookup the schema versions of the main
+and temp schemas are read using cached `PRAGMA schema_version` statements, and
+if either has changed the entire cache is discarded.
+*/
+
+static const char *schema_version_sql[2] = {
+  "pragma main.schema_version",
+  "pragma temp.schema_version"
+};
+
+static int Database_read_schema_version(Database_t *db, int idx) {
+  sqlite3_stmt **stmt = db->schema_version_stmts + idx;
+  int version = 0;
+
+  if (!*stmt)
+    prepare_single_stmt(db->sqlite3_db, stmt, rb_str_new_cstr(schema_version_sql[idx]));
+  else
+    sqlite3_reset(*stmt);
+
+  if (stmt_iterate(*stmt, db->sqlite3_db)) version = sqlite3_column_int(*stmt, 0);
+  sqlite3_reset(*stmt);
+  return version;
+}
+
+static VALUE Database_schema_cache_section(Database_t *db, VALUE section) {
+  int main_version = Database_read_schema_version(db, 0);
+  int temp_version = Database_read_schema_version(db, 1);
+
+  if (db->schema_cache == Qnil || main_version != db->schema_versions[0] || temp_version != db->schema_versions[1]) {
+    db->schema_cache = rb_hash_new();
+    db->schema_versions[0] = main_version;
+    db->schema_versions[1] = temp_version;
+  }
+
+  VALUE hash = rb_hash_aref(db->schema_cache, section);
+  if (hash == Qnil) {
+    hash = rb_hash_new();
+    rb_hash_aset(db->schema_cache, section, hash);
+  }
+  return hash;
+}
+
+// Runs a query for loading schema information. Results are always frozen, as
+// they are kept in the schema cache.
+static VALUE Database_schema_query(VALUE self, Database_t *db, VALUE sql, VALUE param, VALUE (*call)(query_ctx *)) {
+  perform_query_args args = { self, db, sql, param == Qundef ? 0 : 1, &param, Qnil, call, 1 };
+  VALUE result = Database_perform_query_locked((VALUE)&args);
+  RB_GC_GUARD(sql);
+  return result;
+}
+
+typedef struct {
+  VALUE self;
+  Database_t *db;
+  VALUE section;
+  VALUE key;
+  VALUE (*load)(VALUE self, Database_t *db, VALUE key);
+  long max_entries;
+} schema_lookup_args;
+
+// Looks up the given key in the given schema cache section, loading it on a
+// miss. If max_entries is non-zero, the section is kept as an LRU of at most
+// max_entries keys, relying on the insertion order of Ruby hashes.
+static VALUE Database_schema_lookup_locked(VALUE ptr) {
+  schema_lookup_args *args = (schema_lookup_args *)ptr;
+
+  CHECK_STILL_OPEN(args->db);
+  VALUE section = Database_schema_cache_section(args->db, args->section);
+  VALUE value = rb_hash_lookup2(section, args->key, Qundef);
+  if (value != Qundef) {
+    if (!args->max_entries) return value;
+
+    // move the key to the end of the hash, marking it as most recently used
+    rb_hash_delete(section, args->key);
+  }
+  else {
+    value = args->load(args->self, args->db, args->key);
+    if (args->max_entries && RHASH_SIZE(section) >= (size_t)args->max_entries)
+      rb_funcall(section, ID_shift, 0);
+  }
+  rb_hash_aset(section, args->key, value);
+  return value;
+}
+
+static VALUE Database_schema_lookup(VALUE self, VALUE section, VALUE key, VALUE (*load)(VALUE, Database_t *, VALUE), long max_entries) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+
+  schema_lookup_args args = { self, db, section, key, load, max_entries };
+  return Database_synchronize(db, Database_schema_lookup_locked, (VALUE)&args);
+}
+
+static inline VALUE table_name_param(VALUE table) {
+  if (SYMBOL_P(table)) return rb_sym2str(table);
+  StringValue(table);
+  return table;
+}
+
+#define TABLES_SQL \
+  "select name from sqlite_master where type = 'table' and name not like 'sqlite_%'"
+
+static VALUE Database_load_tables(VALUE self, Database_t *db, VALUE key) {
+  return Database_schema_query(self, db, rb_str_new_literal(TABLES_SQL), Qundef, safe_query_single_column);
 }
 
+/* call-seq:
+ *   db.tables -> [...]
+ *
+ * Returns the list of tables defined in the main schema. The result is served
+ * from the schema cache.
+ *
+ * @return [Array] list of tables
+ */
+VALUE Database_tables(VALUE self) {
+  return rb_ary_dup(Database_schema_lookup(self, SYM_tables, Qnil, Database_load_tables, 0));
+}
+
+// The query is prepared as a single statement, so it is never run.
+static VALUE Database_load_columns(VALUE self, Database_t *db, VALUE sql) {
+  sqlite3_stmt *stmt;
+
+  sql = rb_funcall(sql, ID_strip, 0);
+  if (RSTRING_LEN(sql) == 0) return Qnil;
+
+  prepare_single_stmt(db->sqlite3_db, &stmt, sql);
+  query_ctx ctx = { self, db->sqlite3_db, stmt, Qnil, 1 };
+  VALUE columns = rb_ensure(SAFE(safe_query_columns), (VALUE)&ctx, SAFE(Database_cleanup_stmt), (VALUE)&ctx);
+  RB_GC_GUARD(sql);
+  return columns;
+}
+
+// Maximum number of queries whose columns are kept in the schema cache
+#define COLUMNS_CACHE_SIZE 256
+
 /* call-seq:
  *   db.columns(sql) -> columns
  *
- * Returns the column names for the given query, without running it.
+ * Returns the column names for the given query, without running it. The result
+ * is served from the schema cache, so the query is only prepared the first
+ * time, or after the schema has changed. The columns of at most 256 distinct
+ * queries are cached, the least recently used being evicted first.
  */
 VALUE Database_columns(VALUE self, VALUE sql) {
-  return Database_perform_query(1, &sql, self, safe_query_columns);
+  StringValue(sql);
+  VALUE columns = Database_schema_lookup(self, SYM_columns, sql, Database_load_columns, COLUMNS_CACHE_SIZE);
+  return columns == Qnil ? Qnil : rb_ary_dup(columns);
+}
+
+static VALUE Database_load_table_info(VALUE self, Database_t *db, VALUE table) {
+  // table_xinfo includes hidden and generated columns
+  VALUE sql = (sqlite3_libversion_number() >= 3026000) ?
+    rb_str_new_literal("select * from pragma_table_xinfo(?)") :
+    rb_str_new_literal("select * from pragma_table_info(?)");
+  return Database_schema_query(self, db, sql, table, safe_query_hash);
+}
+
+/* call-seq:
+ *   db.table_info(table) -> [...]
+ *
+ * Returns information about the columns of the given table, as an array of
+ * hashes with `:cid`, `:name`, `:type`, `:notnull`, `:dflt_value` and `:pk`
+ * (and `:hidden` on SQLite 3.26 and newer) keys. The result is served from the
+ * schema cache, and is frozen.
+ */
+VALUE Database_table_info(VALUE self, VALUE table) {
+  return Database_schema_lookup(self, SYM_table_info, table_name_param(table), Database_load_table_info, 0);
+}
+
+#define INDEXES_SQL \
+  "select il.name, il.\"unique\", il.origin, il.partial, ii.name " \
+  "from pragma_index_list(?1) il join pragma_index_info(il.name) ii " \
+  "order by il.seq, ii.seqno"
+
+static VALUE Database_load_indexes(VALUE self, Database_t *db, VALUE table) {
+  VALUE rows = Database_schema_query(self, db, rb_str_new_literal(INDEXES_SQL), table, safe_query_ary);
+  VALUE indexes = rb_ary_new();
+  VALUE index = Qnil;
+  VALUE columns = Qnil;
+  VALUE last_name = Qnil;
+
+  long len = RARRAY_LEN(rows);
+  for (long i = 0; i < len; i++) {
+    VALUE row = RARRAY_AREF(rows, i);
+    VALUE name = RARRAY_AREF(row, 0);
+    if (index == Qnil || !rb_str_equal(name, last_name)) {
+      if (index != Qnil) rb_obj_freeze(columns);
+      columns = rb_ary_new();
+      index = rb_hash_new();
+      rb_hash_aset(index, ID2SYM(rb_intern("name")), name);
+      rb_hash_aset(index, ID2SYM(rb_intern("unique")), RARRAY_AREF(row, 1) == INT2FIX(1) ? Qtrue : Qfalse);
+      rb_hash_aset(index, ID2SYM(rb_intern("origin")), RARRAY_AREF(row, 2));
+      rb_hash_aset(index, ID2SYM(rb_intern("partial")), RARRAY_AREF(row, 3) == INT2FIX(1) ? Qtrue : Qfalse);
+      rb_hash_aset(index, ID2SYM(rb_intern("columns")), columns);
+      rb_ary_push(indexes, rb_obj_freeze(index));
+      last_name = name;
+    }
+    rb_ary_push(columns, RARRAY_AREF(row, 4));
+  }
+  if (columns != Qnil) rb_obj_freeze(columns);
+
+  RB_GC_GUARD(rows);
+  return rb_obj_freeze(indexes);
+}
+
+/* call-seq:
+ *   db.indexes(table) -> [...]
+ *
+ * Returns the indexes defined on the given table, as an array of hashes with
+ * `:name`, `:unique`, `:origin`, `:partial` and `:columns` keys. The result is
+ * served from the schema cache, and is frozen.
+ */
+VALUE Database_indexes(VALUE self, VALUE table) {
+  return Database_schema_lookup(self, SYM_indexes, table_name_param(table), Database_load_indexes, 0);
+}
+
+static VALUE Database_load_foreign_keys(VALUE self, Database_t *db, VALUE table) {
+  VALUE sql = rb_str_new_literal("select * from pragma_foreign_key_list(?)");
+  return Database_schema_query(self, db, sql, table, safe_query_hash);
+}
+
+/* call-seq:
+ *   db.foreign_keys(table) -> [...]
+ *
+ * Returns the foreign keys defined on the given table, as an array of hashes
+ * with `:id`, `:seq`, `:table`, `:from`, `:to`, `:on_update`, `:on_delete`
+ * and `:match` keys. The result is served from the schema cache, and is frozen.
+ */
+VALUE Database_foreign_keys(VALUE self, VALUE table) {
+  return Database_schema_lookup(self, SYM_foreign_keys, table_name_param(table), Database_load_foreign_keys, 0);
+}
+
+static VALUE Database_schema_version_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return INT2NUM(Database_read_schema_version(db, 0));
+}
+
+/* call-seq:
+ *   db.schema_version -> version
+ *
+ * Returns the schema version of the main schema, which is incremented by
+ * SQLite whenever the schema changes.
+ */
+VALUE Database_schema_version(VALUE self) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+
+  return Database_synchronize(db, Database_schema_version_locked, (VALUE)db);
+}
+
+static VALUE Database_last_insert_rowid_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return INT2FIX(sqlite3_last_insert_rowid(db->sqlite3_db));
 }
 
 /* call-seq:
@@ -331,7 +1151,13 @@ VALUE Database_last_insert_rowid(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  return INT2FIX(sqlite3_last_insert_rowid(db->sqlite3_db));
+  return Database_synchronize(db, Database_last_insert_rowid_locked, (VALUE)db);
+}
+
+static VALUE Database_changes_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return INT2FIX(sqlite3_changes(db->sqlite3_db));
 }
 
 /* call-seq:
@@ -343,7 +1169,19 @@ VALUE Database_changes(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  return INT2FIX(sqlite3_changes(db->sqlite3_db));
+  return Database_synchronize(db, Database_changes_locked, (VALUE)db);
+}
+
+typedef struct {
+  Database_t *db;
+  const char *db_name;
+} filename_ctx;
+
+static VALUE Database_filename_locked(VALUE ptr) {
+  filename_ctx *ctx = (filename_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+  const char *filename = sqlite3_db_filename(ctx->db->sqlite3_db, ctx->db_name);
+  return filename ? rb_str_new_cstr(filename) : Qnil;
 }
 
 /* call-seq:
@@ -352,15 +1190,20 @@ VALUE Database_changes(VALUE self) {
  * Returns the database filename.
  */
 VALUE Database_filename(int argc, VALUE *argv, VALUE self) {
-  const char *db_name;
-  const char *filename;
   Database_t *db;
   GetOpenDatabase(self, db);
 
   rb_check_arity(argc, 0, 1);
-  db_name = (argc == 1) ? StringValueCStr(argv[0]) : "main";
-  filename = sqlite3_db_filename(db->sqlite3_db, db_name);
-  return filename ? rb_str_new_cstr(filename) : Qnil;
+  filename_ctx ctx = { db, (argc == 1) ? StringValueCStr(argv[0]) : "main" };
+  VALUE result = Database_synchronize(db, Database_filename_locked, (VALUE)&ctx);
+  if (argc == 1) RB_GC_GUARD(argv[0]);
+  return result;
+}
+
+static VALUE Database_transaction_active_p_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return sqlite3_get_autocommit(db->sqlite3_db) ? Qfalse : Qtrue;
 }
 
 /* call-seq:
@@ -372,27 +1215,40 @@ VALUE Database_transaction_active_p(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  return sqlite3_get_autocommit(db->sqlite3_db) ? Qfalse : Qtrue;
+  return Database_synchronize(db, Database_transaction_active_p_locked, (VALUE)db);
 }
 
 #ifdef HAVE_SQLITE3_LOAD_EXTENSION
-/* call-seq:
- *   db.load_extension(path) -> db
- *
- * Loads an extension with the given path.
- */
-VALUE Database_load_extension(VALUE self, VALUE path) {
+typedef struct {
   Database_t *db;
-  GetOpenDatabase(self, db);
+  VALUE path;
+} load_extension_ctx;
+
+static VALUE Database_load_extension_locked(VALUE ptr) {
+  load_extension_ctx *ctx = (load_extension_ctx *)ptr;
   char *err_msg;
+  CHECK_STILL_OPEN(ctx->db);
 
-  int rc = sqlite3_load_extension(db->sqlite3_db, RSTRING_PTR(path), 0, &err_msg);
+  int rc = sqlite3_load_extension(ctx->db->sqlite3_db, StringValueCStr(ctx->path), 0, &err_msg);
   if (rc != SQLITE_OK) {
     VALUE error = rb_exc_new2(cError, err_msg);
     sqlite3_free(err_msg);
     rb_exc_raise(error);
   }
+  return Qnil;
+}
 
+/* call-seq:
+ *   db.load_extension(path) -> db
+ *
+ * Loads an extension with the given path.
+ */
+VALUE Database_load_extension(VALUE self, VALUE path) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+
+  load_extension_ctx ctx = { db, path };
+  Database_synchronize(db, Database_load_extension_locked, (VALUE)&ctx);
   return self;
 }
 #endif
@@ -500,6 +1356,34 @@ VALUE backup_cleanup(VALUE ptr) {
  * count, which can be used to display the progress to the user or to collect
  * statistics.
  */
+typedef struct {
+  Database_t *src;
+  sqlite3 *dst_db;
+  int dst_is_fn;
+  VALUE src_name;
+  VALUE dst_name;
+} backup_args;
+
+static VALUE Database_backup_locked(VALUE ptr) {
+  backup_args *args = (backup_args *)ptr;
+
+  CHECK_STILL_OPEN(args->src);
+
+  // TODO: add possibility to use different src and dest db names (main, tmp, or
+  // attached db's).
+  sqlite3_backup *backup;
+  backup = sqlite3_backup_init(args->dst_db, StringValueCStr(args->dst_name), args->src->sqlite3_db, StringValueCStr(args->src_name));
+  if (!backup) {
+    VALUE msg = rb_str_new_cstr(sqlite3_errmsg(args->dst_db));
+    if (args->dst_is_fn)
+      sqlite3_close_v2(args->dst_db);
+    rb_raise(cError, "%"PRIsVALUE, msg);
+  }
+
+  backup_ctx ctx = { args->dst_db, args->dst_is_fn, backup, rb_block_given_p(), 0 };
+  return rb_ensure(SAFE(backup_safe_iterate), (VALUE)&ctx, SAFE(backup_cleanup), (VALUE)&ctx);
+}
+
 VALUE Database_backup(int argc, VALUE *argv, VALUE self) {
   VALUE dst;
   VALUE src_name;
@@ -518,7 +1402,7 @@ VALUE Database_backup(int argc, VALUE *argv, VALUE self) {
     int rc = sqlite3_open(StringValueCStr(dst), &dst_db);
     if (rc) {
       sqlite3_close_v2(dst_db);
-      rb_raise(cError, "%s", sqlite3_errmsg(dst_db));
+      rb_raise(cError, "%s", sqlite3_errstr(rc));
     }
   }
   else {
@@ -527,18 +1411,10 @@ VALUE Database_backup(int argc, VALUE *argv, VALUE self) {
     dst_db = dst_struct->sqlite3_db;
   }
 
-  // TODO: add possibility to use different src and dest db names (main, tmp, or
-  // attached db's).
-  sqlite3_backup *backup;
-  backup = sqlite3_backup_init(dst_db, StringValueCStr(dst_name), src->sqlite3_db, StringValueCStr(src_name));
-  if (!backup) {
-    if (dst_is_fn)
-      sqlite3_close_v2(dst_db);
-    rb_raise(cError, "%s", sqlite3_errmsg(dst_db));
-  }
-
-  backup_ctx ctx = { dst_db, dst_is_fn, backup, rb_block_given_p(), 0 };
-  rb_ensure(SAFE(backup_safe_iterate), (VALUE)&ctx, SAFE(backup_cleanup), (VALUE)&ctx);
+  backup_args args = { src, dst_db, dst_is_fn, src_name, dst_name };
+  Database_synchronize(src, Database_backup_locked, (VALUE)&args);
+  RB_GC_GUARD(src_name);
+  RB_GC_GUARD(dst_name);
 
   return self;
 }
@@ -562,6 +1438,73 @@ VALUE Extralite_runtime_status(int argc, VALUE* argv, VALUE self) {
   return rb_ary_new3(2, LONG2FIX(cur), LONG2FIX(hwm));
 }
 
+/* call-seq:
+ *   Extralite.soft_heap_limit -> limit
+ *
+ * Returns the process-wide soft heap limit in bytes (0 means no limit).
+ */
+VALUE Extralite_soft_heap_limit(VALUE self) {
+  return LL2NUM(sqlite3_soft_heap_limit64(-1));
+}
+
+/* call-seq:
+ *   Extralite.soft_heap_limit = limit
+ *
+ * Sets the process-wide soft heap limit in bytes (0 for no limit). When the
+ * memory used by SQLite exceeds the limit, least recently used pages are
+ * evicted from the page caches of all connections (or from the shared page
+ * cache for databases opened with `shared_cache: true`).
+ */
+VALUE Extralite_soft_heap_limit_set(VALUE self, VALUE limit) {
+  sqlite3_int64 value = NUM2LL(limit);
+  if (value < 0) rb_raise(rb_eArgError, "Invalid heap limit");
+
+  sqlite3_soft_heap_limit64(value);
+  return limit;
+}
+
+#ifdef HAVE_SQLITE3_HARD_HEAP_LIMIT64
+/* call-seq:
+ *   Extralite.hard_heap_limit -> limit
+ *
+ * Returns the process-wide hard heap limit in bytes (0 means no limit).
+ */
+VALUE Extralite_hard_heap_limit(VALUE self) {
+  return LL2NUM(sqlite3_hard_heap_limit64(-1));
+}
+
+/* call-seq:
+ *   Extralite.hard_heap_limit = limit
+ *
+ * Sets the process-wide hard heap limit in bytes (0 for no limit). Memory
+ * allocations by SQLite that would exceed the limit fail.
+ */
+VALUE Extralite_hard_heap_limit_set(VALUE self, VALUE limit) {
+  sqlite3_int64 value = NUM2LL(limit);
+  if (value < 0) rb_raise(rb_eArgError, "Invalid heap limit");
+
+  sqlite3_hard_heap_limit64(value);
+  return limit;
+}
+#endif
+
+typedef struct {
+  Database_t *db;
+  int op;
+  int reset;
+} status_ctx;
+
+static VALUE Database_status_locked(VALUE ptr) {
+  status_ctx *ctx = (status_ctx *)ptr;
+  int cur, hwm;
+  CHECK_STILL_OPEN(ctx->db);
+
+  int rc = sqlite3_db_status(ctx->db->sqlite3_db, ctx->op, &cur, &hwm, ctx->reset);
+  if (rc != SQLITE_OK) rb_raise(cError, "%s", sqlite3_errstr(rc));
+
+  return rb_ary_new3(2, INT2NUM(cur), INT2NUM(hwm));
+}
+
 /* call-seq:
  *   db.status(op[, reset]) -> [value, highwatermark]
  *
@@ -571,17 +1514,281 @@ VALUE Extralite_runtime_status(int argc, VALUE* argv, VALUE self) {
  */
 VALUE Database_status(int argc, VALUE *argv, VALUE self) {
   VALUE op, reset;
-  int cur, hwm;
 
   rb_scan_args(argc, argv, "11", &op, &reset);
 
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  int rc = sqlite3_db_status(db->sqlite3_db, NUM2INT(op), &cur, &hwm, RTEST(reset) ? 1 : 0);
-  if (rc != SQLITE_OK) rb_raise(cError, "%s", sqlite3_errstr(rc));
+  status_ctx ctx = { db, NUM2INT(op), RTEST(reset) ? 1 : 0 };
+  return Database_synchronize(db, Database_status_locked, (VALUE)&ctx);
+}
 
-  return rb_ary_new3(2, INT2NUM(cur), INT2NUM(hwm));
+/*
+The space usage report is computed from the dbstat virtual table. All rows are
+stepped through and aggregated into a C array of per-object entries in a single
+GVL-free call, and only then converted into Ruby hashes. dbstat visits pages of
+each b-tree in logical order, so the fragmentation score is the ratio of leaf
+pages that do not immediately follow the previous leaf page in the file.
+*/
+
+typedef struct {
+  char *name;
+  long pages;
+  long leaf_pages;
+  long gaps;
+  int last_leaf;
+  sqlite3_int64 payload;
+  sqlite3_int64 unused;
+  sqlite3_int64 size;
+} space_usage_entry;
+
+typedef struct {
+  Database_t *db;
+  VALUE sql;
+  VALUE schema;
+  sqlite3_stmt *stmt;
+  space_usage_entry *entries;
+  int count;
+  int capacity;
+  int rc;
+} space_usage_ctx;
+
+#define SPACE_USAGE_SQL \
+  "select name, pageno, pagetype, payload, unused, pgsize from dbstat(?)"
+
+static void *space_usage_step_without_gvl(void *ptr) {
+  space_usage_ctx *ctx = (space_usage_ctx *)ptr;
+  space_usage_entry *entry = NULL;
+
+  while ((ctx->rc = sqlite3_step(ctx->stmt)) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(ctx->stmt, 0);
+    if (!entry || strcmp(entry->name, name)) {
+      if (ctx->count == ctx->capacity) {
+        int capacity = ctx->capacity ? ctx->capacity * 2 : 16;
+        space_usage_entry *entries = realloc(ctx->entries, capacity * sizeof(space_usage_entry));
+        if (!entries) {
+          ctx->rc = SQLITE_NOMEM;
+          return NULL;
+        }
+        ctx->entries = entries;
+        ctx->capacity = capacity;
+      }
+      entry = ctx->entries + ctx->count;
+      memset(entry, 0, sizeof(space_usage_entry));
+      entry->name = strdup(name);
+      ctx->count++;
+      if (!entry->name) {
+        ctx->rc = SQLITE_NOMEM;
+        return NULL;
+      }
+    }
+
+    int pageno = sqlite3_column_int(ctx->stmt, 1);
+    const char *type = (const char *)sqlite3_column_text(ctx->stmt, 2);
+    entry->pages++;
+    entry->payload += sqlite3_column_int64(ctx->stmt, 3);
+    entry->unused += sqlite3_column_int64(ctx->stmt, 4);
+    entry->size += sqlite3_column_int64(ctx->stmt, 5);
+    if (type && !strcmp(type, "leaf")) {
+      if (entry->leaf_pages && pageno != entry->last_leaf + 1) entry->gaps++;
+      entry->leaf_pages++;
+      entry->last_leaf = pageno;
+    }
+  }
+  return NULL;
+}
+
+static void space_usage_ubf(void *ptr) {
+  space_usage_ctx *ctx = (space_usage_ctx *)ptr;
+  sqlite3_interrupt(ctx->db->sqlite3_db);
+}
+
+static VALUE space_usage_collect(VALUE ptr) {
+  space_usage_ctx *ctx = (space_usage_ctx *)ptr;
+
+  CHECK_STILL_OPEN(ctx->db);
+  prepare_single_stmt(ctx->db->sqlite3_db, &ctx->stmt, ctx->sql);
+  sqlite3_bind_text(ctx->stmt, 1, RSTRING_PTR(ctx->schema), RSTRING_LEN(ctx->schema), SQLITE_TRANSIENT);
+
+  rb_thread_call_without_gvl(space_usage_step_without_gvl, (void *)ctx, space_usage_ubf, (void *)ctx);
+  switch (ctx->rc) {
+    case SQLITE_DONE:
+      break;
+    case SQLITE_NOMEM:
+      rb_raise(rb_eNoMemError, "Failed to allocate space usage entries");
+    case SQLITE_INTERRUPT:
+      rb_raise(cInterruptError, "Query was interrupted");
+    default:
+      rb_raise(cSQLError, "%s", sqlite3_errmsg(ctx->db->sqlite3_db));
+  }
+
+  VALUE result = rb_ary_new2(ctx->count);
+  for (int i = 0; i < ctx->count; i++) {
+    space_usage_entry *entry = ctx->entries + i;
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("name")), rb_str_new_cstr(entry->name));
+    rb_hash_aset(hash, ID2SYM(rb_intern("pages")), LONG2NUM(entry->pages));
+    rb_hash_aset(hash, ID2SYM(rb_intern("payload")), LL2NUM(entry->payload));
+    rb_hash_aset(hash, ID2SYM(rb_intern("unused")), LL2NUM(entry->unused));
+    rb_hash_aset(hash, ID2SYM(rb_intern("size")), LL2NUM(entry->size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("fragmentation")),
+      DBL2NUM(entry->leaf_pages > 1 ? (double)entry->gaps / (entry->leaf_pages - 1) : 0.0));
+    rb_ary_push(result, hash);
+  }
+  return result;
+}
+
+static VALUE space_usage_cleanup(VALUE ptr) {
+  space_usage_ctx *ctx = (space_usage_ctx *)ptr;
+
+  if (ctx->stmt) sqlite3_finalize(ctx->stmt);
+  for (int i = 0; i < ctx->count; i++) free(ctx->entries[i].name);
+  free(ctx->entries);
+  return Qnil;
+}
+
+static VALUE Database_space_usage_locked(VALUE ptr) {
+  return rb_ensure(SAFE(space_usage_collect), ptr, SAFE(space_usage_cleanup), ptr);
+}
+
+/* call-seq:
+ *   db.space_usage -> [...]
+ *   db.space_usage(schema) -> [...]
+ *
+ * Returns a space usage report for all tables and indexes in the given schema
+ * (`"main"` by default), as an array of hashes with the following keys:
+ *
+ * - `:name`: table or index name.
+ * - `:pages`: total number of pages used (including overflow pages).
+ * - `:payload`: number of bytes of payload stored.
+ * - `:unused`: number of unused bytes in the used pages.
+ * - `:size`: total size in bytes of the used pages.
+ * - `:fragmentation`: ratio of leaf pages that are not stored directly after
+ *   the preceding leaf page (0.0 for a perfectly sequential b-tree).
+ *
+ * The report is computed without holding the GVL. This method requires SQLite
+ * to be compiled with the dbstat virtual table (which is the case for the
+ * bundled SQLite), otherwise an `Extralite::SQLError` is raised.
+ */
+VALUE Database_space_usage(int argc, VALUE *argv, VALUE self) {
+  VALUE schema;
+  Database_t *db;
+
+  rb_scan_args(argc, argv, "01", &schema);
+  schema = (schema == Qnil) ? rb_str_new_literal("main") : rb_funcall(schema, ID_to_s, 0);
+  GetOpenDatabase(self, db);
+
+  space_usage_ctx ctx = { db, rb_str_new_literal(SPACE_USAGE_SQL), schema, NULL, NULL, 0, 0, 0 };
+  VALUE result = Database_synchronize(db, Database_space_usage_locked, (VALUE)&ctx);
+  RB_GC_GUARD(ctx.sql);
+  RB_GC_GUARD(schema);
+  return result;
+}
+
+#define WARM_FILE_CHUNK_SIZE (1 << 20)
+
+typedef struct {
+  Database_t *db;
+  int wal;
+  sqlite3_file *file;
+  char *buf;
+  sqlite3_int64 size;
+  sqlite3_int64 ofs;
+  int len;
+  int rc;
+} warm_file_ctx;
+
+static void *warm_file_read_without_gvl(void *ptr) {
+  warm_file_ctx *ctx = (warm_file_ctx *)ptr;
+  ctx->rc = ctx->file->pMethods->xRead(ctx->file, ctx->buf, ctx->len, ctx->ofs);
+  return NULL;
+}
+
+static VALUE warm_file_read(VALUE ptr) {
+  warm_file_ctx *ctx = (warm_file_ctx *)ptr;
+  int yield_to_block = rb_block_given_p();
+
+  while (ctx->ofs < ctx->size) {
+    ctx->len = (ctx->size - ctx->ofs) > WARM_FILE_CHUNK_SIZE ? WARM_FILE_CHUNK_SIZE : (int)(ctx->size - ctx->ofs);
+    rb_thread_call_without_gvl(warm_file_read_without_gvl, (void *)ctx, RUBY_UBF_IO, 0);
+    // a short read means the file was truncated in the meantime
+    if (ctx->rc == SQLITE_IOERR_SHORT_READ) break;
+    if (ctx->rc != SQLITE_OK) rb_raise(cError, "%s", sqlite3_errstr(ctx->rc));
+
+    ctx->ofs += ctx->len;
+    if (yield_to_block) rb_yield(LL2NUM(ctx->ofs));
+    rb_thread_check_ints();
+  }
+  return LL2NUM(ctx->ofs);
+}
+
+static VALUE warm_file_cleanup(VALUE ptr) {
+  warm_file_ctx *ctx = (warm_file_ctx *)ptr;
+  free(ctx->buf);
+  return Qnil;
+}
+
+// The file is read through the file object opened by SQLite, since opening and
+// then closing another file descriptor for the same file would release the
+// POSIX locks held by the process on it.
+static VALUE Database_warm_file_locked(VALUE ptr) {
+  warm_file_ctx *ctx = (warm_file_ctx *)ptr;
+  sqlite3 *db = ctx->db->sqlite3_db;
+
+  CHECK_STILL_OPEN(ctx->db);
+  int op = ctx->wal ? SQLITE_FCNTL_JOURNAL_POINTER : SQLITE_FCNTL_FILE_POINTER;
+  if (sqlite3_file_control(db, "main", op, &ctx->file) != SQLITE_OK || !ctx->file || !ctx->file->pMethods)
+    return INT2FIX(0);
+  if (ctx->file->pMethods->xFileSize(ctx->file, &ctx->size) != SQLITE_OK || !ctx->size)
+    return INT2FIX(0);
+
+#ifdef HAVE_POSIX_FADVISE
+  // hint the kernel to prefetch the whole file
+  sqlite3_vfs *vfs = NULL;
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+  int fd = unix_file_fd(vfs, ctx->file);
+  if (fd >= 0) posix_fadvise(fd, 0, ctx->size, POSIX_FADV_WILLNEED);
+#endif
+
+  ctx->buf = malloc(WARM_FILE_CHUNK_SIZE);
+  if (!ctx->buf) rb_raise(rb_eNoMemError, "Failed to allocate read buffer");
+
+  return rb_ensure(SAFE(warm_file_read), (VALUE)ctx, SAFE(warm_file_cleanup), (VALUE)ctx);
+}
+
+/* call-seq:
+ *   db.warm_file(wal) -> bytes
+ *   db.warm_file(wal) { |bytes| ... } -> bytes
+ *
+ * Reads the main database file (or the WAL file if `wal` is true) sequentially
+ * in order to load it into the OS page cache. Reading is done in 1MB chunks,
+ * without holding the GVL. If a block is given, it is called after each chunk
+ * with the number of bytes read so far. Returns 0 if the file is not open. Used
+ * by `Database#warm`.
+ */
+static VALUE Database_warm_file(VALUE self, VALUE wal) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+
+  warm_file_ctx ctx = { db, RTEST(wal), NULL, NULL, 0, 0, 0, SQLITE_OK };
+  return Database_synchronize(db, Database_warm_file_locked, (VALUE)&ctx);
+}
+
+typedef struct {
+  Database_t *db;
+  int category;
+  int value;
+} limit_ctx;
+
+static VALUE Database_limit_locked(VALUE ptr) {
+  limit_ctx *ctx = (limit_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+
+  int value = sqlite3_limit(ctx->db->sqlite3_db, ctx->category, ctx->value);
+  if (value == -1) rb_raise(cError, "Invalid limit category");
+
+  return INT2NUM(value);
 }
 
 /* call-seq:
@@ -599,11 +1806,25 @@ VALUE Database_limit(int argc, VALUE *argv, VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  int value = sqlite3_limit(db->sqlite3_db, NUM2INT(category), RTEST(new_value) ? NUM2INT(new_value) : -1);
+  limit_ctx ctx = { db, NUM2INT(category), RTEST(new_value) ? NUM2INT(new_value) : -1 };
+  return Database_synchronize(db, Database_limit_locked, (VALUE)&ctx);
+}
 
-  if (value == -1) rb_raise(cError, "Invalid limit category");
+typedef struct {
+  Database_t *db;
+  int ms;
+} busy_timeout_ctx;
 
-  return INT2NUM(value);
+static VALUE Database_busy_timeout_set_locked(VALUE ptr) {
+  busy_timeout_ctx *ctx = (busy_timeout_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+
+  int rc = sqlite3_busy_timeout(ctx->db->sqlite3_db, ctx->ms);
+  if (rc != SQLITE_OK) rb_raise(cError, "Failed to set busy timeout");
+
+  // kept for reopening the database after a fork
+  ctx->db->busy_timeout_ms = ctx->ms;
+  return Qnil;
 }
 
 /* call-seq:
@@ -617,13 +1838,17 @@ VALUE Database_busy_timeout_set(VALUE self, VALUE sec) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  int ms = (sec == Qnil) ? 0 : (int)(NUM2DBL(sec) * 1000);
-  int rc = sqlite3_busy_timeout(db->sqlite3_db, ms);
-  if (rc != SQLITE_OK) rb_raise(cError, "Failed to set busy timeout");
-
+  busy_timeout_ctx ctx = { db, (sec == Qnil) ? 0 : (int)(NUM2DBL(sec) * 1000) };
+  Database_synchronize(db, Database_busy_timeout_set_locked, (VALUE)&ctx);
   return self;
 }
 
+static VALUE Database_total_changes_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return INT2NUM(sqlite3_total_changes(db->sqlite3_db));
+}
+
 /* call-seq:
  *   db.total_changes -> value
  *
@@ -633,8 +1858,18 @@ VALUE Database_total_changes(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  int value = sqlite3_total_changes(db->sqlite3_db);
-  return INT2NUM(value);
+  return Database_synchronize(db, Database_total_changes_locked, (VALUE)db);
+}
+
+typedef struct {
+  Database_t *db;
+  VALUE proc;
+} hook_ctx;
+
+static VALUE Database_trace_locked(VALUE ptr) {
+  hook_ctx *ctx = (hook_ctx *)ptr;
+  ctx->db->trace_block = ctx->proc;
+  return Qnil;
 }
 
 /* call-seq:
@@ -648,10 +1883,73 @@ VALUE Database_trace(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  db->trace_block = rb_block_given_p() ? rb_block_proc() : Qnil;
+  hook_ctx ctx = { db, rb_block_given_p() ? rb_block_proc() : Qnil };
+  Database_synchronize(db, Database_trace_locked, (VALUE)&ctx);
   return self;
 }
 
+static VALUE Database_on_commit_locked(VALUE ptr) {
+  hook_ctx *ctx = (hook_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+
+  if (ctx->db->commit_hooks == Qnil) ctx->db->commit_hooks = rb_ary_new();
+  rb_ary_push(ctx->db->commit_hooks, ctx->proc);
+  Database_install_commit_hook(ctx->db);
+  return ctx->proc;
+}
+
+/* call-seq:
+ *   db.on_commit { } -> proc
+ *
+ * Installs a block that will be invoked after transactions are committed on
+ * this connection, once the operation performing the commit has returned. An
+ * operation committing multiple transactions (e.g. `#execute_multi` outside of
+ * a transaction) invokes the block once. Multiple blocks may be installed,
+ * and are invoked in the order they were installed.
+ *
+ * Returns the block as a proc, which can be passed to `#remove_on_commit` in
+ * order to remove it.
+ */
+VALUE Database_on_commit(VALUE self) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+  if (!rb_block_given_p()) rb_raise(rb_eArgError, "No block given");
+
+  hook_ctx ctx = { db, rb_block_proc() };
+  return Database_synchronize(db, Database_on_commit_locked, (VALUE)&ctx);
+}
+
+static VALUE Database_remove_on_commit_locked(VALUE ptr) {
+  hook_ctx *ctx = (hook_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+
+  if (ctx->db->commit_hooks != Qnil) {
+    rb_ary_delete(ctx->db->commit_hooks, ctx->proc);
+    Database_install_commit_hook(ctx->db);
+  }
+  return Qnil;
+}
+
+/* call-seq:
+ *   db.remove_on_commit(proc) -> db
+ *
+ * Removes a block installed using `#on_commit`.
+ */
+VALUE Database_remove_on_commit(VALUE self, VALUE hook) {
+  Database_t *db;
+  GetOpenDatabase(self, db);
+
+  hook_ctx ctx = { db, hook };
+  Database_synchronize(db, Database_remove_on_commit_locked, (VALUE)&ctx);
+  return self;
+}
+
+static VALUE Database_errcode_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return INT2NUM(sqlite3_errcode(db->sqlite3_db));
+}
+
 /* call-seq:
  *   db.errcode -> errcode
  *
@@ -661,7 +1959,13 @@ VALUE Database_errcode(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  return INT2NUM(sqlite3_errcode(db->sqlite3_db));
+  return Database_synchronize(db, Database_errcode_locked, (VALUE)db);
+}
+
+static VALUE Database_errmsg_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return rb_str_new2(sqlite3_errmsg(db->sqlite3_db));
 }
 
 /* call-seq:
@@ -673,10 +1977,16 @@ VALUE Database_errmsg(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  return rb_str_new2(sqlite3_errmsg(db->sqlite3_db));
+  return Database_synchronize(db, Database_errmsg_locked, (VALUE)db);
 }
 
 #ifdef HAVE_SQLITE3_ERROR_OFFSET
+static VALUE Database_error_offset_locked(VALUE ptr) {
+  Database_t *db = (Database_t *)ptr;
+  CHECK_STILL_OPEN(db);
+  return INT2NUM(sqlite3_error_offset(db->sqlite3_db));
+}
+
 /* call-seq:
  *   db.error_offset -> ofs
  *
@@ -686,13 +1996,19 @@ VALUE Database_error_offset(VALUE self) {
   Database_t *db;
   GetOpenDatabase(self, db);
 
-  return INT2NUM(sqlite3_error_offset(db->sqlite3_db));
+  return Database_synchronize(db, Database_error_offset_locked, (VALUE)db);
 }
 #endif
 
 void Init_ExtraliteDatabase(void) {
   VALUE mExtralite = rb_define_module("Extralite");
+#ifdef HAVE_SQLITE3_HARD_HEAP_LIMIT64
+  rb_define_singleton_method(mExtralite, "hard_heap_limit", Extralite_hard_heap_limit, 0);
+  rb_define_singleton_method(mExtralite, "hard_heap_limit=", Extralite_hard_heap_limit_set, 1);
+#endif
   rb_define_singleton_method(mExtralite, "runtime_status", Extralite_runtime_status, -1);
+  rb_define_singleton_method(mExtralite, "soft_heap_limit", Extralite_soft_heap_limit, 0);
+  rb_define_singleton_method(mExtralite, "soft_heap_limit=", Extralite_soft_heap_limit_set, 1);
   rb_define_singleton_method(mExtralite, "sqlite3_version", Extralite_sqlite3_version, 0);
 
   cDatabase = rb_define_class_under(mExtralite, "Database", rb_cObject);
@@ -713,22 +2029,37 @@ void Init_ExtraliteDatabase(void) {
 
   rb_define_method(cDatabase, "execute_multi", Database_execute_multi, 2);
   rb_define_method(cDatabase, "filename", Database_filename, -1);
-  rb_define_method(cDatabase, "initialize", Database_initialize, 1);
+  rb_define_method(cDatabase, "foreign_keys", Database_foreign_keys, 1);
+  rb_define_method(cDatabase, "frozen_results?", Database_frozen_results_p, 0);
+  rb_define_method(cDatabase, "indexes", Database_indexes, 1);
+  rb_define_method(cDatabase, "initialize", Database_initialize, -1);
   rb_define_method(cDatabase, "interrupt", Database_interrupt, 0);
   rb_define_method(cDatabase, "last_insert_rowid", Database_last_insert_rowid, 0);
   rb_define_method(cDatabase, "limit", Database_limit, -1);
+  rb_define_method(cDatabase, "on_commit", Database_on_commit, 0);
   rb_define_method(cDatabase, "prepare", Database_prepare, 1);
   rb_define_method(cDatabase, "query", Database_query_hash, -1);
   rb_define_method(cDatabase, "query_ary", Database_query_ary, -1);
   rb_define_method(cDatabase, "query_hash", Database_query_hash, -1);
+  rb_define_method(cDatabase, "query_rows", Database_query_rows, -1);
   rb_define_method(cDatabase, "query_single_column", Database_query_single_column, -1);
   rb_define_method(cDatabase, "query_single_row", Database_query_single_row, -1);
   rb_define_method(cDatabase, "query_single_value", Database_query_single_value, -1);
+  rb_define_method(cDatabase, "remove_on_commit", Database_remove_on_commit, 1);
+  rb_define_method(cDatabase, "reset_scan_report", Database_reset_scan_report, 0);
+  rb_define_method(cDatabase, "scan_report", Database_scan_report, -1);
+  rb_define_method(cDatabase, "schema_version", Database_schema_version, 0);
+  rb_define_method(cDatabase, "space_usage", Database_space_usage, -1);
   rb_define_method(cDatabase, "status", Database_status, -1);
+  rb_define_method(cDatabase, "table_info", Database_table_info, 1);
+  rb_define_method(cDatabase, "tables", Database_tables, 0);
+  rb_define_method(cDatabase, "thread_safe?", Database_thread_safe_p, 0);
   rb_define_method(cDatabase, "total_changes", Database_total_changes, 0);
   rb_define_method(cDatabase, "trace", Database_trace, 0);
   rb_define_method(cDatabase, "transaction_active?", Database_transaction_active_p, 0);
 
+  rb_define_private_method(cDatabase, "warm_file", Database_warm_file, 1);
+
 #ifdef HAVE_SQLITE3_LOAD_EXTENSION
   rb_define_method(cDatabase, "load_extension", Database_load_extension, 1);
 #endif
@@ -745,6 +2076,29 @@ void Init_ExtraliteDatabase(void) {
   ID_call   = rb_intern("call");
   ID_keys   = rb_intern("keys");
   ID_new    = rb_intern("new");
+  ID_shift  = rb_intern("shift");
   ID_strip  = rb_intern("strip");
   ID_to_s   = rb_intern("to_s");
+
+  SYM_frozen  = ID2SYM(rb_intern("frozen"));
+  SYM_on_fork = ID2SYM(rb_intern("on_fork"));
+  SYM_reopen  = ID2SYM(rb_intern("reopen"));
+  SYM_thread_safe = ID2SYM(rb_intern("thread_safe"));
+  SYM_vfs = ID2SYM(rb_intern("vfs"));
+  SYM_shared_cache = ID2SYM(rb_intern("shared_cache"));
+  SYM_immutable = ID2SYM(rb_intern("immutable"));
+  SYM_io_stats = ID2SYM(rb_intern("io_stats"));
+  SYM_columns       = ID2SYM(rb_intern("columns"));
+  SYM_foreign_keys  = ID2SYM(rb_intern("foreign_keys"));
+  SYM_indexes       = ID2SYM(rb_intern("indexes"));
+  SYM_table_info    = ID2SYM(rb_intern("table_info"));
+  SYM_tables        = ID2SYM(rb_intern("tables"));
+
+  /* SQL query returning the names of the tables in the main schema */
+  rb_define_const(cDatabase, "TABLES_SQL", rb_obj_freeze(rb_str_new_literal(TABLES_SQL)));
+
+#ifdef HAVE_WORKING_FORK
+  current_pid = getpid();
+  pthread_atfork(NULL, NULL, Extralite_after_fork_child);
+#endif
 }
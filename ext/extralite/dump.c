@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <math.h>
+#include "extralite.h"
+
+/*
+Logical dumps are produced by Database#dump, which writes the schema, and calls
+dump_rows for each table. Rows are stepped through and formatted as batched
+INSERT statements into an sqlite3_str buffer without holding the GVL, and the
+buffer is written to the IO whenever it exceeds DUMP_BUFFER_SIZE.
+
+Restoring is done by Database#restore, which reads the script in chunks. For
+each chunk, sql_complete_length finds the longest prefix made of complete
+statements, and execute_script executes it without holding the GVL, skipping
+transaction control statements, since the restore is performed in its own
+chunked transactions.
+
+To find complete statements, sql_complete_length scans the newly read text
+using a minimal lexer that skips quoted strings, identifiers and comments. Each
+semicolon found outside of those is checked using sqlite3_complete on the text
+of the current statement (a semicolon inside a trigger body does not end the
+statement). The scan offset and lexer state are returned to the caller, so that
+text left over for the next chunk is not scanned again.
+*/
+
+#define DUMP_BUFFER_SIZE (1 << 20)
+
+static ID ID_write;
+
+typedef struct {
+  Database_t *db;
+  VALUE io;
+  VALUE sql;
+  VALUE insert;
+  char *insert_str;
+  sqlite3_stmt *stmt;
+  sqlite3_str *buf;
+  int batch_rows;
+  long rows;
+  int rc;
+} dump_ctx;
+
+static void dump_format_value(sqlite3_str *buf, sqlite3_stmt *stmt, int col) {
+  switch (sqlite3_column_type(stmt, col)) {
+    case SQLITE_INTEGER:
+      sqlite3_str_appendf(buf, "%lld", sqlite3_column_int64(stmt, col));
+      return;
+    case SQLITE_FLOAT:
+      {
+        double value = sqlite3_column_double(stmt, col);
+        if (isnan(value))
+          sqlite3_str_appendall(buf, "NULL");
+        else if (isinf(value))
+          sqlite3_str_appendall(buf, value < 0 ? "-1e999" : "1e999");
+        else
+          sqlite3_str_appendf(buf, "%!.17g", value);
+        return;
+      }
+    case SQLITE_TEXT:
+      sqlite3_str_appendf(buf, "%Q", sqlite3_column_text(stmt, col));
+      return;
+    case SQLITE_BLOB:
+      {
+        static const char hex[] = "0123456789abcdef";
+        const unsigned char *blob = sqlite3_column_blob(stmt, col);
+        int len = sqlite3_column_bytes(stmt, col);
+        sqlite3_str_appendall(buf, "X'");
+        for (int i = 0; i < len; i++) {
+          sqlite3_str_appendchar(buf, 1, hex[blob[i] >> 4]);
+          sqlite3_str_appendchar(buf, 1, hex[blob[i] & 0xf]);
+        }
+        sqlite3_str_appendchar(buf, 1, '\'');
+        return;
+      }
+    default:
+      sqlite3_str_appendall(buf, "NULL");
+  }
+}
+
+// Formats rows until the buffer is full or all rows have been read.
+static void *dump_fill_without_gvl(void *ptr) {
+  dump_ctx *ctx = (dump_ctx *)ptr;
+  int columns = sqlite3_column_count(ctx->stmt);
+  int in_batch = 0;
+
+  while (sqlite3_str_length(ctx->buf) < DUMP_BUFFER_SIZE && !sqlite3_str_errcode(ctx->buf)) {
+    ctx->rc = sqlite3_step(ctx->stmt);
+    if (ctx->rc != SQLITE_ROW) break;
+
+    if (in_batch)
+      sqlite3_str_appendall(ctx->buf, ",\n");
+    else
+      sqlite3_str_appendall(ctx->buf, ctx->insert_str);
+
+    sqlite3_str_appendchar(ctx->buf, 1, '(');
+    for (int i = 0; i < columns; i++) {
+      if (i) sqlite3_str_appendchar(ctx->buf, 1, ',');
+      dump_format_value(ctx->buf, ctx->stmt, i);
+    }
+    sqlite3_str_appendchar(ctx->buf, 1, ')');
+    ctx->rows++;
+
+    if (++in_batch == ctx->batch_rows) {
+      sqlite3_str_appendall(ctx->buf, ";\n");
+      in_batch = 0;
+    }
+  }
+  if (in_batch) sqlite3_str_appendall(ctx->buf, ";\n");
+  return NULL;
+}
+
+static void dump_ubf(void *ptr) {
+  dump_ctx *ctx = (dump_ctx *)ptr;
+  sqlite3_interrupt(ctx->db->sqlite3_db);
+}
+
+static void dump_flush(dump_ctx *ctx) {
+  switch (sqlite3_str_errcode(ctx->buf)) {
+    case SQLITE_OK:
+      break;
+    case SQLITE_NOMEM:
+      rb_raise(rb_eNoMemError, "Failed to allocate dump buffer");
+    default:
+      rb_raise(cError, "Row too large to dump");
+  }
+
+  int len = sqlite3_str_length(ctx->buf);
+  if (!len) return;
+
+  rb_funcall(ctx->io, ID_write, 1, rb_str_new(sqlite3_str_value(ctx->buf), len));
+  sqlite3_str_reset(ctx->buf);
+}
+
+static VALUE dump_rows_collect(VALUE ptr) {
+  dump_ctx *ctx = (dump_ctx *)ptr;
+
+  prepare_single_stmt(ctx->db->sqlite3_db, &ctx->stmt, ctx->sql);
+  ctx->buf = sqlite3_str_new(ctx->db->sqlite3_db);
+  // the INSERT prefix is used while the GVL is released
+  ctx->insert_str = sqlite3_mprintf("%s", StringValueCStr(ctx->insert));
+  if (!ctx->insert_str) rb_raise(rb_eNoMemError, "Failed to allocate SQL");
+
+  while (1) {
+    rb_thread_call_without_gvl(dump_fill_without_gvl, (void *)ctx, dump_ubf, (void *)ctx);
+    switch (ctx->rc) {
+      case SQLITE_ROW:
+        dump_flush(ctx);
+        continue;
+      case SQLITE_DONE:
+        dump_flush(ctx);
+        return LONG2NUM(ctx->rows);
+      case SQLITE_NOMEM:
+        rb_raise(rb_eNoMemError, "Failed to allocate dump buffer");
+      case SQLITE_BUSY:
+        rb_raise(cBusyError, "Database is busy");
+      case SQLITE_INTERRUPT:
+        rb_raise(cInterruptError, "Query was interrupted");
+      case SQLITE_ERROR:
+        rb_raise(cSQLError, "%s", sqlite3_errmsg(ctx->db->sqlite3_db));
+      default:
+        rb_raise(cError, "%s", sqlite3_errmsg(ctx->db->sqlite3_db));
+    }
+  }
+}
+
+static VALUE dump_rows_cleanup(VALUE ptr) {
+  dump_ctx *ctx = (dump_ctx *)ptr;
+  if (ctx->buf) sqlite3_free(sqlite3_str_finish(ctx->buf));
+  if (ctx->stmt) sqlite3_finalize(ctx->stmt);
+  sqlite3_free(ctx->insert_str);
+  return Qnil;
+}
+
+static VALUE Database_dump_rows_locked(VALUE ptr) {
+  return rb_ensure(SAFE(dump_rows_collect), ptr, SAFE(dump_rows_cleanup), ptr);
+}
+
+static VALUE dump_column_list(VALUE columns) {
+  VALUE list = rb_str_new(0, 0);
+  for (long i = 0; i < RARRAY_LEN(columns); i++) {
+    VALUE column = rb_funcall(RARRAY_AREF(columns, i), ID_to_s, 0);
+    char *quoted = sqlite3_mprintf("%s\"%w\"", i ? "," : "", StringValueCStr(column));
+    if (!quoted) rb_raise(rb_eNoMemError, "Failed to allocate SQL");
+    rb_str_cat_cstr(list, quoted);
+    sqlite3_free(quoted);
+  }
+  return list;
+}
+
+static VALUE dump_sql(const char *fmt, VALUE a, VALUE b) {
+  char *sql = sqlite3_mprintf(fmt, StringValueCStr(a), StringValueCStr(b));
+  if (!sql) rb_raise(rb_eNoMemError, "Failed to allocate SQL");
+  VALUE str = rb_str_new_cstr(sql);
+  sqlite3_free(sql);
+  return str;
+}
+
+/* call-seq:
+ *   db.dump_rows(io, table, columns, batch_rows) -> rows
+ *
+ * Writes the rows of the given table to io as INSERT statements, each
+ * inserting up to batch_rows rows. Rows are formatted without holding the GVL,
+ * and written to io in chunks of about 1MB. Returns the number of rows
+ * written. Used by `Database#dump`.
+ */
+static VALUE Database_dump_rows(VALUE self, VALUE io, VALUE table, VALUE columns, VALUE batch_rows) {
+  Database_t *db = Database_open_struct(self);
+  Check_Type(columns, T_ARRAY);
+  if (!RARRAY_LEN(columns)) rb_raise(cError, "No columns given");
+  int batch = NUM2INT(batch_rows);
+  if (batch < 1) rb_raise(cError, "Invalid batch size");
+
+  table = rb_funcall(table, ID_to_s, 0);
+  VALUE list = dump_column_list(columns);
+  VALUE sql = dump_sql("select %s from \"%w\"", list, table);
+  VALUE insert = dump_sql("INSERT INTO \"%w\"(%s) VALUES\n", table, list);
+
+  dump_ctx ctx = { db, io, sql, insert, NULL, NULL, NULL, batch, 0, 0 };
+  VALUE result = Database_synchronize(db, Database_dump_rows_locked, (VALUE)&ctx);
+  RB_GC_GUARD(sql);
+  RB_GC_GUARD(insert);
+  return result;
+}
+
+enum sql_lex_state {
+  SQL_LEX_NORMAL,
+  SQL_LEX_SINGLE_QUOTE,   // '...' (an escaped quote is lexed as two adjacent
+                          // quoted strings, and likewise below)
+  SQL_LEX_DOUBLE_QUOTE,   // "..."
+  SQL_LEX_BACKTICK,       // `...`
+  SQL_LEX_BRACKET,        // [...]
+  SQL_LEX_LINE_COMMENT,   // -- ...
+  SQL_LEX_BLOCK_COMMENT   // /* ... */
+};
+
+// characters ending each lexer state (block comments are handled separately)
+static const char sql_lex_end[] = { 0, '\'', '"', '`', ']', '\n', 0 };
+
+// Returns true if the given statement text, ending with a semicolon, is
+// complete according to sqlite3_complete.
+static int sql_statement_complete(const char *sql, long len) {
+  char *str = malloc(len + 1);
+  if (!str) rb_raise(rb_eNoMemError, "Failed to allocate SQL buffer");
+  memcpy(str, sql, len);
+  str[len] = 0;
+  int complete = sqlite3_complete(str);
+  free(str);
+  return complete;
+}
+
+/* call-seq:
+ *   db.sql_complete_length(sql, offset, state) -> [length, offset, state]
+ *
+ * Returns the byte length of the longest prefix of the given SQL string made of
+ * complete statements (0 if there is none), along with the offset and lexer
+ * state to pass in the next call, once the complete prefix has been removed
+ * from the string (subtracting the length from the offset) and more text
+ * appended. The first call is made with an offset and state of 0. Used by
+ * `Database#restore`.
+ */
+static VALUE Database_sql_complete_length(VALUE self, VALUE sql, VALUE offset, VALUE state) {
+  StringValue(sql);
+  const char *str = RSTRING_PTR(sql);
+  long len = RSTRING_LEN(sql);
+  long pos = NUM2LONG(offset);
+  int lex = NUM2INT(state);
+  long complete = 0;
+
+  if (pos < 0 || pos > len) rb_raise(rb_eArgError, "Invalid offset");
+  if (lex < SQL_LEX_NORMAL || lex > SQL_LEX_BLOCK_COMMENT) rb_raise(rb_eArgError, "Invalid state");
+
+  for (; pos < len; pos++) {
+    char c = str[pos];
+    switch (lex) {
+      case SQL_LEX_NORMAL:
+        if (c == '\'')
+          lex = SQL_LEX_SINGLE_QUOTE;
+        else if (c == '"')
+          lex = SQL_LEX_DOUBLE_QUOTE;
+        else if (c == '`')
+          lex = SQL_LEX_BACKTICK;
+        else if (c == '[')
+          lex = SQL_LEX_BRACKET;
+        else if ((c == '-' || c == '/') && pos + 1 == len)
+          // the next character is needed, resume from here
+          goto done;
+        else if (c == '-' && str[pos + 1] == '-')
+          lex = SQL_LEX_LINE_COMMENT;
+        else if (c == '/' && str[pos + 1] == '*') {
+          lex = SQL_LEX_BLOCK_COMMENT;
+          pos++;
+        }
+        else if (c == ';' && sql_statement_complete(str + complete, pos + 1 - complete))
+          complete = pos + 1;
+        break;
+      case SQL_LEX_BLOCK_COMMENT:
+        if (c == '*' && pos + 1 == len) goto done;
+        if (c == '*' && str[pos + 1] == '/') {
+          lex = SQL_LEX_NORMAL;
+          pos++;
+        }
+        break;
+      default:
+        if (c == sql_lex_end[lex]) lex = SQL_LEX_NORMAL;
+    }
+  }
+done:
+  RB_GC_GUARD(sql);
+  return rb_ary_new_from_args(3, LONG2NUM(complete), LONG2NUM(pos), INT2FIX(lex));
+}
+
+typedef struct {
+  Database_t *db;
+  VALUE str;
+  char *sql;
+  long len;
+  long count;
+  int rc;
+  char *errmsg;
+} script_ctx;
+
+static inline int script_space_p(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+static inline int script_ident_char_p(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$' ||
+    (c & 0x80);
+}
+
+// Returns true if the first keyword of the statement, after any whitespace and
+// comments, is BEGIN, COMMIT, END or ROLLBACK.
+static int script_transaction_control_p(sqlite3_stmt *stmt) {
+  const char *sql = sqlite3_sql(stmt);
+
+  while (1) {
+    if (script_space_p(*sql))
+      sql++;
+    else if (sql[0] == '-' && sql[1] == '-') {
+      while (*sql && *sql != '\n') sql++;
+    }
+    else if (sql[0] == '/' && sql[1] == '*') {
+      sql += 2;
+      while (*sql && !(sql[0] == '*' && sql[1] == '/')) sql++;
+      if (*sql) sql += 2;
+    }
+    else
+      break;
+  }
+
+  int len = 0;
+  while (script_ident_char_p(sql[len])) len++;
+
+  switch (len) {
+    case 3:
+      return !sqlite3_strnicmp(sql, "end", 3);
+    case 5:
+      return !sqlite3_strnicmp(sql, "begin", 5);
+    case 6:
+      return !sqlite3_strnicmp(sql, "commit", 6);
+    case 8:
+      return !sqlite3_strnicmp(sql, "rollback", 8);
+    default:
+      return 0;
+  }
+}
+
+static void *execute_script_without_gvl(void *ptr) {
+  script_ctx *ctx = (script_ctx *)ptr;
+  sqlite3 *db = ctx->db->sqlite3_db;
+  const char *str = ctx->sql;
+  const char *end = ctx->sql + ctx->len;
+
+  while (str < end) {
+    sqlite3_stmt *stmt = NULL;
+    const char *rest = NULL;
+    ctx->rc = sqlite3_prepare_v2(db, str, end - str, &stmt, &rest);
+    if (ctx->rc != SQLITE_OK) break;
+    str = rest;
+    if (!stmt) continue; // whitespace or comment
+
+    if (!script_transaction_control_p(stmt)) {
+      while ((ctx->rc = sqlite3_step(stmt)) == SQLITE_ROW);
+      if (ctx->rc != SQLITE_DONE) {
+        sqlite3_finalize(stmt);
+        break;
+      }
+      ctx->count++;
+    }
+    sqlite3_finalize(stmt);
+    ctx->rc = SQLITE_OK;
+  }
+  if (ctx->rc != SQLITE_OK) ctx->errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  return NULL;
+}
+
+static void script_ubf(void *ptr) {
+  script_ctx *ctx = (script_ctx *)ptr;
+  sqlite3_interrupt(ctx->db->sqlite3_db);
+}
+
+static VALUE execute_script_run(VALUE ptr) {
+  script_ctx *ctx = (script_ctx *)ptr;
+
+  // the SQL is copied, since the string may be modified while the GVL is released
+  ctx->len = RSTRING_LEN(ctx->str);
+  ctx->sql = malloc(ctx->len + 1);
+  if (!ctx->sql) rb_raise(rb_eNoMemError, "Failed to allocate SQL buffer");
+  memcpy(ctx->sql, RSTRING_PTR(ctx->str), ctx->len);
+  ctx->sql[ctx->len] = 0;
+
+  rb_thread_call_without_gvl(execute_script_without_gvl, (void *)ctx, script_ubf, (void *)ctx);
+  switch (ctx->rc) {
+    case SQLITE_OK:
+      return LONG2NUM(ctx->count);
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED_SHAREDCACHE:
+      rb_raise(cBusyError, "Database is busy");
+    case SQLITE_INTERRUPT:
+      rb_raise(cInterruptError, "Query was interrupted");
+    case SQLITE_ERROR:
+      rb_raise(cSQLError, "%s", ctx->errmsg);
+    default:
+      rb_raise(cError, "%s", ctx->errmsg);
+  }
+}
+
+static VALUE execute_script_cleanup(VALUE ptr) {
+  script_ctx *ctx = (script_ctx *)ptr;
+  free(ctx->sql);
+  sqlite3_free(ctx->errmsg);
+  return Qnil;
+}
+
+static VALUE Database_execute_script_locked(VALUE ptr) {
+  return rb_ensure(SAFE(execute_script_run), ptr, SAFE(execute_script_cleanup), ptr);
+}
+
+/* call-seq:
+ *   db.execute_script(sql) -> count
+ *
+ * Executes all statements in the given SQL string without holding the GVL,
+ * skipping transaction control statements (BEGIN, COMMIT, END and ROLLBACK).
+ * Returns the number of statements executed. Used by `Database#restore`.
+ */
+static VALUE Database_execute_script(VALUE self, VALUE sql) {
+  Database_t *db = Database_open_struct(self);
+  StringValue(sql);
+
+  script_ctx ctx = { db, sql, NULL, 0, 0, 0, NULL };
+  VALUE result = Database_synchronize(db, Database_execute_script_locked, (VALUE)&ctx);
+  RB_GC_GUARD(sql);
+  return result;
+}
+
+void Init_ExtraliteDump(void) {
+  rb_define_private_method(cDatabase, "dump_rows", Database_dump_rows, 4);
+  rb_define_private_method(cDatabase, "execute_script", Database_execute_script, 1);
+  rb_define_private_method(cDatabase, "sql_complete_length", Database_sql_complete_length, 3);
+
+  ID_write = rb_intern("write");
+}
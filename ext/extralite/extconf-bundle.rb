@@ -9,8 +9,16 @@ $CFLAGS << ' -Wno-unused-function'
 $defs << "-DHAVE_SQLITE3_ENABLE_LOAD_EXTENSION"
 $defs << "-DHAVE_SQLITE3_LOAD_EXTENSION"
 $defs << "-DHAVE_SQLITE3_ERROR_OFFSET"
+$defs << "-DHAVE_SQLITE3_HARD_HEAP_LIMIT64"
+$defs << "-DHAVE_SQLITE3_FILENAME_DATABASE"
+$defs << "-DSQLITE_ENABLE_DBSTAT_VTAB"
 
 have_func('usleep')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('posix_fadvise', 'fcntl.h')
+have_header('linux/io_uring.h')
+have_header('linux/fs.h')
+have_func('copy_file_range', 'unistd.h')
 
 dir_config('extralite_ext')
 create_makefile('extralite_ext')
@@ -85,6 +85,13 @@ else
     have_func('sqlite3_load_extension')
     have_func('sqlite3_prepare_v2')
     have_func('sqlite3_error_offset')
+    have_func('sqlite3_hard_heap_limit64')
+    have_func('sqlite3_filename_database')
+    have_func('rb_ext_ractor_safe', 'ruby.h')
+    have_func('posix_fadvise', 'fcntl.h')
+    have_header('linux/io_uring.h')
+    have_header('linux/fs.h')
+    have_func('copy_file_range', 'unistd.h')
     
     $defs << "-DEXTRALITE_NO_BUNDLE"
     
@@ -19,8 +19,14 @@
 
 #define SAFE(f) (VALUE (*)(VALUE))(f)
 
+// make sure the database was not closed by another thread before acquiring the
+// lock (see Database_synchronize)
+#define CHECK_STILL_OPEN(db) \
+  if (!(db)->sqlite3_db) rb_raise(cError, "Database is closed");
+
 extern VALUE cDatabase;
 extern VALUE cPreparedStatement;
+extern VALUE cRow;
 
 extern VALUE cError;
 extern VALUE cSQLError;
@@ -30,12 +36,31 @@ extern VALUE cInterruptError;
 extern ID ID_call;
 extern ID ID_keys;
 extern ID ID_new;
+extern ID ID_shift;
 extern ID ID_strip;
 extern ID ID_to_s;
 
+extern VALUE SYM_frozen;
+
 typedef struct {
   sqlite3 *sqlite3_db;
   VALUE trace_block;
+  int freeze_results;
+  VALUE path;
+  VALUE vfs;
+  int reopen_on_fork;
+  int shared_cache;
+  int immutable;
+  int busy_timeout_ms;
+  rb_pid_t pid;
+  VALUE lock;
+  VALUE lock_owner;
+  sqlite3_stmt *schema_version_stmts[2];
+  int schema_versions[2];
+  VALUE schema_cache;
+  VALUE scan_report;
+  VALUE commit_hooks;
+  int commits_pending;
 } Database_t;
 
 typedef struct {
@@ -44,6 +69,8 @@ typedef struct {
   Database_t *db_struct;
   sqlite3 *sqlite3_db;
   sqlite3_stmt *stmt;
+  rb_pid_t pid;
+  int scan_status[3];
 } PreparedStatement_t;
 
 typedef struct {
@@ -51,6 +78,7 @@ typedef struct {
   sqlite3 *sqlite3_db;
   sqlite3_stmt *stmt;
   VALUE params;
+  int freeze;
 } query_ctx;
 
 typedef struct {
@@ -63,6 +91,7 @@ VALUE safe_execute_multi(query_ctx *ctx);
 VALUE safe_query_ary(query_ctx *ctx);
 VALUE safe_query_columns(query_ctx *ctx);
 VALUE safe_query_hash(query_ctx *ctx);
+VALUE safe_query_rows(query_ctx *ctx);
 VALUE safe_query_single_column(query_ctx *ctx);
 VALUE safe_query_single_row(query_ctx *ctx);
 VALUE safe_query_single_value(query_ctx *ctx);
@@ -73,8 +102,23 @@ void bind_all_parameters(sqlite3_stmt *stmt, int argc, VALUE *argv);
 void bind_all_parameters_from_object(sqlite3_stmt *stmt, VALUE obj);
 int stmt_iterate(sqlite3_stmt *stmt, sqlite3 *db);
 VALUE cleanup_stmt(query_ctx *ctx);
+int unix_file_fd(sqlite3_vfs *vfs, sqlite3_file *file);
+
+VALUE row_new(sqlite3_stmt *stmt, int column_count, VALUE column_names, int freeze);
+
+VALUE stmt_column_value(sqlite3_stmt *stmt, int col);
+VALUE stmt_column_names(sqlite3_stmt *stmt);
+VALUE stmt_row_to_hash(sqlite3_stmt *stmt, VALUE column_names);
+VALUE stmt_row_to_ary(sqlite3_stmt *stmt);
 
 sqlite3 *Database_sqlite3_db(VALUE self);
+sqlite3_stmt *PreparedStatement_sqlite3_stmt(VALUE self);
 Database_t *Database_struct(VALUE self);
+Database_t *Database_open_struct(VALUE self);
+int Database_inherited_p(rb_pid_t pid);
+int Database_sample_scan_status(sqlite3_stmt *stmt, int *last, int *deltas);
+void Database_record_scan_status(Database_t *db, VALUE sql, int *deltas);
+void Database_harvest_scan_status(Database_t *db, sqlite3_stmt *stmt, int *last);
+VALUE Database_synchronize(Database_t *db, VALUE (*fn)(VALUE), VALUE arg);
 
 #endif /* EXTRALITE_H */
\ No newline at end of file
@@ -0,0 +1,106 @@
+#ifndef EXTRALITE_API_H
+#define EXTRALITE_API_H
+
+/*
+Public C API for native extensions using Extralite database connections.
+
+The API is provided as a versioned table of function pointers. New functions
+are only ever appended to the table, and the version is incremented whenever
+the table is extended, so an extension built against an older version of this
+header keeps working with newer versions of Extralite. To load the API:
+
+    #include "extralite_api.h"
+
+    static const extralite_api_t *extralite;
+
+    void Init_my_ext(void) {
+      extralite = extralite_api_load(1);
+    }
+
+Then, to run a query:
+
+    sqlite3_stmt *stmt = extralite->prepare(db, sql);
+    extralite->bind(stmt, argc, argv);
+    VALUE columns = extralite->column_names(stmt);
+    while (extralite->step(stmt))
+      rb_ary_push(rows, extralite->row_to_hash(stmt, columns));
+    extralite->finalize(stmt);
+
+Functions taking Ruby objects raise exceptions just like the corresponding Ruby
+methods (for example when the database is closed), and `step` releases the GVL
+while stepping through the statement. Statements should be finalized before
+returning control to Ruby (use `rb_ensure`). When the database was opened in
+thread-safe mode, database access should be wrapped in a call to `synchronize`.
+
+Since Extralite may be built with a bundled SQLite library, extensions should
+not call SQLite functions directly on the returned `sqlite3` or `sqlite3_stmt`
+pointers, unless they are known to be linked against the same SQLite library.
+*/
+
+#include "ruby.h"
+
+#define EXTRALITE_API_VERSION 1
+#define EXTRALITE_API_SYMBOL "extralite_api"
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+typedef struct extralite_api {
+  // version of the API table
+  int version;
+
+  // Returns the SQLite connection for the given Extralite::Database.
+  struct sqlite3 *(*database_sqlite3)(VALUE db);
+  // Returns the SQLite statement for the given Extralite::PreparedStatement.
+  struct sqlite3_stmt *(*prepared_statement_stmt)(VALUE stmt);
+  // Calls fn with arg while holding the database lock (in thread-safe mode).
+  VALUE (*synchronize)(VALUE db, VALUE (*fn)(VALUE), VALUE arg);
+
+  // Prepares a statement for the given SQL string.
+  struct sqlite3_stmt *(*prepare)(VALUE db, VALUE sql);
+  // Binds the given parameters, as accepted by Database#query.
+  void (*bind)(struct sqlite3_stmt *stmt, int argc, VALUE *argv);
+  // Steps the statement, returning 1 if a row is available, 0 when done.
+  int (*step)(struct sqlite3_stmt *stmt);
+  // Resets the statement, so it can be run again.
+  void (*reset)(struct sqlite3_stmt *stmt);
+  // Finalizes the statement.
+  void (*finalize)(struct sqlite3_stmt *stmt);
+
+  // Returns the column names for the statement as an array of symbols.
+  VALUE (*column_names)(struct sqlite3_stmt *stmt);
+  // Returns the value of the given column of the current row.
+  VALUE (*column_value)(struct sqlite3_stmt *stmt, int col);
+  // Returns the current row as a hash, using the given column names as keys.
+  VALUE (*row_to_hash)(struct sqlite3_stmt *stmt, VALUE column_names);
+  // Returns the current row as an array.
+  VALUE (*row_to_ary)(struct sqlite3_stmt *stmt);
+} extralite_api_t;
+
+/*
+Loads Extralite (unless already loaded) and returns the API table, raising a
+LoadError if the loaded version of Extralite does not provide at least the
+given API version. The table is looked up using `rb_ext_resolve_symbol` where
+available (Ruby 3.3 and newer, define HAVE_RB_EXT_RESOLVE_SYMBOL using
+`have_func` in your extconf.rb), which finds the extension only if it is on the
+load path, falling back to the address stored in `Extralite::C_API`.
+*/
+static inline const extralite_api_t *extralite_api_load(int min_version) {
+  const extralite_api_t *api = NULL;
+  ID id_extralite = rb_intern("Extralite");
+
+  // Extralite may have been loaded by path, in which case it cannot be required
+  if (!rb_const_defined(rb_cObject, id_extralite)) rb_require("extralite");
+#ifdef HAVE_RB_EXT_RESOLVE_SYMBOL
+  api = (const extralite_api_t *)rb_ext_resolve_symbol("extralite_ext", EXTRALITE_API_SYMBOL);
+#endif
+  if (!api) {
+    VALUE mExtralite = rb_const_get(rb_cObject, id_extralite);
+    api = (const extralite_api_t *)(uintptr_t)NUM2ULL(rb_const_get(mExtralite, rb_intern("C_API")));
+  }
+  if (api->version < min_version)
+    rb_raise(rb_eLoadError, "Extralite C API version %d required, but only %d available", min_version, api->version);
+  return api;
+}
+
+#endif /* EXTRALITE_API_H */
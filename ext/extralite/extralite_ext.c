@@ -1,7 +1,29 @@
+#include "ruby.h"
+
 void Init_ExtraliteDatabase();
 void Init_ExtralitePreparedStatement();
+void Init_ExtraliteRow();
+void Init_ExtraliteIndexAdvisor();
+void Init_ExtraliteAPI();
+void Init_ExtraliteUringVFS();
+void Init_ExtraliteClone();
+void Init_ExtraliteDump();
+void Init_ExtraliteMemdb();
+void Init_ExtraliteStatsVFS();
 
 void Init_extralite_ext(void) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif
+
   Init_ExtraliteDatabase();
   Init_ExtralitePreparedStatement();
+  Init_ExtraliteRow();
+  Init_ExtraliteIndexAdvisor();
+  Init_ExtraliteAPI();
+  Init_ExtraliteUringVFS();
+  Init_ExtraliteClone();
+  Init_ExtraliteDump();
+  Init_ExtraliteMemdb();
+  Init_ExtraliteStatsVFS();
 }
@@ -1,3 +1,24 @@
 #ifndef EXTRALITE_NO_BUNDLE
 #include "../sqlite3/sqlite3.c"
+
+// Returns the file descriptor of the given file if it was opened by one of the
+// unix VFSes, or -1 otherwise. The descriptor must not be closed, since that
+// would release the POSIX locks held by the process on the file. The unix VFS
+// file structure is private to SQLite, so the descriptor is only available
+// when using the bundled SQLite, where the structure is known at compile time.
+int unix_file_fd(sqlite3_vfs *vfs, sqlite3_file *file) {
+#if SQLITE_OS_UNIX
+  if (!vfs || vfs->xOpen != unixOpen || !file || !file->pMethods) return -1;
+
+  return ((unixFile *)file)->h;
+#else
+  return -1;
+#endif
+}
+#else
+#include <sqlite3.h>
+
+int unix_file_fd(sqlite3_vfs *vfs, sqlite3_file *file) {
+  return -1;
+}
 #endif
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include "extralite.h"
+
+/*
+The index advisor finds out which columns the query planner would like to use
+for each table referenced by a query. It opens a scratch in-memory database in
+which each table is mirrored by a virtual table with the same name and
+columns, then prepares the query. SQLite calls xBestIndex on the virtual tables
+with the usable equality and range constraints and the requested sort order,
+which are recorded and returned to Ruby, where candidate indexes are built and
+evaluated (see Database#recommend_indexes). The query is never run.
+*/
+
+#define ADVISOR_MAX_COLUMNS 16
+
+typedef struct {
+  int table;
+  int n_eq;
+  int eq[ADVISOR_MAX_COLUMNS];
+  int n_range;
+  int range[ADVISOR_MAX_COLUMNS];
+  int n_order;
+  int order[ADVISOR_MAX_COLUMNS];
+  int order_desc[ADVISOR_MAX_COLUMNS];
+} advisor_usage;
+
+typedef struct {
+  sqlite3 *db;
+  advisor_usage *usages;
+  int count;
+  int capacity;
+} advisor_ctx;
+
+typedef struct {
+  sqlite3_vtab base;
+  advisor_ctx *ctx;
+  int table;
+} advisor_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+} advisor_cursor;
+
+// argv[3] is the table index, followed by the column definitions
+static int advisor_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+  if (argc < 4) return SQLITE_ERROR;
+
+  sqlite3_str *sql = sqlite3_str_new(db);
+  sqlite3_str_appendall(sql, "create table x(");
+  for (int i = 4; i < argc; i++) {
+    if (i > 4) sqlite3_str_appendchar(sql, 1, ',');
+    sqlite3_str_appendall(sql, argv[i]);
+  }
+  sqlite3_str_appendchar(sql, 1, ')');
+  char *create = sqlite3_str_finish(sql);
+  if (!create) return SQLITE_NOMEM;
+
+  int rc = sqlite3_declare_vtab(db, create);
+  sqlite3_free(create);
+  if (rc != SQLITE_OK) return rc;
+
+  advisor_vtab *tab = sqlite3_malloc(sizeof(advisor_vtab));
+  if (!tab) return SQLITE_NOMEM;
+  memset(tab, 0, sizeof(advisor_vtab));
+  tab->ctx = (advisor_ctx *)aux;
+  tab->table = atoi(argv[3]);
+  *vtab = &tab->base;
+  return SQLITE_OK;
+}
+
+static int advisor_disconnect(sqlite3_vtab *vtab) {
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static inline void advisor_push_column(int *cols, int *n, int col) {
+  for (int i = 0; i < *n; i++) if (cols[i] == col) return;
+  if (*n < ADVISOR_MAX_COLUMNS) cols[(*n)++] = col;
+}
+
+static void advisor_record(advisor_ctx *ctx, advisor_usage *usage) {
+  for (int i = 0; i < ctx->count; i++)
+    if (!memcmp(ctx->usages + i, usage, sizeof(advisor_usage))) return;
+
+  if (ctx->count == ctx->capacity) {
+    int capacity = ctx->capacity ? ctx->capacity * 2 : 16;
+    advisor_usage *usages = sqlite3_realloc(ctx->usages, capacity * sizeof(advisor_usage));
+    if (!usages) return;
+    ctx->usages = usages;
+    ctx->capacity = capacity;
+  }
+  ctx->usages[ctx->count++] = *usage;
+}
+
+static int advisor_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  advisor_vtab *tab = (advisor_vtab *)vtab;
+  advisor_usage usage;
+
+  memset(&usage, 0, sizeof(advisor_usage));
+  usage.table = tab->table;
+
+  for (int i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = info->aConstraint + i;
+    if (!c->usable || c->iColumn < 0) continue;
+
+    switch (c->op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+      case SQLITE_INDEX_CONSTRAINT_IS:
+        advisor_push_column(usage.eq, &usage.n_eq, c->iColumn);
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+        advisor_push_column(usage.range, &usage.n_range, c->iColumn);
+        break;
+    }
+  }
+  for (int i = 0; i < info->nOrderBy && usage.n_order < ADVISOR_MAX_COLUMNS; i++) {
+    if (info->aOrderBy[i].iColumn < 0) break;
+    usage.order[usage.n_order] = info->aOrderBy[i].iColumn;
+    usage.order_desc[usage.n_order++] = info->aOrderBy[i].desc;
+  }
+
+  if (usage.n_eq || usage.n_range || usage.n_order) advisor_record(tab->ctx, &usage);
+
+  // prefer plans with more constrained columns, as a real index would
+  info->estimatedCost = 1000000.0 / (1 + usage.n_eq * 10 + usage.n_range);
+  return SQLITE_OK;
+}
+
+static int advisor_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  advisor_cursor *cur = sqlite3_malloc(sizeof(advisor_cursor));
+  if (!cur) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(advisor_cursor));
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+static int advisor_close(sqlite3_vtab_cursor *cursor) {
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int advisor_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str, int argc, sqlite3_value **argv) {
+  return SQLITE_OK;
+}
+
+static int advisor_next(sqlite3_vtab_cursor *cursor) {
+  return SQLITE_OK;
+}
+
+static int advisor_eof(sqlite3_vtab_cursor *cursor) {
+  return 1;
+}
+
+static int advisor_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int idx) {
+  return SQLITE_OK;
+}
+
+static int advisor_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  *rowid = 0;
+  return SQLITE_OK;
+}
+
+static sqlite3_module advisor_module = {
+  0,                  // iVersion
+  advisor_connect,    // xCreate
+  advisor_connect,    // xConnect
+  advisor_best_index, // xBestIndex
+  advisor_disconnect, // xDisconnect
+  advisor_disconnect, // xDestroy
+  advisor_open,       // xOpen
+  advisor_close,      // xClose
+  advisor_filter,     // xFilter
+  advisor_next,       // xNext
+  advisor_eof,        // xEof
+  advisor_column,     // xColumn
+  advisor_rowid,      // xRowid
+};
+
+static VALUE advisor_column_names(VALUE columns, int *cols, int n) {
+  VALUE names = rb_ary_new2(n);
+  for (int i = 0; i < n; i++) rb_ary_push(names, rb_ary_entry(columns, cols[i]));
+  return names;
+}
+
+static void advisor_exec(advisor_ctx *ctx, const char *sql) {
+  char *errmsg = NULL;
+  if (sqlite3_exec(ctx->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+    VALUE msg = rb_str_new_cstr(errmsg ? errmsg : sqlite3_errmsg(ctx->db));
+    sqlite3_free(errmsg);
+    rb_raise(cSQLError, "%"PRIsVALUE, msg);
+  }
+}
+
+typedef struct {
+  advisor_ctx *ctx;
+  VALUE sql;
+  VALUE tables;
+  VALUE views;
+} advisor_args;
+
+static VALUE advisor_collect(VALUE ptr) {
+  advisor_args *args = (advisor_args *)ptr;
+  advisor_ctx *ctx = args->ctx;
+
+  if (sqlite3_open_v2(":memory:", &ctx->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+    rb_raise(cError, "Failed to open scratch database");
+  sqlite3_create_module(ctx->db, "extralite_advisor", &advisor_module, (void *)ctx);
+
+  long table_count = RARRAY_LEN(args->tables);
+  for (long i = 0; i < table_count; i++) {
+    VALUE table = RARRAY_AREF(args->tables, i);
+    VALUE name = rb_ary_entry(table, 0);
+    VALUE defs = rb_ary_entry(table, 2);
+    sqlite3_str *sql = sqlite3_str_new(ctx->db);
+    sqlite3_str_appendf(sql, "create virtual table \"%w\" using extralite_advisor(%ld", StringValueCStr(name), i);
+    for (long j = 0; j < RARRAY_LEN(defs); j++) {
+      VALUE def = RARRAY_AREF(defs, j);
+      sqlite3_str_appendf(sql, ", %s", StringValueCStr(def));
+    }
+    sqlite3_str_appendchar(sql, 1, ')');
+    char *create = sqlite3_str_finish(sql);
+    if (!create) rb_raise(rb_eNoMemError, "Failed to allocate SQL");
+    VALUE create_str = rb_str_new_cstr(create);
+    sqlite3_free(create);
+    advisor_exec(ctx, StringValueCStr(create_str));
+  }
+
+  // views are recreated on top of the virtual tables, ignoring failures
+  for (long i = 0; i < RARRAY_LEN(args->views); i++) {
+    VALUE view = RARRAY_AREF(args->views, i);
+    sqlite3_exec(ctx->db, StringValueCStr(view), NULL, NULL, NULL);
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  prepare_single_stmt(ctx->db, &stmt, args->sql);
+  sqlite3_finalize(stmt);
+
+  VALUE result = rb_ary_new2(ctx->count);
+  for (int i = 0; i < ctx->count; i++) {
+    advisor_usage *usage = ctx->usages + i;
+    VALUE table = RARRAY_AREF(args->tables, usage->table);
+    VALUE columns = rb_ary_entry(table, 1);
+    VALUE order = rb_ary_new2(usage->n_order);
+    for (int j = 0; j < usage->n_order; j++)
+      rb_ary_push(order, rb_ary_new_from_args(2,
+        rb_ary_entry(columns, usage->order[j]), usage->order_desc[j] ? Qtrue : Qfalse
+      ));
+
+    rb_ary_push(result, rb_ary_new_from_args(4,
+      RARRAY_AREF(table, 0),
+      advisor_column_names(columns, usage->eq, usage->n_eq),
+      advisor_column_names(columns, usage->range, usage->n_range),
+      order
+    ));
+  }
+  return result;
+}
+
+static VALUE advisor_cleanup(VALUE ptr) {
+  advisor_args *args = (advisor_args *)ptr;
+  if (args->ctx->db) sqlite3_close_v2(args->ctx->db);
+  sqlite3_free(args->ctx->usages);
+  return Qnil;
+}
+
+/* call-seq:
+ *   db.index_usage(sql, tables, views) -> [...]
+ *
+ * Returns the column usages the query planner considers for the given query,
+ * as an array of `[table, eq_columns, range_columns, order_by]` tuples, where
+ * `order_by` is an array of `[column, desc]` pairs. `tables` is an array of
+ * `[table, column_names, column_definitions]` tuples describing the tables to
+ * be mirrored, and `views` an array of view definitions. Used by
+ * `Database#recommend_indexes`.
+ */
+static VALUE Database_index_usage(VALUE self, VALUE sql, VALUE tables, VALUE views) {
+  advisor_ctx ctx = { NULL, NULL, 0, 0 };
+
+  StringValue(sql);
+  Check_Type(tables, T_ARRAY);
+  Check_Type(views, T_ARRAY);
+
+  advisor_args args = { &ctx, sql, tables, views };
+  return rb_ensure(SAFE(advisor_collect), (VALUE)&args, SAFE(advisor_cleanup), (VALUE)&args);
+}
+
+void Init_ExtraliteIndexAdvisor(void) {
+  rb_define_private_method(cDatabase, "index_usage", Database_index_usage, 3);
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include "extralite.h"
+
+/*
+In-memory databases opened using the memdb VFS with a name starting with a
+slash are shared by all connections in the process opening the same name, and
+last until the last of these connections is closed (see Database.new_memory).
+Any database can be serialized into a string, and a string holding a database
+image can be deserialized into a connection, replacing its database with a
+private in-memory copy of the image.
+*/
+
+typedef struct {
+  Database_t *db;
+  const char *schema;
+  unsigned char *data;
+  sqlite3_int64 size;
+} serialize_ctx;
+
+static void *serialize_without_gvl(void *ptr) {
+  serialize_ctx *ctx = (serialize_ctx *)ptr;
+  ctx->data = sqlite3_serialize(ctx->db->sqlite3_db, ctx->schema, &ctx->size, 0);
+  return NULL;
+}
+
+static VALUE serialize_result(VALUE ptr) {
+  serialize_ctx *ctx = (serialize_ctx *)ptr;
+  return rb_str_new((const char *)ctx->data, ctx->size);
+}
+
+static VALUE serialize_cleanup(VALUE ptr) {
+  serialize_ctx *ctx = (serialize_ctx *)ptr;
+  sqlite3_free(ctx->data);
+  return Qnil;
+}
+
+static VALUE Database_serialize_locked(VALUE ptr) {
+  serialize_ctx *ctx = (serialize_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+
+  rb_thread_call_without_gvl(serialize_without_gvl, (void *)ctx, RUBY_UBF_IO, 0);
+  if (!ctx->data) {
+    if (sqlite3_errcode(ctx->db->sqlite3_db) == SQLITE_NOMEM)
+      rb_raise(rb_eNoMemError, "Failed to allocate serialized database");
+    rb_raise(cError, "Failed to serialize database %s", ctx->schema);
+  }
+
+  return rb_ensure(SAFE(serialize_result), ptr, SAFE(serialize_cleanup), ptr);
+}
+
+/* call-seq:
+ *   db.serialize -> data
+ *   db.serialize(db_name) -> data
+ *
+ * Returns a binary string holding the database image of the given database
+ * (`main` by default), as it would be stored on disk. The image can be loaded
+ * into another connection using `#deserialize`, or written to a file. The
+ * database is serialized without holding the GVL.
+ */
+VALUE Database_serialize(int argc, VALUE *argv, VALUE self) {
+  VALUE schema;
+  rb_scan_args(argc, argv, "01", &schema);
+  schema = (schema == Qnil) ? rb_str_new_literal("main") : rb_funcall(schema, ID_to_s, 0);
+
+  Database_t *db = Database_open_struct(self);
+  serialize_ctx ctx = { db, StringValueCStr(schema), NULL, 0 };
+  VALUE result = Database_synchronize(db, Database_serialize_locked, (VALUE)&ctx);
+  RB_GC_GUARD(schema);
+  return result;
+}
+
+typedef struct {
+  Database_t *db;
+  VALUE data;
+  const char *schema;
+  int read_only;
+} deserialize_ctx;
+
+static VALUE Database_deserialize_locked(VALUE ptr) {
+  deserialize_ctx *ctx = (deserialize_ctx *)ptr;
+  CHECK_STILL_OPEN(ctx->db);
+
+  sqlite3_int64 size = RSTRING_LEN(ctx->data);
+  // the buffer is owned by SQLite from here on, and freed on close
+  unsigned char *buf = sqlite3_malloc64(size ? size : 1);
+  if (!buf) rb_raise(rb_eNoMemError, "Failed to allocate database image");
+  memcpy(buf, RSTRING_PTR(ctx->data), size);
+
+  unsigned int flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+  flags |= ctx->read_only ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+  int rc = sqlite3_deserialize(ctx->db->sqlite3_db, ctx->schema, buf, size, size, flags);
+  switch (rc) {
+    case SQLITE_OK:
+      return Qnil;
+    case SQLITE_BUSY:
+      rb_raise(cBusyError, "Database is busy");
+    case SQLITE_ERROR:
+      rb_raise(cSQLError, "%s", sqlite3_errmsg(ctx->db->sqlite3_db));
+    default:
+      rb_raise(cError, "%s", sqlite3_errstr(rc));
+  }
+}
+
+/* call-seq:
+ *   db.deserialize(data) -> db
+ *   db.deserialize(data, db_name) -> db
+ *   db.deserialize(data, db_name, read_only: true) -> db
+ *
+ * Replaces the given database (`main` by default) with a private in-memory
+ * database holding a copy of the given database image, e.g. as returned by
+ * `#serialize` or read from a database file. Changes are made in memory only.
+ * If `read_only` is true, the database cannot be modified. Note that a shared
+ * in-memory database (see `Database.new_memory`) stops being shared with other
+ * connections when deserialized into.
+ */
+VALUE Database_deserialize(int argc, VALUE *argv, VALUE self) {
+  VALUE data, schema, opts;
+  rb_scan_args(argc, argv, "11:", &data, &schema, &opts);
+  StringValue(data);
+  schema = (schema == Qnil) ? rb_str_new_literal("main") : rb_funcall(schema, ID_to_s, 0);
+  int read_only = (opts != Qnil) && RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("read_only"))));
+
+  Database_t *db = Database_open_struct(self);
+  deserialize_ctx ctx = { db, data, StringValueCStr(schema), read_only };
+  Database_synchronize(db, Database_deserialize_locked, (VALUE)&ctx);
+  RB_GC_GUARD(data);
+  RB_GC_GUARD(schema);
+  return self;
+}
+
+void Init_ExtraliteMemdb(void) {
+  rb_define_method(cDatabase, "serialize", Database_serialize, -1);
+  rb_define_method(cDatabase, "deserialize", Database_deserialize, -1);
+}
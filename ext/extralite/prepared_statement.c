@@ -15,7 +15,7 @@ static void PreparedStatement_mark(void *ptr) {
 
 static void PreparedStatement_free(void *ptr) {
   PreparedStatement_t *stmt = ptr;
-  if (stmt->stmt) sqlite3_finalize(stmt->stmt);
+  if (stmt->stmt && !Database_inherited_p(stmt->pid)) sqlite3_finalize(stmt->stmt);
   free(ptr);
 }
 
@@ -28,14 +28,53 @@ static const rb_data_type_t PreparedStatement_type = {
 static VALUE PreparedStatement_allocate(VALUE klass) {
   PreparedStatement_t *stmt = ALLOC(PreparedStatement_t);
   stmt->db = Qnil;
+  stmt->sql = Qnil;
+  stmt->db_struct = NULL;
   stmt->sqlite3_db = NULL;
   stmt->stmt = NULL;
+  stmt->pid = 0;
+  memset(stmt->scan_status, 0, sizeof(stmt->scan_status));
   return TypedData_Wrap_Struct(klass, &PreparedStatement_type, stmt);
 }
 
 #define GetPreparedStatement(obj, stmt) \
   TypedData_Get_Struct((obj), PreparedStatement_t, &PreparedStatement_type, (stmt))
 
+// make sure the prepared statement is open and usable in the current process
+#define GetOpenPreparedStatement(obj, stmt) { \
+  TypedData_Get_Struct((obj), PreparedStatement_t, &PreparedStatement_type, (stmt)); \
+  if (!(stmt)->stmt) \
+    rb_raise(cError, "Prepared statement is closed"); \
+  if (Database_inherited_p((stmt)->pid)) PreparedStatement_handle_fork(stmt); \
+}
+
+/*
+Handles a prepared statement inherited from a parent process. If the database
+has been (or can be) reopened, the statement is reprepared on the new
+connection. The inherited statement is dropped without being finalized.
+*/
+static void PreparedStatement_handle_fork(PreparedStatement_t *stmt) {
+  Database_t *db = Database_open_struct(stmt->db);
+
+  stmt->stmt = NULL;
+  stmt->sqlite3_db = db->sqlite3_db;
+  stmt->pid = db->pid;
+  memset(stmt->scan_status, 0, sizeof(stmt->scan_status));
+  prepare_single_stmt(stmt->sqlite3_db, &stmt->stmt, stmt->sql);
+}
+
+sqlite3_stmt *PreparedStatement_sqlite3_stmt(VALUE self) {
+  PreparedStatement_t *stmt;
+  GetOpenPreparedStatement(self, stmt);
+  return stmt->stmt;
+}
+
+static VALUE PreparedStatement_prepare_locked(VALUE ptr) {
+  PreparedStatement_t *stmt = (PreparedStatement_t *)ptr;
+  prepare_single_stmt(stmt->sqlite3_db, &stmt->stmt, stmt->sql);
+  return Qnil;
+}
+
 /* call-seq: initialize(db, sql)
  *
  * Initializes a new SQLite prepared statement with the given path.
@@ -49,29 +88,76 @@ VALUE PreparedStatement_initialize(VALUE self, VALUE db, VALUE sql) {
     rb_raise(cError, "Cannot prepare an empty SQL query");
 
   stmt->db = db;
-  stmt->db_struct = Database_struct(db);
-  stmt->sqlite3_db = Database_sqlite3_db(db);
+  stmt->db_struct = Database_open_struct(db);
+  stmt->sqlite3_db = stmt->db_struct->sqlite3_db;
+  stmt->pid = stmt->db_struct->pid;
   stmt->sql = sql;
 
-  prepare_single_stmt(stmt->sqlite3_db, &stmt->stmt, sql);
+  Database_synchronize(stmt->db_struct, PreparedStatement_prepare_locked, (VALUE)stmt);
 
   return Qnil;
 }
 
-static inline VALUE PreparedStatement_perform_query(int argc, VALUE *argv, VALUE self, VALUE (*call)(query_ctx *)) {
+typedef struct {
+  VALUE self;
   PreparedStatement_t *stmt;
-  GetPreparedStatement(self, stmt);
+  int argc;
+  VALUE *argv;
+  VALUE params;
+  VALUE (*call)(query_ctx *);
+} perform_query_args;
+
+// make sure the statement was not closed by another thread before acquiring the lock
+#define CHECK_STMT_STILL_OPEN(stmt) \
+  if (!(stmt)->stmt) rb_raise(cError, "Prepared statement is closed");
+
+static VALUE PreparedStatement_perform_query_call(VALUE ptr) {
+  perform_query_args *args = (perform_query_args *)ptr;
+  PreparedStatement_t *stmt = args->stmt;
+
+  query_ctx ctx = { args->self, stmt->sqlite3_db, stmt->stmt, Qnil, stmt->db_struct->freeze_results };
+  return args->call(&ctx);
+}
 
-  if (!stmt->stmt)
-    rb_raise(cError, "Prepared statement is closed");
+// The statement is reset once the query is done, so that it does not keep a
+// transaction open (or, for statements that modify the database outside of an
+// explicit transaction, delay the commit) until its next use. The scan report
+// is updated only after the reset, since it allocates Ruby objects.
+static VALUE PreparedStatement_perform_query_reset(VALUE ptr) {
+  perform_query_args *args = (perform_query_args *)ptr;
+  PreparedStatement_t *stmt = args->stmt;
+  int deltas[3];
+
+  if (!stmt->stmt) return Qnil;
+  int any = Database_sample_scan_status(stmt->stmt, stmt->scan_status, deltas);
+  sqlite3_reset(stmt->stmt);
+  if (any)
+    Database_record_scan_status(stmt->db_struct, rb_str_new_cstr(sqlite3_sql(stmt->stmt)), deltas);
+  return Qnil;
+}
 
-  if (stmt->db_struct->trace_block != Qnil) rb_funcall(stmt->db_struct->trace_block, ID_call, 1, stmt->sql);
+static VALUE PreparedStatement_perform_query_locked(VALUE ptr) {
+  perform_query_args *args = (perform_query_args *)ptr;
+  PreparedStatement_t *stmt = args->stmt;
 
+  CHECK_STMT_STILL_OPEN(stmt);
   sqlite3_reset(stmt->stmt);
   sqlite3_clear_bindings(stmt->stmt);
-  bind_all_parameters(stmt->stmt, argc, argv);
-  query_ctx ctx = { self, stmt->sqlite3_db, stmt->stmt };
-  return call(&ctx);
+  bind_all_parameters(stmt->stmt, args->argc, args->argv);
+  return rb_ensure(
+    SAFE(PreparedStatement_perform_query_call), ptr,
+    SAFE(PreparedStatement_perform_query_reset), ptr
+  );
+}
+
+static inline VALUE PreparedStatement_perform_query(int argc, VALUE *argv, VALUE self, VALUE (*call)(query_ctx *)) {
+  PreparedStatement_t *stmt;
+  GetOpenPreparedStatement(self, stmt);
+
+  if (stmt->db_struct->trace_block != Qnil) rb_funcall(stmt->db_struct->trace_block, ID_call, 1, stmt->sql);
+
+  perform_query_args args = { self, stmt, argc, argv, Qnil, call };
+  return Database_synchronize(stmt->db_struct, PreparedStatement_perform_query_locked, (VALUE)&args);
 }
 
 /* call-seq:
@@ -126,6 +212,20 @@ VALUE PreparedStatement_query_ary(int argc, VALUE *argv, VALUE self) {
   return PreparedStatement_perform_query(argc, argv, self, safe_query_ary);
 }
 
+/* call-seq:
+ *   stmt.query_rows(*parameters, &block) -> [...]
+ *
+ * Runs a query returning rows as `Extralite::Row` objects, which convert column
+ * values to Ruby values only when accessed. If a block is given, it will be
+ * called for each row. Otherwise, an array containing all rows is returned.
+ *
+ *     stmt = db.prepare('select * from foo where x = ?')
+ *     stmt.query_rows(42).first[:y] #=> 43
+ */
+VALUE PreparedStatement_query_rows(int argc, VALUE *argv, VALUE self) {
+  return PreparedStatement_perform_query(argc, argv, self, safe_query_rows);
+}
+
 /* call-seq:
  *   stmt.query_single_row(sql, *parameters) -> {...}
  *
@@ -214,15 +314,237 @@ VALUE PreparedStatement_query_single_value(int argc, VALUE *argv, VALUE self) {
  *     stmt.execute_multi_query(records)
  *
  */
+static VALUE PreparedStatement_execute_multi_locked(VALUE ptr) {
+  perform_query_args *args = (perform_query_args *)ptr;
+  PreparedStatement_t *stmt = args->stmt;
+
+  CHECK_STMT_STILL_OPEN(stmt);
+  query_ctx ctx = { args->self, stmt->sqlite3_db, stmt->stmt, args->params, stmt->db_struct->freeze_results };
+  VALUE result = safe_execute_multi(&ctx);
+  Database_harvest_scan_status(stmt->db_struct, stmt->stmt, stmt->scan_status);
+  return result;
+}
+
 VALUE PreparedStatement_execute_multi(VALUE self, VALUE params_array) {
   PreparedStatement_t *stmt;
-  GetPreparedStatement(self, stmt);
+  GetOpenPreparedStatement(self, stmt);
 
-  if (!stmt->stmt)
-    rb_raise(cError, "Prepared statement is closed");
+  perform_query_args args = { self, stmt, 0, NULL, params_array, NULL };
+  return Database_synchronize(stmt->db_struct, PreparedStatement_execute_multi_locked, (VALUE)&args);
+}
 
-  query_ctx ctx = { self, stmt->sqlite3_db, stmt->stmt, params_array };
-  return safe_execute_multi(&ctx);
+/*
+Batch upserts convert all parameter values into a C buffer, then bind and step
+through all rows in a single GVL-free call. Text values are copied into a
+single arena, since Ruby strings may be moved or modified while the GVL is
+released. Inserted rows are told apart from updated rows by setting the last
+insert rowid to a sentinel value before each step: an upsert that takes the DO
+UPDATE path does not change the last insert rowid.
+*/
+
+#define BATCH_ROWID_SENTINEL INT64_MIN
+
+typedef struct {
+  int type;
+  union {
+    sqlite3_int64 i;
+    double d;
+    struct {
+      size_t ofs;
+      int len;
+    } text;
+  };
+} batch_value;
+
+typedef struct {
+  VALUE self;
+  PreparedStatement_t *stmt;
+  VALUE keys;
+  VALUE rows;
+  batch_value *values;
+  char *arena;
+  size_t arena_len;
+  size_t arena_capacity;
+  long row_count;
+  int column_count;
+  long done;
+  long inserted;
+  long updated;
+  int rc;
+} batch_ctx;
+
+static void batch_convert_value(batch_ctx *ctx, batch_value *v, VALUE value, int pos) {
+  switch (TYPE(value)) {
+    case T_NIL:
+      v->type = SQLITE_NULL;
+      return;
+    case T_FIXNUM:
+      v->type = SQLITE_INTEGER;
+      v->i = NUM2LL(value);
+      return;
+    case T_FLOAT:
+      v->type = SQLITE_FLOAT;
+      v->d = NUM2DBL(value);
+      return;
+    case T_TRUE:
+    case T_FALSE:
+      v->type = SQLITE_INTEGER;
+      v->i = value == Qtrue ? 1 : 0;
+      return;
+    case T_STRING:
+      {
+        size_t len = RSTRING_LEN(value);
+        if (ctx->arena_len + len > ctx->arena_capacity) {
+          size_t capacity = ctx->arena_capacity ? ctx->arena_capacity : 4096;
+          while (capacity < ctx->arena_len + len) capacity *= 2;
+          char *arena = realloc(ctx->arena, capacity);
+          if (!arena) rb_raise(rb_eNoMemError, "Failed to allocate batch buffer");
+          ctx->arena = arena;
+          ctx->arena_capacity = capacity;
+        }
+        memcpy(ctx->arena + ctx->arena_len, RSTRING_PTR(value), len);
+        v->type = SQLITE_TEXT;
+        v->text.ofs = ctx->arena_len;
+        v->text.len = len;
+        ctx->arena_len += len;
+        return;
+      }
+    default:
+      rb_raise(cError, "Cannot bind parameter at position %d", pos);
+  }
+}
+
+static void *batch_step_without_gvl(void *ptr) {
+  batch_ctx *ctx = (batch_ctx *)ptr;
+  sqlite3_stmt *stmt = ctx->stmt->stmt;
+  sqlite3 *db = ctx->stmt->sqlite3_db;
+
+  for (; ctx->done < ctx->row_count; ctx->done++) {
+    batch_value *row = ctx->values + ctx->done * ctx->column_count;
+    sqlite3_reset(stmt);
+    for (int i = 0; i < ctx->column_count; i++) {
+      batch_value *v = row + i;
+      switch (v->type) {
+        case SQLITE_NULL:
+          sqlite3_bind_null(stmt, i + 1);
+          break;
+        case SQLITE_INTEGER:
+          sqlite3_bind_int64(stmt, i + 1, v->i);
+          break;
+        case SQLITE_FLOAT:
+          sqlite3_bind_double(stmt, i + 1, v->d);
+          break;
+        case SQLITE_TEXT:
+          sqlite3_bind_text(stmt, i + 1, ctx->arena + v->text.ofs, v->text.len, SQLITE_STATIC);
+          break;
+      }
+    }
+
+    sqlite3_set_last_insert_rowid(db, BATCH_ROWID_SENTINEL);
+    ctx->rc = sqlite3_step(stmt);
+    if (ctx->rc != SQLITE_DONE && ctx->rc != SQLITE_ROW) return NULL;
+
+    if (sqlite3_changes(db)) {
+      if (sqlite3_last_insert_rowid(db) != BATCH_ROWID_SENTINEL)
+        ctx->inserted++;
+      else
+        ctx->updated++;
+    }
+  }
+  ctx->rc = SQLITE_DONE;
+  return NULL;
+}
+
+static void batch_ubf(void *ptr) {
+  batch_ctx *ctx = (batch_ctx *)ptr;
+  sqlite3_interrupt(ctx->stmt->sqlite3_db);
+}
+
+static VALUE PreparedStatement_execute_rows_locked(VALUE ptr) {
+  batch_ctx *ctx = (batch_ctx *)ptr;
+  PreparedStatement_t *stmt = ctx->stmt;
+
+  CHECK_STMT_STILL_OPEN(stmt);
+  if (sqlite3_bind_parameter_count(stmt->stmt) != ctx->column_count)
+    rb_raise(cError, "Expected %d parameters, got %d", sqlite3_bind_parameter_count(stmt->stmt), ctx->column_count);
+
+  ctx->values = malloc(sizeof(batch_value) * (ctx->row_count * ctx->column_count + 1));
+  if (!ctx->values) rb_raise(rb_eNoMemError, "Failed to allocate batch buffer");
+  for (long i = 0; i < ctx->row_count; i++) {
+    VALUE row = RARRAY_AREF(ctx->rows, i);
+    Check_Type(row, T_HASH);
+    for (int j = 0; j < ctx->column_count; j++)
+      batch_convert_value(ctx, ctx->values + i * ctx->column_count + j, rb_hash_aref(row, RARRAY_AREF(ctx->keys, j)), j + 1);
+  }
+
+  rb_thread_call_without_gvl(batch_step_without_gvl, (void *)ctx, batch_ubf, (void *)ctx);
+  Database_harvest_scan_status(stmt->db_struct, stmt->stmt, stmt->scan_status);
+
+  switch (ctx->rc) {
+    case SQLITE_DONE:
+      return rb_ary_new_from_args(2, LONG2NUM(ctx->inserted), LONG2NUM(ctx->updated));
+    case SQLITE_BUSY:
+      rb_raise(cBusyError, "Database is busy");
+    case SQLITE_INTERRUPT:
+      rb_raise(cInterruptError, "Query was interrupted");
+    case SQLITE_ERROR:
+      rb_raise(cSQLError, "%s", sqlite3_errmsg(stmt->sqlite3_db));
+    default:
+      rb_raise(cError, "%s", sqlite3_errmsg(stmt->sqlite3_db));
+  }
+}
+
+static VALUE PreparedStatement_execute_rows_cleanup(VALUE ptr) {
+  batch_ctx *ctx = (batch_ctx *)ptr;
+  if (ctx->stmt->stmt) {
+    sqlite3_reset(ctx->stmt->stmt);
+    sqlite3_clear_bindings(ctx->stmt->stmt);
+  }
+  free(ctx->values);
+  free(ctx->arena);
+  return Qnil;
+}
+
+static VALUE PreparedStatement_execute_rows_synchronized(VALUE ptr) {
+  return rb_ensure(
+    SAFE(PreparedStatement_execute_rows_locked), ptr,
+    SAFE(PreparedStatement_execute_rows_cleanup), ptr
+  );
+}
+
+/* call-seq:
+ *   stmt.execute_rows(keys, rows) -> [inserted, updated]
+ *
+ * Executes the prepared statement for each of the given rows (hashes), binding
+ * the values for the given keys as positional parameters. All rows are stepped
+ * through in a single call without holding the GVL. Returns the number of
+ * inserted rows and the number of rows changed without inserting (e.g. taking
+ * the `DO UPDATE` path of an upsert). Used by `Database#upsert`.
+ *
+ *     stmt = db.prepare('insert into foo (a, b) values (?, ?)')
+ *     stmt.execute_rows([:a, :b], [{ a: 1, b: 2 }, { a: 3, b: 4 }]) #=> [2, 0]
+ */
+static VALUE PreparedStatement_execute_rows(VALUE self, VALUE keys, VALUE rows) {
+  PreparedStatement_t *stmt;
+  GetOpenPreparedStatement(self, stmt);
+  Check_Type(keys, T_ARRAY);
+  Check_Type(rows, T_ARRAY);
+
+  if (stmt->db_struct->trace_block != Qnil) rb_funcall(stmt->db_struct->trace_block, ID_call, 1, stmt->sql);
+
+  batch_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.self = self;
+  ctx.stmt = stmt;
+  ctx.keys = keys;
+  ctx.rows = rows;
+  ctx.row_count = RARRAY_LEN(rows);
+  ctx.column_count = RARRAY_LEN(keys);
+
+  VALUE result = Database_synchronize(stmt->db_struct, PreparedStatement_execute_rows_synchronized, (VALUE)&ctx);
+  RB_GC_GUARD(keys);
+  RB_GC_GUARD(rows);
+  return result;
 }
 
 /* call-seq:
@@ -263,13 +585,22 @@ VALUE PreparedStatement_columns(VALUE self) {
  * Closes the prepared statement. Running a closed prepared statement will raise
  * an error.
  */
-VALUE PreparedStatement_close(VALUE self) {
-  PreparedStatement_t *stmt;
-  GetPreparedStatement(self, stmt);
+static VALUE PreparedStatement_close_locked(VALUE ptr) {
+  PreparedStatement_t *stmt = (PreparedStatement_t *)ptr;
   if (stmt->stmt) {
-    sqlite3_finalize(stmt->stmt);
+    if (!Database_inherited_p(stmt->pid)) {
+      Database_harvest_scan_status(stmt->db_struct, stmt->stmt, stmt->scan_status);
+      sqlite3_finalize(stmt->stmt);
+    }
     stmt->stmt = NULL;
   }
+  return Qnil;
+}
+
+VALUE PreparedStatement_close(VALUE self) {
+  PreparedStatement_t *stmt;
+  GetPreparedStatement(self, stmt);
+  if (stmt->stmt) Database_synchronize(stmt->db_struct, PreparedStatement_close_locked, (VALUE)stmt);
   return self;
 }
 
@@ -285,6 +616,19 @@ VALUE PreparedStatement_closed_p(VALUE self) {
   return stmt->stmt ? Qfalse : Qtrue;
 }
 
+typedef struct {
+  PreparedStatement_t *stmt;
+  int op;
+  int reset;
+} status_ctx;
+
+static VALUE PreparedStatement_status_locked(VALUE ptr) {
+  status_ctx *ctx = (status_ctx *)ptr;
+  PreparedStatement_t *stmt = ctx->stmt;
+  CHECK_STMT_STILL_OPEN(stmt);
+  return INT2NUM(sqlite3_stmt_status(stmt->stmt, ctx->op, ctx->reset));
+}
+
 /* call-seq:
  *   stmt.status(op[, reset]) -> value
  *
@@ -297,10 +641,10 @@ VALUE PreparedStatement_status(int argc, VALUE* argv, VALUE self) {
   rb_scan_args(argc, argv, "11", &op, &reset);
 
   PreparedStatement_t *stmt;
-  GetPreparedStatement(self, stmt);
+  GetOpenPreparedStatement(self, stmt);
 
-  int value = sqlite3_stmt_status(stmt->stmt, NUM2INT(op), RTEST(reset) ? 1 : 0);
-  return INT2NUM(value);
+  status_ctx ctx = { stmt, NUM2INT(op), RTEST(reset) ? 1 : 0 };
+  return Database_synchronize(stmt->db_struct, PreparedStatement_status_locked, (VALUE)&ctx);
 }
 
 void Init_ExtralitePreparedStatement(void) {
@@ -315,10 +659,12 @@ void Init_ExtralitePreparedStatement(void) {
   rb_define_method(cPreparedStatement, "database", PreparedStatement_database, 0);
   rb_define_method(cPreparedStatement, "db", PreparedStatement_database, 0);
   rb_define_method(cPreparedStatement, "execute_multi", PreparedStatement_execute_multi, 1);
+  rb_define_method(cPreparedStatement, "execute_rows", PreparedStatement_execute_rows, 2);
   rb_define_method(cPreparedStatement, "initialize", PreparedStatement_initialize, 2);
   rb_define_method(cPreparedStatement, "query", PreparedStatement_query_hash, -1);
   rb_define_method(cPreparedStatement, "query_hash", PreparedStatement_query_hash, -1);
   rb_define_method(cPreparedStatement, "query_ary", PreparedStatement_query_ary, -1);
+  rb_define_method(cPreparedStatement, "query_rows", PreparedStatement_query_rows, -1);
   rb_define_method(cPreparedStatement, "query_single_row", PreparedStatement_query_single_row, -1);
   rb_define_method(cPreparedStatement, "query_single_column", PreparedStatement_query_single_column, -1);
   rb_define_method(cPreparedStatement, "query_single_value", PreparedStatement_query_single_value, -1);
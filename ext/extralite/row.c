@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include "extralite.h"
+
+VALUE cRow;
+
+/*
+A row holds the raw column values of a single result row, copied into a compact
+buffer at fetch time. Ruby values are only created when a column is accessed,
+and are then cached in the values array, so each column is converted at most
+once.
+*/
+
+typedef struct {
+  int type;
+  int len;
+  union {
+    sqlite3_int64 i;
+    double d;
+    size_t ofs;
+  } v;
+} row_cell_t;
+
+typedef struct {
+  VALUE column_names;
+  int column_count;
+  VALUE *values;
+  row_cell_t *cells;
+  char *data;
+  size_t data_len;
+} Row_t;
+
+static size_t Row_size(const void *ptr) {
+  const Row_t *row = ptr;
+  return sizeof(Row_t) + row->column_count * (sizeof(VALUE) + sizeof(row_cell_t)) + row->data_len;
+}
+
+static void Row_mark(void *ptr) {
+  Row_t *row = ptr;
+  rb_gc_mark(row->column_names);
+  for (int i = 0; i < row->column_count; i++)
+    rb_gc_mark(row->values[i]);
+}
+
+static void Row_free(void *ptr) {
+  Row_t *row = ptr;
+  free(row->values);
+  free(ptr);
+}
+
+static const rb_data_type_t Row_type = {
+    "Row",
+    {Row_mark, Row_free, Row_size,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    | RUBY_TYPED_FROZEN_SHAREABLE
+#endif
+};
+
+#define GetRow(obj, row) \
+  TypedData_Get_Struct((obj), Row_t, &Row_type, (row))
+
+static inline VALUE Row_convert(Row_t *row, int idx);
+
+/*
+Creates a new row from the current result row of the given statement. The
+values array, the cell descriptors and the text/blob bytes are all kept in a
+single allocation. A frozen row has all its values converted (and frozen)
+upfront, since its cache cannot be modified once it is shared between Ractors.
+*/
+VALUE row_new(sqlite3_stmt *stmt, int column_count, VALUE column_names, int freeze) {
+  Row_t *row = ALLOC(Row_t);
+  size_t data_len = 0;
+
+  row->column_names = column_names;
+  row->column_count = 0;
+  row->values = NULL;
+  row->data_len = 0;
+  VALUE obj = TypedData_Wrap_Struct(cRow, &Row_type, row);
+
+  for (int i = 0; i < column_count; i++) {
+    switch (sqlite3_column_type(stmt, i)) {
+      case SQLITE_TEXT:
+        sqlite3_column_text(stmt, i);
+        data_len += sqlite3_column_bytes(stmt, i) + 1;
+        break;
+      case SQLITE_BLOB:
+        sqlite3_column_blob(stmt, i);
+        data_len += sqlite3_column_bytes(stmt, i);
+        break;
+    }
+  }
+
+  char *buf = malloc(column_count * (sizeof(VALUE) + sizeof(row_cell_t)) + data_len);
+  if (!buf) rb_raise(rb_eNoMemError, "Failed to allocate row buffer");
+
+  row->values = (VALUE *)buf;
+  row->cells = (row_cell_t *)(buf + column_count * sizeof(VALUE));
+  row->data = buf + column_count * (sizeof(VALUE) + sizeof(row_cell_t));
+  row->data_len = data_len;
+
+  size_t ofs = 0;
+  for (int i = 0; i < column_count; i++) {
+    row_cell_t *cell = row->cells + i;
+    row->values[i] = Qundef;
+    cell->type = sqlite3_column_type(stmt, i);
+    switch (cell->type) {
+      case SQLITE_INTEGER:
+        cell->v.i = sqlite3_column_int64(stmt, i);
+        break;
+      case SQLITE_FLOAT:
+        cell->v.d = sqlite3_column_double(stmt, i);
+        break;
+      case SQLITE_TEXT:
+        cell->len = sqlite3_column_bytes(stmt, i);
+        cell->v.ofs = ofs;
+        memcpy(row->data + ofs, sqlite3_column_text(stmt, i), cell->len + 1);
+        ofs += cell->len + 1;
+        break;
+      case SQLITE_BLOB:
+        cell->len = sqlite3_column_bytes(stmt, i);
+        cell->v.ofs = ofs;
+        if (cell->len) memcpy(row->data + ofs, sqlite3_column_blob(stmt, i), cell->len);
+        ofs += cell->len;
+        break;
+    }
+  }
+  row->column_count = column_count;
+
+  if (freeze) {
+    for (int i = 0; i < column_count; i++)
+      rb_obj_freeze(Row_convert(row, i));
+    rb_obj_freeze(obj);
+  }
+
+  return obj;
+}
+
+static inline VALUE Row_convert(Row_t *row, int idx) {
+  row_cell_t *cell;
+
+  if (row->values[idx] != Qundef) return row->values[idx];
+
+  cell = row->cells + idx;
+  switch (cell->type) {
+    case SQLITE_NULL:
+      row->values[idx] = Qnil;
+      break;
+    case SQLITE_INTEGER:
+      row->values[idx] = LL2NUM(cell->v.i);
+      break;
+    case SQLITE_FLOAT:
+      row->values[idx] = DBL2NUM(cell->v.d);
+      break;
+    case SQLITE_TEXT:
+      row->values[idx] = rb_str_new_cstr(row->data + cell->v.ofs);
+      break;
+    case SQLITE_BLOB:
+      row->values[idx] = rb_str_new(row->data + cell->v.ofs, cell->len);
+      break;
+    default:
+      rb_raise(cError, "Unknown column type: %d", cell->type);
+  }
+  return row->values[idx];
+}
+
+// Returns the column index for the given key, or -1 if not found.
+static int Row_column_index(Row_t *row, VALUE key) {
+  switch (TYPE(key)) {
+    case T_FIXNUM: {
+      long idx = FIX2LONG(key);
+      if (idx < 0) idx += row->column_count;
+      return (idx >= 0 && idx < row->column_count) ? (int)idx : -1;
+    }
+    case T_STRING: {
+      ID id = rb_check_id(&key);
+      if (!id) return -1;
+      key = ID2SYM(id);
+    }
+    case T_SYMBOL:
+      for (int i = 0; i < row->column_count; i++)
+        if (RARRAY_AREF(row->column_names, i) == key) return i;
+      return -1;
+    default:
+      rb_raise(rb_eTypeError, "Expected column index or name");
+  }
+  return -1;
+}
+
+/* call-seq:
+ *   row[idx] -> value
+ *   row[name] -> value
+ *
+ * Returns the value for the given column index or column name (as a symbol or
+ * string). Returns nil if no such column exists.
+ */
+VALUE Row_aref(VALUE self, VALUE key) {
+  Row_t *row;
+  GetRow(self, row);
+
+  int idx = Row_column_index(row, key);
+  return idx == -1 ? Qnil : Row_convert(row, idx);
+}
+
+/* call-seq:
+ *   row.fetch(key) -> value
+ *   row.fetch(key, default) -> value
+ *   row.fetch(key) { |key| } -> value
+ *
+ * Returns the value for the given column index or column name. If no such
+ * column exists, returns the given default value or the result of calling the
+ * given block. Otherwise a `KeyError` is raised.
+ */
+VALUE Row_fetch(int argc, VALUE *argv, VALUE self) {
+  VALUE key, default_value, block;
+  Row_t *row;
+  GetRow(self, row);
+
+  rb_scan_args(argc, argv, "11&", &key, &default_value, &block);
+
+  int idx = Row_column_index(row, key);
+  if (idx != -1) return Row_convert(row, idx);
+
+  if (block != Qnil) return rb_yield(key);
+  if (argc == 2) return default_value;
+  rb_raise(rb_eKeyError, "Column not found: %"PRIsVALUE, rb_inspect(key));
+}
+
+/* call-seq:
+ *   row.to_h -> hash
+ *
+ * Returns a hash mapping column names to values.
+ */
+VALUE Row_to_h(VALUE self) {
+  Row_t *row;
+  GetRow(self, row);
+
+  VALUE hash = rb_hash_new();
+  for (int i = 0; i < row->column_count; i++)
+    rb_hash_aset(hash, RARRAY_AREF(row->column_names, i), Row_convert(row, i));
+  return hash;
+}
+
+/* call-seq:
+ *   row.to_a -> array
+ *
+ * Returns an array containing the row values.
+ */
+VALUE Row_to_a(VALUE self) {
+  Row_t *row;
+  GetRow(self, row);
+
+  VALUE ary = rb_ary_new2(row->column_count);
+  for (int i = 0; i < row->column_count; i++)
+    rb_ary_push(ary, Row_convert(row, i));
+  return ary;
+}
+
+/* call-seq:
+ *   row.columns -> [...]
+ *
+ * Returns the column names for the row.
+ */
+VALUE Row_columns(VALUE self) {
+  Row_t *row;
+  GetRow(self, row);
+  return row->column_names;
+}
+
+/* call-seq:
+ *   row.size -> count
+ *   row.length -> count
+ *
+ * Returns the number of columns in the row.
+ */
+VALUE Row_size_m(VALUE self) {
+  Row_t *row;
+  GetRow(self, row);
+  return INT2FIX(row->column_count);
+}
+
+void Init_ExtraliteRow(void) {
+  VALUE mExtralite = rb_define_module("Extralite");
+
+  cRow = rb_define_class_under(mExtralite, "Row", rb_cObject);
+  rb_undef_alloc_func(cRow);
+
+  rb_define_method(cRow, "[]", Row_aref, 1);
+  rb_define_method(cRow, "columns", Row_columns, 0);
+  rb_define_method(cRow, "fetch", Row_fetch, -1);
+  rb_define_method(cRow, "length", Row_size_m, 0);
+  rb_define_method(cRow, "size", Row_size_m, 0);
+  rb_define_method(cRow, "to_a", Row_to_a, 0);
+  rb_define_method(cRow, "to_h", Row_to_h, 0);
+}
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <time.h>
+#include "extralite.h"
+
+/*
+The stats VFS (`extralite-stats`) is a pass-through shim on top of the default
+VFS, counting reads, writes and syncs, along with the number of bytes
+transferred and the latency of each operation, per file type. It is only used
+by databases opened with the `io_stats: true` option, so other connections pay
+no overhead.
+
+Each connection's main database file holds a reference-counted stats struct,
+which is shared with the WAL and rollback journal files opened by the same
+connection. Those are found by their database filename, which SQLite stores in
+the same buffer as the main database filename. Temporary files have no such
+link, and are attributed to the connection whose main database was most
+recently locked on the current thread, which is the connection running the
+statement opening the temporary file.
+
+Reads of memory-mapped pages (see `PRAGMA mmap_size`) do not perform any I/O
+calls, and are not counted.
+*/
+
+// Latency histogram buckets: bucket i counts operations taking less than 2^i
+// microseconds (and at least 2^(i-1) microseconds), the last bucket counting
+// all longer operations.
+#define STATS_LATENCY_BUCKETS 24
+
+enum {
+  STATS_MAIN,
+  STATS_WAL,
+  STATS_JOURNAL,
+  STATS_TEMP,
+  STATS_FILE_TYPES
+};
+
+typedef struct {
+  sqlite3_int64 count;
+  sqlite3_int64 bytes;
+  sqlite3_int64 time_ns;
+  sqlite3_int64 latency[STATS_LATENCY_BUCKETS];
+} stats_op;
+
+typedef struct {
+  stats_op reads;
+  stats_op writes;
+  stats_op syncs;
+} stats_counters;
+
+typedef struct io_stats {
+  int refcount;
+  const char *db_name;
+  struct io_stats *next;
+  stats_counters files[STATS_FILE_TYPES];
+} io_stats;
+
+typedef struct {
+  sqlite3_file base;
+  sqlite3_file *real;
+  io_stats *stats;
+  stats_counters *counters;
+  int main_db;
+} stats_file;
+
+static sqlite3_vfs stats_vfs;
+static sqlite3_mutex *stats_mutex;
+// stats of open main database files, looked up by WAL and journal files
+static io_stats *stats_list;
+// stats of the connection whose main database was last locked on this thread
+static __thread io_stats *stats_current;
+
+static void stats_retain(io_stats *stats) {
+  __atomic_add_fetch(&stats->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void stats_release(io_stats *stats) {
+  if (__atomic_sub_fetch(&stats->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    sqlite3_free(stats);
+}
+
+static void stats_set_current(io_stats *stats) {
+  if (stats_current == stats) return;
+  if (stats) stats_retain(stats);
+  if (stats_current) stats_release(stats_current);
+  stats_current = stats;
+}
+
+static inline sqlite3_int64 stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void stats_record(stats_op *op, sqlite3_int64 start, int bytes) {
+  sqlite3_int64 elapsed = stats_now() - start;
+  unsigned long long us = elapsed / 1000;
+  int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= STATS_LATENCY_BUCKETS) bucket = STATS_LATENCY_BUCKETS - 1;
+
+  op->count++;
+  op->bytes += bytes;
+  op->time_ns += elapsed;
+  op->latency[bucket]++;
+}
+
+static int stats_close(sqlite3_file *file) {
+  stats_file *f = (stats_file *)file;
+  int rc = f->real->pMethods ? f->real->pMethods->xClose(f->real) : SQLITE_OK;
+
+  if (f->stats) {
+    if (f->main_db) {
+      sqlite3_mutex_enter(stats_mutex);
+      io_stats **ptr = &stats_list;
+      while (*ptr && *ptr != f->stats) ptr = &(*ptr)->next;
+      if (*ptr) *ptr = f->stats->next;
+      sqlite3_mutex_leave(stats_mutex);
+      if (stats_current == f->stats) stats_set_current(NULL);
+    }
+    stats_release(f->stats);
+  }
+  return rc;
+}
+
+static int stats_read(sqlite3_file *file, void *buf, int amt, sqlite3_int64 ofs) {
+  stats_file *f = (stats_file *)file;
+  if (!f->counters) return f->real->pMethods->xRead(f->real, buf, amt, ofs);
+
+  sqlite3_int64 start = stats_now();
+  int rc = f->real->pMethods->xRead(f->real, buf, amt, ofs);
+  stats_record(&f->counters->reads, start, amt);
+  return rc;
+}
+
+static int stats_write(sqlite3_file *file, const void *buf, int amt, sqlite3_int64 ofs) {
+  stats_file *f = (stats_file *)file;
+  if (!f->counters) return f->real->pMethods->xWrite(f->real, buf, amt, ofs);
+
+  sqlite3_int64 start = stats_now();
+  int rc = f->real->pMethods->xWrite(f->real, buf, amt, ofs);
+  stats_record(&f->counters->writes, start, amt);
+  return rc;
+}
+
+static int stats_truncate(sqlite3_file *file, sqlite3_int64 size) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xTruncate(f->real, size);
+}
+
+static int stats_sync(sqlite3_file *file, int flags) {
+  stats_file *f = (stats_file *)file;
+  if (!f->counters) return f->real->pMethods->xSync(f->real, flags);
+
+  sqlite3_int64 start = stats_now();
+  int rc = f->real->pMethods->xSync(f->real, flags);
+  stats_record(&f->counters->syncs, start, 0);
+  return rc;
+}
+
+static int stats_file_size(sqlite3_file *file, sqlite3_int64 *size) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xFileSize(f->real, size);
+}
+
+static int stats_lock(sqlite3_file *file, int lock) {
+  stats_file *f = (stats_file *)file;
+  if (f->main_db) stats_set_current(f->stats);
+  return f->real->pMethods->xLock(f->real, lock);
+}
+
+static int stats_unlock(sqlite3_file *file, int lock) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xUnlock(f->real, lock);
+}
+
+static int stats_check_reserved_lock(sqlite3_file *file, int *out) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xCheckReservedLock(f->real, out);
+}
+
+static int stats_file_control(sqlite3_file *file, int op, void *arg) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xFileControl(f->real, op, arg);
+}
+
+static int stats_sector_size(sqlite3_file *file) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xSectorSize(f->real);
+}
+
+static int stats_device_characteristics(sqlite3_file *file) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xDeviceCharacteristics(f->real);
+}
+
+static int stats_shm_map(sqlite3_file *file, int pg, int pgsz, int extend, void volatile **pp) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xShmMap(f->real, pg, pgsz, extend, pp);
+}
+
+static int stats_shm_lock(sqlite3_file *file, int offset, int n, int flags) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xShmLock(f->real, offset, n, flags);
+}
+
+static void stats_shm_barrier(sqlite3_file *file) {
+  stats_file *f = (stats_file *)file;
+  f->real->pMethods->xShmBarrier(f->real);
+}
+
+static int stats_shm_unmap(sqlite3_file *file, int delete_flag) {
+  stats_file *f = (stats_file *)file;
+  return f->real->pMethods->xShmUnmap(f->real, delete_flag);
+}
+
+static int stats_fetch(sqlite3_file *file, sqlite3_int64 ofs, int amt, void **pp) {
+  stats_file *f = (stats_file *)file;
+  if (f->real->pMethods->iVersion < 3) {
+    *pp = NULL;
+    return SQLITE_OK;
+  }
+  return f->real->pMethods->xFetch(f->real, ofs, amt, pp);
+}
+
+static int stats_unfetch(sqlite3_file *file, sqlite3_int64 ofs, void *p) {
+  stats_file *f = (stats_file *)file;
+  if (f->real->pMethods->iVersion < 3) return SQLITE_OK;
+  return f->real->pMethods->xUnfetch(f->real, ofs, p);
+}
+
+static const sqlite3_io_methods stats_io_methods = {
+  3,
+  stats_close,
+  stats_read,
+  stats_write,
+  stats_truncate,
+  stats_sync,
+  stats_file_size,
+  stats_lock,
+  stats_unlock,
+  stats_check_reserved_lock,
+  stats_file_control,
+  stats_sector_size,
+  stats_device_characteristics,
+  stats_shm_map,
+  stats_shm_lock,
+  stats_shm_barrier,
+  stats_shm_unmap,
+  stats_fetch,
+  stats_unfetch
+};
+
+#define PARENT(vfs) ((sqlite3_vfs *)(vfs)->pAppData)
+
+// Returns a new reference to the stats of the given file.
+static io_stats *stats_for_file(const char *name, int flags, int *type) {
+  io_stats *stats = NULL;
+
+  if (flags & SQLITE_OPEN_MAIN_DB) {
+    *type = STATS_MAIN;
+    stats = sqlite3_malloc(sizeof(io_stats));
+    if (!stats) return NULL;
+    memset(stats, 0, sizeof(io_stats));
+    // the main database file removes the stats from the list when closed
+    stats->refcount = 1;
+    stats->db_name = name;
+    sqlite3_mutex_enter(stats_mutex);
+    stats->next = stats_list;
+    stats_list = stats;
+    sqlite3_mutex_leave(stats_mutex);
+  }
+  else if (name && (flags & (SQLITE_OPEN_WAL | SQLITE_OPEN_MAIN_JOURNAL))) {
+    *type = (flags & SQLITE_OPEN_WAL) ? STATS_WAL : STATS_JOURNAL;
+    const char *db_name = sqlite3_filename_database(name);
+    sqlite3_mutex_enter(stats_mutex);
+    for (stats = stats_list; stats && stats->db_name != db_name; stats = stats->next);
+    if (stats) stats_retain(stats);
+    sqlite3_mutex_leave(stats_mutex);
+  }
+  else if (flags & (SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_SUBJOURNAL |
+                    SQLITE_OPEN_TRANSIENT_DB | SQLITE_OPEN_SUPER_JOURNAL)) {
+    *type = STATS_TEMP;
+    stats = stats_current;
+    if (stats) stats_retain(stats);
+  }
+  return stats;
+}
+
+static int stats_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file, int flags, int *out_flags) {
+  stats_file *f = (stats_file *)file;
+  sqlite3_vfs *parent = PARENT(vfs);
+
+  memset(f, 0, sizeof(stats_file));
+  f->real = (sqlite3_file *)(f + 1);
+
+  int rc = parent->xOpen(parent, name, f->real, flags, out_flags);
+  if (rc != SQLITE_OK) return rc;
+
+  int type = 0;
+  f->stats = stats_for_file(name, flags, &type);
+  if (f->stats) {
+    f->main_db = (type == STATS_MAIN);
+    f->counters = f->stats->files + type;
+  }
+  f->base.pMethods = &stats_io_methods;
+  return SQLITE_OK;
+}
+
+static int stats_delete(sqlite3_vfs *vfs, const char *name, int sync_dir) {
+  return PARENT(vfs)->xDelete(PARENT(vfs), name, sync_dir);
+}
+
+static int stats_access(sqlite3_vfs *vfs, const char *name, int flags, int *out) {
+  return PARENT(vfs)->xAccess(PARENT(vfs), name, flags, out);
+}
+
+static int stats_full_pathname(sqlite3_vfs *vfs, const char *name, int n, char *out) {
+  return PARENT(vfs)->xFullPathname(PARENT(vfs), name, n, out);
+}
+
+static void *stats_dl_open(sqlite3_vfs *vfs, const char *path) {
+  return PARENT(vfs)->xDlOpen(PARENT(vfs), path);
+}
+
+static void stats_dl_error(sqlite3_vfs *vfs, int n, char *msg) {
+  PARENT(vfs)->xDlError(PARENT(vfs), n, msg);
+}
+
+static void (*stats_dl_sym(sqlite3_vfs *vfs, void *handle, const char *sym))(void) {
+  return PARENT(vfs)->xDlSym(PARENT(vfs), handle, sym);
+}
+
+static void stats_dl_close(sqlite3_vfs *vfs, void *handle) {
+  PARENT(vfs)->xDlClose(PARENT(vfs), handle);
+}
+
+static int stats_randomness(sqlite3_vfs *vfs, int n, char *out) {
+  return PARENT(vfs)->xRandomness(PARENT(vfs), n, out);
+}
+
+static int stats_sleep(sqlite3_vfs *vfs, int us) {
+  return PARENT(vfs)->xSleep(PARENT(vfs), us);
+}
+
+static int stats_current_time(sqlite3_vfs *vfs, double *out) {
+  return PARENT(vfs)->xCurrentTime(PARENT(vfs), out);
+}
+
+static int stats_get_last_error(sqlite3_vfs *vfs, int n, char *out) {
+  return PARENT(vfs)->xGetLastError(PARENT(vfs), n, out);
+}
+
+static int stats_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *out) {
+  return PARENT(vfs)->xCurrentTimeInt64(PARENT(vfs), out);
+}
+
+static void stats_vfs_init(sqlite3_vfs *vfs, sqlite3_vfs *parent, const char *name) {
+  memset(vfs, 0, sizeof(sqlite3_vfs));
+  vfs->iVersion = 2;
+  vfs->szOsFile = sizeof(stats_file) + parent->szOsFile;
+  vfs->mxPathname = parent->mxPathname;
+  vfs->zName = name;
+  vfs->pAppData = parent;
+  vfs->xOpen = stats_open;
+  vfs->xDelete = stats_delete;
+  vfs->xAccess = stats_access;
+  vfs->xFullPathname = stats_full_pathname;
+  vfs->xDlOpen = stats_dl_open;
+  vfs->xDlError = stats_dl_error;
+  vfs->xDlSym = stats_dl_sym;
+  vfs->xDlClose = stats_dl_close;
+  vfs->xRandomness = stats_randomness;
+  vfs->xSleep = stats_sleep;
+  vfs->xCurrentTime = stats_current_time;
+  vfs->xGetLastError = stats_get_last_error;
+  vfs->xCurrentTimeInt64 = stats_current_time_int64;
+}
+
+static VALUE SYM_main;
+static VALUE SYM_wal;
+static VALUE SYM_journal;
+static VALUE SYM_temp;
+
+// Returns the stats of the given database's connection, or NULL if the
+// database was not opened with the `io_stats: true` option.
+static io_stats *Database_io_stats_struct(VALUE self) {
+  sqlite3_file *file = NULL;
+  Database_t *db = Database_open_struct(self);
+  if (sqlite3_file_control(db->sqlite3_db, "main", SQLITE_FCNTL_FILE_POINTER, &file) != SQLITE_OK) return NULL;
+  if (!file || file->pMethods != &stats_io_methods) return NULL;
+  return ((stats_file *)file)->stats;
+}
+
+static VALUE stats_op_hash(VALUE hash, const char *name, stats_op *op, int with_bytes) {
+  char key[32];
+  rb_hash_aset(hash, ID2SYM(rb_intern(name)), LL2NUM(op->count));
+  if (with_bytes) {
+    snprintf(key, sizeof(key), "%s_bytes", name);
+    rb_hash_aset(hash, ID2SYM(rb_intern(key)), LL2NUM(op->bytes));
+  }
+  snprintf(key, sizeof(key), "%s_time", name);
+  rb_hash_aset(hash, ID2SYM(rb_intern(key)), DBL2NUM(op->time_ns / 1e9));
+
+  VALUE latency = rb_ary_new_capa(STATS_LATENCY_BUCKETS);
+  for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) rb_ary_push(latency, LL2NUM(op->latency[i]));
+  snprintf(key, sizeof(key), "%s_latency", name);
+  rb_hash_aset(hash, ID2SYM(rb_intern(key)), latency);
+  return hash;
+}
+
+static VALUE stats_counters_hash(stats_counters *counters) {
+  VALUE hash = rb_hash_new();
+  stats_op_hash(hash, "reads", &counters->reads, 1);
+  stats_op_hash(hash, "writes", &counters->writes, 1);
+  stats_op_hash(hash, "syncs", &counters->syncs, 0);
+  return hash;
+}
+
+/* call-seq:
+ *   db.io_stats -> hash or nil
+ *
+ * Returns I/O statistics for the database, if opened with the `io_stats: true`
+ * option, otherwise returns nil. Statistics are given per file type: `:main`
+ * (the main database file), `:wal`, `:journal` (the rollback journal) and
+ * `:temp` (temporary databases and journals). For each file type, the number
+ * of reads, writes and syncs is given, along with the number of bytes read and
+ * written, the total time spent in seconds, and a latency histogram, e.g.
+ * `:reads_latency`, an array in which element `i` counts the operations taking
+ * less than `2**i` microseconds (and at least `2**(i-1)` microseconds), the
+ * last element counting all longer operations:
+ *
+ *     db = Extralite::Database.new('/tmp/my.db', io_stats: true)
+ *     db.io_stats[:main] #=> { reads: 12, reads_bytes: 49152, reads_time: 0.0001, ... }
+ *
+ * Pages read from a memory-mapped database (see `PRAGMA mmap_size`) are not
+ * counted.
+ */
+VALUE Database_io_stats(VALUE self) {
+  io_stats *stats = Database_io_stats_struct(self);
+  if (!stats) return Qnil;
+
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, SYM_main, stats_counters_hash(stats->files + STATS_MAIN));
+  rb_hash_aset(hash, SYM_wal, stats_counters_hash(stats->files + STATS_WAL));
+  rb_hash_aset(hash, SYM_journal, stats_counters_hash(stats->files + STATS_JOURNAL));
+  rb_hash_aset(hash, SYM_temp, stats_counters_hash(stats->files + STATS_TEMP));
+  return hash;
+}
+
+/* call-seq:
+ *   db.reset_io_stats -> db
+ *
+ * Resets the I/O statistics for the database (see `#io_stats`).
+ */
+VALUE Database_reset_io_stats(VALUE self) {
+  io_stats *stats = Database_io_stats_struct(self);
+  if (stats) memset(stats->files, 0, sizeof(stats->files));
+  return self;
+}
+
+void Init_ExtraliteStatsVFS(void) {
+  sqlite3_vfs *parent = sqlite3_vfs_find(NULL);
+
+  if (parent) {
+    stats_mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    stats_vfs_init(&stats_vfs, parent, "extralite-stats");
+    sqlite3_vfs_register(&stats_vfs, 0);
+  }
+
+  rb_define_method(cDatabase, "io_stats", Database_io_stats, 0);
+  rb_define_method(cDatabase, "reset_io_stats", Database_reset_io_stats, 0);
+
+  SYM_main = ID2SYM(rb_intern("main"));
+  SYM_wal = ID2SYM(rb_intern("wal"));
+  SYM_journal = ID2SYM(rb_intern("journal"));
+  SYM_temp = ID2SYM(rb_intern("temp"));
+}
@@ -0,0 +1,743 @@
+#define _GNU_SOURCE 1 // for O_DIRECT
+#include <stdio.h>
+#include "extralite.h"
+
+/*
+The io_uring VFS is a shim on top of the default (unix) VFS, available on Linux.
+Writes to main database and WAL files are not performed immediately, but are
+instead copied into a list of pending writes. Before SQLite syncs, truncates,
+unlocks or closes the file, reads an overlapping region, or updates the WAL
+index, the pending writes are sorted, coalesced into runs of contiguous pages,
+and submitted to the kernel as a single batch of vectored writes using an
+io_uring instance (created with raw syscalls, one per file). Where io_uring is
+not available (old kernels or restricted by seccomp), batches are written using
+pwritev instead. Sequential reads trigger readahead of the following region of
+the file.
+
+Writes are performed on the file descriptor opened by the underlying unix VFS.
+A second descriptor is never opened, since closing it would release the POSIX
+locks held by the process on the file. The descriptor is only available with
+the bundled SQLite (see unix_file_fd), otherwise all I/O is passed through.
+
+The `extralite-uring-direct` variant writes main database files with O_DIRECT,
+bypassing the OS page cache, which is useful when SQLite's own page cache is
+large enough to hold the working set. O_DIRECT is set on the file descriptor
+only while flushing pending writes, which are always aligned.
+
+Since SQLite updates the WAL index through the main database file, each main
+database file is linked to its WAL file (the WAL file name passed to xOpen
+refers to the same buffer as the database file name), and the pending WAL
+writes are flushed before the WAL index is updated.
+
+All other file operations (including locking and shared memory) are passed
+through to the underlying VFS.
+*/
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 64
+#define URING_MAX_PENDING_BYTES (16 << 20)
+#define URING_READAHEAD_TRIGGER 4
+#define URING_READAHEAD_WINDOW (1 << 20)
+#define URING_DIRECT_ALIGN 4096
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+} uring_t;
+
+static int uring_setup(uring_t *ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(uring_t));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) return -1;
+
+  ring->sq_entries = p.sq_entries;
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+    ring->cq_len = 0;
+  }
+
+  ring->sq_ptr = mmap(0, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) goto error;
+
+  if (ring->cq_len) {
+    ring->cq_ptr = mmap(0, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) goto error;
+  }
+  else
+    ring->cq_ptr = ring->sq_ptr;
+
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(0, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto error;
+
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+  return 0;
+error:
+  if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_len && ring->cq_ptr && ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_len);
+  if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+  close(ring->fd);
+  ring->fd = -1;
+  return -1;
+}
+
+static void uring_teardown(uring_t *ring) {
+  munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_len) munmap(ring->cq_ptr, ring->cq_len);
+  munmap(ring->sq_ptr, ring->sq_len);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+typedef struct {
+  sqlite3_int64 ofs;
+  int len;
+  int seq;
+  char *buf;
+} uring_pending_write;
+
+typedef struct {
+  sqlite3_int64 ofs;
+  int iov;
+  int iovcnt;
+  size_t len;
+} uring_run;
+
+typedef struct uring_file uring_file;
+
+struct uring_file {
+  sqlite3_file base;
+  sqlite3_file *real;
+  const char *name;
+  uring_file *wal;
+  uring_file *db;
+  uring_file *next_db;
+  int fd;
+  int writable;
+  int direct;
+  int ring_state;
+  uring_t ring;
+  uring_pending_write *writes;
+  int write_count;
+  int write_capacity;
+  int seq;
+  sqlite3_int64 pending_bytes;
+  sqlite3_int64 pending_min;
+  sqlite3_int64 pending_max;
+  sqlite3_int64 last_read_end;
+  sqlite3_int64 readahead_end;
+  int sequential_reads;
+};
+
+// main database files, looked up when opening a WAL file
+static uring_file *uring_db_files = NULL;
+static sqlite3_mutex *uring_mutex = NULL;
+
+static void uring_register_db(uring_file *f) {
+  sqlite3_mutex_enter(uring_mutex);
+  f->next_db = uring_db_files;
+  uring_db_files = f;
+  sqlite3_mutex_leave(uring_mutex);
+}
+
+static void uring_unregister_db(uring_file *f) {
+  sqlite3_mutex_enter(uring_mutex);
+  for (uring_file **ptr = &uring_db_files; *ptr; ptr = &(*ptr)->next_db)
+    if (*ptr == f) {
+      *ptr = f->next_db;
+      break;
+    }
+  sqlite3_mutex_leave(uring_mutex);
+}
+
+static void uring_link_wal(uring_file *wal, const char *db_name) {
+  sqlite3_mutex_enter(uring_mutex);
+  for (uring_file *f = uring_db_files; f; f = f->next_db)
+    if (f->name == db_name) {
+      f->wal = wal;
+      wal->db = f;
+      break;
+    }
+  sqlite3_mutex_leave(uring_mutex);
+}
+
+// Writes the given iovecs, skipping the first `skip` bytes already written.
+static int uring_pwritev_all(int fd, struct iovec *iov, int iovcnt, sqlite3_int64 ofs, size_t skip) {
+  if (!skip) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    ssize_t n;
+    do { n = pwritev(fd, iov, iovcnt, ofs); } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+    if ((size_t)n == total) return 0;
+    skip = n;
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    size_t len = iov[i].iov_len;
+    if (skip >= len) {
+      skip -= len;
+      ofs += len;
+      continue;
+    }
+    char *buf = (char *)iov[i].iov_base + skip;
+    sqlite3_int64 pos = ofs + skip;
+    len -= skip;
+    ofs += iov[i].iov_len;
+    skip = 0;
+    while (len) {
+      ssize_t n = pwrite(fd, buf, len, pos);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      buf += n;
+      pos += n;
+      len -= n;
+    }
+  }
+  return 0;
+}
+
+static int uring_submit_runs(uring_file *f, uring_run *runs, int count, struct iovec *iovs) {
+  uring_t *ring = &f->ring;
+  int done = 0;
+
+  while (done < count) {
+    int batch = count - done;
+    if (batch > (int)ring->sq_entries) batch = ring->sq_entries;
+
+    unsigned tail = *ring->sq_tail;
+    unsigned mask = *ring->sq_mask;
+    for (int i = 0; i < batch; i++) {
+      uring_run *run = runs + done + i;
+      unsigned idx = tail & mask;
+      struct io_uring_sqe *sqe = ring->sqes + idx;
+      memset(sqe, 0, sizeof(struct io_uring_sqe));
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->fd = f->fd;
+      sqe->addr = (unsigned long)(iovs + run->iov);
+      sqe->len = run->iovcnt;
+      sqe->off = run->ofs;
+      sqe->user_data = done + i;
+      ring->sq_array[idx] = idx;
+      tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    int completed = 0;
+    int failed = 0;
+    while (completed < batch) {
+      int to_submit = batch - submitted;
+      int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      submitted += ret;
+
+      unsigned head = *ring->cq_head;
+      unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      while (head != cq_tail) {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+        uring_run *run = runs + cqe->user_data;
+        if (cqe->res < 0)
+          failed = 1;
+        else if ((size_t)cqe->res < run->len) {
+          // complete short writes synchronously
+          if (uring_pwritev_all(f->fd, iovs + run->iov, run->iovcnt, run->ofs, cqe->res)) failed = 1;
+        }
+        head++;
+        completed++;
+      }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (failed) return -1;
+    done += batch;
+  }
+  return 0;
+}
+
+static int uring_write_cmp(const void *a, const void *b) {
+  const uring_pending_write *wa = a;
+  const uring_pending_write *wb = b;
+  if (wa->ofs != wb->ofs) return wa->ofs < wb->ofs ? -1 : 1;
+  return wa->seq - wb->seq;
+}
+
+static int uring_write_seq_cmp(const void *a, const void *b) {
+  return ((const uring_pending_write *)a)->seq - ((const uring_pending_write *)b)->seq;
+}
+
+static void uring_discard_writes(uring_file *f) {
+  for (int i = 0; i < f->write_count; i++) free(f->writes[i].buf);
+  f->write_count = 0;
+  f->pending_bytes = 0;
+}
+
+static int uring_flush(uring_file *f) {
+  if (!f->write_count) return SQLITE_OK;
+
+  uring_pending_write *w = f->writes;
+  int count = 0;
+  int overlap = 0;
+  int rc = 0;
+
+  // sort by offset, dropping writes superseded by a later write of the same page
+  qsort(w, f->write_count, sizeof(uring_pending_write), uring_write_cmp);
+  for (int i = 0; i < f->write_count; i++) {
+    if (count && w[count - 1].ofs == w[i].ofs && w[count - 1].len == w[i].len) {
+      free(w[count - 1].buf);
+      w[count - 1] = w[i];
+      continue;
+    }
+    if (count && w[count - 1].ofs + w[count - 1].len > w[i].ofs) overlap = 1;
+    w[count++] = w[i];
+  }
+  f->write_count = count;
+
+  struct iovec *iovs = malloc(count * sizeof(struct iovec));
+  uring_run *runs = malloc(count * sizeof(uring_run));
+  int fl = -1;
+  if (!iovs || !runs) {
+    rc = -1;
+    goto done;
+  }
+
+  if (f->direct) {
+    fl = fcntl(f->fd, F_GETFL);
+    if (fl == -1 || fcntl(f->fd, F_SETFL, fl | O_DIRECT) == -1) fl = -1;
+  }
+
+  if (overlap) {
+    // partially overlapping writes are performed in their original order
+    qsort(w, count, sizeof(uring_pending_write), uring_write_seq_cmp);
+    for (int i = 0; i < count && !rc; i++) {
+      iovs[i].iov_base = w[i].buf;
+      iovs[i].iov_len = w[i].len;
+      rc = uring_pwritev_all(f->fd, iovs + i, 1, w[i].ofs, 0);
+    }
+    goto done;
+  }
+
+  // coalesce contiguous writes into runs of iovecs
+  int run_count = 0;
+  for (int i = 0; i < count; i++) {
+    iovs[i].iov_base = w[i].buf;
+    iovs[i].iov_len = w[i].len;
+    uring_run *run = run_count ? runs + run_count - 1 : NULL;
+    if (run && run->ofs + (sqlite3_int64)run->len == w[i].ofs && run->iovcnt < IOV_MAX) {
+      run->iovcnt++;
+      run->len += w[i].len;
+    }
+    else {
+      run = runs + run_count++;
+      run->ofs = w[i].ofs;
+      run->iov = i;
+      run->iovcnt = 1;
+      run->len = w[i].len;
+    }
+  }
+
+  if (f->ring_state == 0) f->ring_state = uring_setup(&f->ring, URING_ENTRIES) ? -1 : 1;
+  if (f->ring_state == 1)
+    rc = uring_submit_runs(f, runs, run_count, iovs);
+  else
+    for (int i = 0; i < run_count && !rc; i++)
+      rc = uring_pwritev_all(f->fd, iovs + runs[i].iov, runs[i].iovcnt, runs[i].ofs, 0);
+
+done:
+  if (fl != -1) fcntl(f->fd, F_SETFL, fl);
+  free(iovs);
+  free(runs);
+  uring_discard_writes(f);
+  return rc ? SQLITE_IOERR_WRITE : SQLITE_OK;
+}
+
+static int uring_close(sqlite3_file *file) {
+  uring_file *f = (uring_file *)file;
+  int rc = uring_flush(f);
+
+  if (f->name) uring_unregister_db(f);
+  if (f->wal) f->wal->db = NULL;
+  if (f->db) f->db->wal = NULL;
+
+  free(f->writes);
+  if (f->ring_state == 1) uring_teardown(&f->ring);
+
+  int rc2 = f->real->pMethods ? f->real->pMethods->xClose(f->real) : SQLITE_OK;
+  return rc != SQLITE_OK ? rc : rc2;
+}
+
+static int uring_read(sqlite3_file *file, void *buf, int amt, sqlite3_int64 ofs) {
+  uring_file *f = (uring_file *)file;
+
+  if (f->write_count && ofs < f->pending_max && ofs + amt > f->pending_min) {
+    int rc = uring_flush(f);
+    if (rc != SQLITE_OK) return rc;
+  }
+
+  if (f->fd >= 0) {
+    f->sequential_reads = (ofs == f->last_read_end) ? f->sequential_reads + 1 : 0;
+    f->last_read_end = ofs + amt;
+    if (f->sequential_reads >= URING_READAHEAD_TRIGGER && f->last_read_end + URING_READAHEAD_WINDOW / 2 >= f->readahead_end) {
+      sqlite3_int64 start = f->last_read_end > f->readahead_end ? f->last_read_end : f->readahead_end;
+      posix_fadvise(f->fd, start, URING_READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+      f->readahead_end = start + URING_READAHEAD_WINDOW;
+    }
+  }
+
+  return f->real->pMethods->xRead(f->real, buf, amt, ofs);
+}
+
+static int uring_write(sqlite3_file *file, const void *buf, int amt, sqlite3_int64 ofs) {
+  uring_file *f = (uring_file *)file;
+
+  if (!f->writable)
+    return f->real->pMethods->xWrite(f->real, buf, amt, ofs);
+
+  if (f->direct && ((ofs % URING_DIRECT_ALIGN) || (amt % URING_DIRECT_ALIGN))) {
+    // unaligned writes cannot use O_DIRECT
+    int rc = uring_flush(f);
+    return rc != SQLITE_OK ? rc : f->real->pMethods->xWrite(f->real, buf, amt, ofs);
+  }
+
+  if (f->write_count == f->write_capacity) {
+    int capacity = f->write_capacity ? f->write_capacity * 2 : 64;
+    uring_pending_write *writes = realloc(f->writes, capacity * sizeof(uring_pending_write));
+    if (!writes) return SQLITE_IOERR_NOMEM;
+    f->writes = writes;
+    f->write_capacity = capacity;
+  }
+
+  char *copy = NULL;
+  if (f->direct) {
+    if (posix_memalign((void **)&copy, URING_DIRECT_ALIGN, amt)) copy = NULL;
+  }
+  else
+    copy = malloc(amt);
+  if (!copy) return SQLITE_IOERR_NOMEM;
+  memcpy(copy, buf, amt);
+
+  uring_pending_write *w = f->writes + f->write_count++;
+  w->ofs = ofs;
+  w->len = amt;
+  w->seq = f->seq++;
+  w->buf = copy;
+
+  if (f->write_count == 1 || ofs < f->pending_min) f->pending_min = ofs;
+  if (f->write_count == 1 || ofs + amt > f->pending_max) f->pending_max = ofs + amt;
+  f->pending_bytes += amt;
+
+  return (f->pending_bytes >= URING_MAX_PENDING_BYTES) ? uring_flush(f) : SQLITE_OK;
+}
+
+static int uring_truncate(sqlite3_file *file, sqlite3_int64 size) {
+  uring_file *f = (uring_file *)file;
+  int rc = uring_flush(f);
+  return rc != SQLITE_OK ? rc : f->real->pMethods->xTruncate(f->real, size);
+}
+
+static int uring_sync(sqlite3_file *file, int flags) {
+  uring_file *f = (uring_file *)file;
+  int rc = uring_flush(f);
+  return rc != SQLITE_OK ? rc : f->real->pMethods->xSync(f->real, flags);
+}
+
+static int uring_file_size(sqlite3_file *file, sqlite3_int64 *size) {
+  uring_file *f = (uring_file *)file;
+  int rc = f->real->pMethods->xFileSize(f->real, size);
+  if (rc == SQLITE_OK && f->write_count && f->pending_max > *size) *size = f->pending_max;
+  return rc;
+}
+
+static int uring_lock(sqlite3_file *file, int lock) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xLock(f->real, lock);
+}
+
+static int uring_unlock(sqlite3_file *file, int lock) {
+  uring_file *f = (uring_file *)file;
+  int rc = uring_flush(f);
+  return rc != SQLITE_OK ? rc : f->real->pMethods->xUnlock(f->real, lock);
+}
+
+static int uring_check_reserved_lock(sqlite3_file *file, int *out) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xCheckReservedLock(f->real, out);
+}
+
+static int uring_file_control(sqlite3_file *file, int op, void *arg) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xFileControl(f->real, op, arg);
+}
+
+static int uring_sector_size(sqlite3_file *file) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xSectorSize(f->real);
+}
+
+static int uring_device_characteristics(sqlite3_file *file) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xDeviceCharacteristics(f->real);
+}
+
+static int uring_shm_map(sqlite3_file *file, int pg, int pgsz, int extend, void volatile **pp) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xShmMap(f->real, pg, pgsz, extend, pp);
+}
+
+// WAL frames (and checkpointed pages) must be written before the WAL index is
+// updated
+static int uring_shm_flush(uring_file *f) {
+  int rc = f->wal ? uring_flush(f->wal) : SQLITE_OK;
+  return rc != SQLITE_OK ? rc : uring_flush(f);
+}
+
+static int uring_shm_lock(sqlite3_file *file, int offset, int n, int flags) {
+  uring_file *f = (uring_file *)file;
+  int rc = uring_shm_flush(f);
+  return rc != SQLITE_OK ? rc : f->real->pMethods->xShmLock(f->real, offset, n, flags);
+}
+
+static void uring_shm_barrier(sqlite3_file *file) {
+  uring_file *f = (uring_file *)file;
+  uring_shm_flush(f);
+  f->real->pMethods->xShmBarrier(f->real);
+}
+
+static int uring_shm_unmap(sqlite3_file *file, int delete_flag) {
+  uring_file *f = (uring_file *)file;
+  return f->real->pMethods->xShmUnmap(f->real, delete_flag);
+}
+
+// version 2: memory-mapped I/O (xFetch) is not supported, since it would bypass
+// pending writes
+static const sqlite3_io_methods uring_io_methods = {
+  2,
+  uring_close,
+  uring_read,
+  uring_write,
+  uring_truncate,
+  uring_sync,
+  uring_file_size,
+  uring_lock,
+  uring_unlock,
+  uring_check_reserved_lock,
+  uring_file_control,
+  uring_sector_size,
+  uring_device_characteristics,
+  uring_shm_map,
+  uring_shm_lock,
+  uring_shm_barrier,
+  uring_shm_unmap
+};
+
+#define PARENT(vfs) ((sqlite3_vfs *)(vfs)->pAppData)
+
+static sqlite3_vfs uring_vfs;
+static sqlite3_vfs uring_direct_vfs;
+
+// Returns true if O_DIRECT can be set on the given file descriptor
+static int uring_direct_supported(int fd) {
+  int fl = fcntl(fd, F_GETFL);
+  if (fl == -1 || fcntl(fd, F_SETFL, fl | O_DIRECT) == -1) return 0;
+
+  fcntl(fd, F_SETFL, fl);
+  return 1;
+}
+
+static int uring_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file, int flags, int *out_flags) {
+  uring_file *f = (uring_file *)file;
+  sqlite3_vfs *parent = PARENT(vfs);
+  int open_flags = 0;
+
+  memset(f, 0, sizeof(uring_file));
+  f->real = (sqlite3_file *)(f + 1);
+  f->fd = -1;
+
+  int rc = parent->xOpen(parent, name, f->real, flags, &open_flags);
+  if (out_flags) *out_flags = open_flags;
+  if (rc != SQLITE_OK) return rc;
+
+  // the file descriptor is known only for files opened by the unix VFS, other
+  // files are passed through
+  if (name && (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL)))
+    f->fd = unix_file_fd(parent, f->real);
+  if (f->fd >= 0) {
+    f->writable = !(open_flags & SQLITE_OPEN_READONLY);
+    f->direct = f->writable && (vfs == &uring_direct_vfs) && (flags & SQLITE_OPEN_MAIN_DB) &&
+      uring_direct_supported(f->fd);
+
+    if (flags & SQLITE_OPEN_MAIN_DB) {
+      f->name = name;
+      uring_register_db(f);
+    }
+    else {
+#ifdef HAVE_SQLITE3_FILENAME_DATABASE
+      uring_link_wal(f, sqlite3_filename_database(name));
+#endif
+      // WAL writes are buffered only if they can be flushed before the WAL
+      // index is updated
+      if (!f->db) f->writable = 0;
+    }
+  }
+
+  f->base.pMethods = &uring_io_methods;
+  return SQLITE_OK;
+}
+
+static int uring_delete(sqlite3_vfs *vfs, const char *name, int sync_dir) {
+  return PARENT(vfs)->xDelete(PARENT(vfs), name, sync_dir);
+}
+
+static int uring_access(sqlite3_vfs *vfs, const char *name, int flags, int *out) {
+  return PARENT(vfs)->xAccess(PARENT(vfs), name, flags, out);
+}
+
+static int uring_full_pathname(sqlite3_vfs *vfs, const char *name, int n, char *out) {
+  return PARENT(vfs)->xFullPathname(PARENT(vfs), name, n, out);
+}
+
+static void *uring_dl_open(sqlite3_vfs *vfs, const char *path) {
+  return PARENT(vfs)->xDlOpen(PARENT(vfs), path);
+}
+
+static void uring_dl_error(sqlite3_vfs *vfs, int n, char *msg) {
+  PARENT(vfs)->xDlError(PARENT(vfs), n, msg);
+}
+
+static void (*uring_dl_sym(sqlite3_vfs *vfs, void *handle, const char *sym))(void) {
+  return PARENT(vfs)->xDlSym(PARENT(vfs), handle, sym);
+}
+
+static void uring_dl_close(sqlite3_vfs *vfs, void *handle) {
+  PARENT(vfs)->xDlClose(PARENT(vfs), handle);
+}
+
+static int uring_randomness(sqlite3_vfs *vfs, int n, char *out) {
+  return PARENT(vfs)->xRandomness(PARENT(vfs), n, out);
+}
+
+static int uring_sleep(sqlite3_vfs *vfs, int us) {
+  return PARENT(vfs)->xSleep(PARENT(vfs), us);
+}
+
+static int uring_current_time(sqlite3_vfs *vfs, double *out) {
+  return PARENT(vfs)->xCurrentTime(PARENT(vfs), out);
+}
+
+static int uring_get_last_error(sqlite3_vfs *vfs, int n, char *out) {
+  return PARENT(vfs)->xGetLastError(PARENT(vfs), n, out);
+}
+
+static int uring_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *out) {
+  return PARENT(vfs)->xCurrentTimeInt64(PARENT(vfs), out);
+}
+
+static void uring_vfs_init(sqlite3_vfs *vfs, sqlite3_vfs *parent, const char *name) {
+  memset(vfs, 0, sizeof(sqlite3_vfs));
+  vfs->iVersion = 2;
+  vfs->szOsFile = sizeof(uring_file) + parent->szOsFile;
+  vfs->mxPathname = parent->mxPathname;
+  vfs->zName = name;
+  vfs->pAppData = parent;
+  vfs->xOpen = uring_open;
+  vfs->xDelete = uring_delete;
+  vfs->xAccess = uring_access;
+  vfs->xFullPathname = uring_full_pathname;
+  vfs->xDlOpen = uring_dl_open;
+  vfs->xDlError = uring_dl_error;
+  vfs->xDlSym = uring_dl_sym;
+  vfs->xDlClose = uring_dl_close;
+  vfs->xRandomness = uring_randomness;
+  vfs->xSleep = uring_sleep;
+  vfs->xCurrentTime = uring_current_time;
+  vfs->xGetLastError = uring_get_last_error;
+  vfs->xCurrentTimeInt64 = uring_current_time_int64;
+}
+
+static int uring_available = -1;
+
+/* call-seq:
+ *   Extralite.io_uring_available? -> bool
+ *
+ * Returns true if io_uring is supported by the running kernel, in which case
+ * the `extralite-uring` and `extralite-uring-direct` VFSes submit batched
+ * writes using io_uring. Otherwise they fall back to using `pwritev`.
+ */
+static VALUE Extralite_io_uring_available_p(VALUE self) {
+  if (uring_available == -1) {
+    uring_t ring;
+    uring_available = uring_setup(&ring, 4) ? 0 : 1;
+    if (uring_available) uring_teardown(&ring);
+  }
+  return uring_available ? Qtrue : Qfalse;
+}
+
+void Init_ExtraliteUringVFS(void) {
+  VALUE mExtralite = rb_define_module("Extralite");
+  sqlite3_vfs *parent = sqlite3_vfs_find(NULL);
+
+  if (parent) {
+    uring_mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    uring_vfs_init(&uring_vfs, parent, "extralite-uring");
+    uring_vfs_init(&uring_direct_vfs, parent, "extralite-uring-direct");
+    sqlite3_vfs_register(&uring_vfs, 0);
+    sqlite3_vfs_register(&uring_direct_vfs, 0);
+  }
+
+  rb_define_singleton_method(mExtralite, "io_uring_available?", Extralite_io_uring_available_p, 0);
+}
+
+#else
+
+static VALUE Extralite_io_uring_available_p(VALUE self) {
+  return Qfalse;
+}
+
+void Init_ExtraliteUringVFS(void) {
+  VALUE mExtralite = rb_define_module("Extralite");
+  rb_define_singleton_method(mExtralite, "io_uring_available?", Extralite_io_uring_available_p, 0);
+}
+
+#endif
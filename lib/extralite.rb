@@ -1,5 +1,12 @@
+# frozen_string_literal: true
+
 require_relative './extralite_ext'
 require_relative './extralite/sqlite3_constants'
+require_relative './extralite/sharded_database'
+require_relative './extralite/tenant_manager'
+require_relative './extralite/kv'
+require_relative './extralite/vacuum_scheduler'
+require_relative './extralite/queue'
 
 # Extralite is a Ruby gem for working with SQLite databases
 module Extralite
@@ -25,21 +32,85 @@ module Extralite
   class InterruptError < Error
   end
 
+  # A result row returned by `Database#query_rows`. Column values are kept in
+  # a compact native buffer and converted to Ruby values only when accessed.
+  class Row
+  end
+
   # An SQLite database
   class Database
     alias_method :execute, :query
 
-    TABLES_SQL = <<~SQL
-      SELECT name FROM sqlite_master
-      WHERE type ='table'
-        AND name NOT LIKE 'sqlite_%';
-    SQL
+    # Opens a named in-memory database, shared by all connections in the
+    # process opening the same name, e.g. from multiple threads. The database
+    # is kept in memory until the last connection to it is closed. Access from
+    # multiple connections is serialized using SQLite's locking, so a busy
+    # timeout should be set on each connection. If `from` is given, the
+    # database is populated with the contents of the given database file (or
+    # database instance), replacing any existing contents.
+    #
+    #     db = Extralite::Database.new_memory('ref', from: 'ref.db', busy_timeout: 1)
+    #     Thread.new { Extralite::Database.new_memory('ref').query('select * from countries') }
+    #
+    # @param name [String, Symbol] database name
+    # @param from [String, Extralite::Database, nil] database to copy
+    # @param busy_timeout [Numeric, nil] busy timeout in seconds
+    # @param opts [Hash] options passed to `Extralite::Database.new`
+    # @return [Extralite::Database] database
+    def self.new_memory(name, from: nil, busy_timeout: nil, **opts)
+      name = name.to_s
+      raise ArgumentError, 'Invalid in-memory database name' if name.empty?
+
+      db = new("/#{name}", vfs: 'memdb', **opts)
+      db.busy_timeout = busy_timeout if busy_timeout
+      load_memory(db, from) if from
+      db
+    rescue Exception
+      db&.close
+      raise
+    end
+
+    # Copies the given database file or instance into the given in-memory
+    # database using the backup API, which, unlike `#deserialize`, keeps the
+    # database shared.
+    def self.load_memory(db, from)
+      return from.backup(db) if from.is_a?(Database)
+
+      raise Error, "Database file not found: #{from}" unless File.file?(from)
 
-    # Returns the list of currently defined tables.
+      src = new(from.to_s)
+      begin
+        src.backup(db)
+      ensure
+        src.close
+      end
+    end
+    private_class_method :load_memory
+
+    # Opens a read-only database file that does not change while open, e.g. a
+    # reference dataset shipped with the application. The file is opened with
+    # the `immutable` URI parameter, so queries skip all file locking and
+    # change detection, and is memory-mapped in full, with a page cache of only
+    # a few pages. Pages are thus read directly from the OS page cache, whose
+    # physical pages are shared by all processes using the file.
+    #
+    # The database can be opened before forking worker processes. By default
+    # (`on_fork: :reopen`), it is transparently reopened in each forked process
+    # on first use, mapping the same file pages.
+    #
+    #     REF = Extralite::Database.open_immutable('/data/geo.db')
+    #     fork { REF.query('select * from countries where code = ?', 'FR') }
     #
-    # @return [Array] list of tables
-    def tables
-      query_single_column(TABLES_SQL)
+    # Modifying the file while it is open may return incorrect results or
+    # raise errors.
+    #
+    # @param path [String] database path
+    # @param opts [Hash] options passed to `Extralite::Database.new`
+    # @return [Extralite::Database] database
+    def self.open_immutable(path, on_fork: :reopen, **opts)
+      raise Error, "Database file not found: #{path}" unless File.file?(path)
+
+      new(path.to_s, immutable: true, on_fork: on_fork, **opts)
     end
 
     # Gets or sets one or more pragmas:
@@ -53,8 +124,594 @@ module Extralite
       value.is_a?(Hash) ? pragma_set(value) : pragma_get(value)
     end
 
+    # Maximum number of statements kept by `#prepare_cached`
+    STATEMENT_CACHE_SIZE = 256
+
+    # Returns a prepared statement for the given SQL, which is cached for the
+    # lifetime of the connection, so it is prepared only once. When the cache
+    # is full, the least recently used statement is closed.
+    #
+    #     db.prepare_cached('select * from users where id = ?').query_single_row(42)
+    #
+    # @param sql [String] query
+    # @return [Extralite::PreparedStatement] prepared statement
+    def prepare_cached(sql)
+      cache = (@statement_cache ||= {})
+      stmt = cache.delete(sql)
+      stmt = nil if stmt&.closed?
+      stmt ||= prepare(sql)
+      if cache.size >= STATEMENT_CACHE_SIZE
+        _, evicted = cache.shift
+        evicted.close
+      end
+      cache[sql] = stmt
+    end
+
+    # Runs the given block in an immediate transaction, which takes the write
+    # lock upfront, so that statements in the block do not fail with a busy
+    # error midway through the transaction. If a transaction is already active,
+    # the block is run as part of it. The transaction is rolled back if the
+    # block raises an exception.
+    #
+    #     db.immediate_transaction { db.query('update counters set n = n + 1') }
+    #
+    # @return [any] block result
+    def immediate_transaction
+      return yield if transaction_active?
+
+      query('begin immediate')
+      begin
+        result = yield
+        query('commit')
+        result
+      rescue Exception
+        query('rollback') if transaction_active?
+        raise
+      end
+    end
+
+    # Inserts or updates the given rows (hashes mapping column names to values)
+    # in the given table. Rows conflicting with existing rows on the `conflict`
+    # columns update the existing rows: with `update: :all`, all given columns
+    # are updated, otherwise only the given columns. With `update: nil`,
+    # conflicting rows are ignored. Statements are generated and cached per
+    # set of row keys, and rows are applied in batches of `batch_size` rows,
+    # each batch stepped through without holding the GVL and, unless a
+    # transaction is already active, in its own transaction.
+    #
+    #     db.upsert(:users, [{ id: 1, name: 'foo' }, { id: 2, name: 'bar' }], conflict: [:id])
+    #     #=> { changes: 2, inserted: 1, updated: 1 }
+    #
+    # For `WITHOUT ROWID` tables, inserted and updated rows cannot be told
+    # apart, and only the total number of changes is returned.
+    #
+    # @param table [String, Symbol] table name
+    # @param rows [Hash, Array<Hash>] rows
+    # @param conflict [Array] columns of the unique index used for detecting conflicts
+    # @param update [Symbol, Array, nil] columns to update on conflict
+    # @param batch_size [Integer] number of rows applied per transaction
+    # @return [Hash] numbers of changed, inserted and updated rows
+    def upsert(table, rows, conflict: [:id], update: :all, batch_size: 1000)
+      rows = [rows] if rows.is_a?(Hash)
+      conflict = Array(conflict)
+      inserted = updated = 0
+
+      rows.each_slice(batch_size) do |batch|
+        immediate_transaction do
+          batch.group_by(&:keys).each do |keys, group|
+            stmt = prepare_cached(upsert_sql(table, keys, conflict, update))
+            i, u = stmt.execute_rows(keys, group)
+            inserted += i
+            updated += u
+          end
+        end
+      end
+
+      changes = inserted + updated
+      return { changes: changes, inserted: nil, updated: nil } if without_rowid?(table)
+
+      { changes: changes, inserted: inserted, updated: updated }
+    end
+
+    # Deletes the rows of the given table matching the given condition in
+    # chunks of `batch` consecutive rowids, each chunk deleted by a single
+    # cached statement in its own short transaction, pausing `pause` seconds
+    # between chunks. Other connections may thus write to the database while a
+    # large delete is in progress. Only rows present when the delete started
+    # are considered. If a block is given, it is called after each chunk with
+    # the number of rows deleted so far and the completed fraction of the
+    # rowid range.
+    #
+    #     db.delete_in_batches(:events, 'ts < ?', [cutoff]) do |changes, progress|
+    #       puts "#{changes} rows deleted (#{(progress * 100).round}%)"
+    #     end
+    #
+    # The operation can be stopped between chunks by breaking out of the
+    # block, or by raising an exception in the calling thread, or during a
+    # chunk by calling `#interrupt` from another thread, in which case the
+    # interrupted chunk is rolled back. Previously deleted chunks remain
+    # deleted. Raises an error if a transaction is active, or if the table is
+    # a `WITHOUT ROWID` table.
+    #
+    # @param table [String, Symbol] table name
+    # @param where [String] SQL condition
+    # @param params [Array, Hash] condition parameters
+    # @param batch [Integer] number of rowids per chunk
+    # @param pause [Numeric] time in seconds between chunks
+    # @return [Integer] number of rows deleted
+    def delete_in_batches(table, where, params = [], batch: 5000, pause: 0.01, &progress)
+      sql = "#{BATCH_BOUNDS} delete from #{quote_identifier(table)} where #{BATCH_CONDITION} and (#{where})"
+      run_in_batches(table, sql, batch_params(params), batch, pause, progress)
+    end
+
+    # Updates the rows of the given table matching the given condition in
+    # chunks of `batch` consecutive rowids, in the same manner as
+    # `#delete_in_batches`. The changes are given either as an SQL `SET`
+    # clause, whose parameters precede the condition parameters, or as a hash
+    # mapping column names to values.
+    #
+    #     db.update_in_batches(:events, { archived: 1 }, 'ts < ?', [cutoff])
+    #     db.update_in_batches(:events, 'hits = hits + ?', 'ts < ?', [1, cutoff])
+    #
+    # @param table [String, Symbol] table name
+    # @param set [String, Hash] SQL `SET` clause or hash of column values
+    # @param where [String] SQL condition
+    # @param params [Array, Hash] parameters
+    # @param batch [Integer] number of rowids per chunk
+    # @param pause [Numeric] time in seconds between chunks
+    # @return [Integer] number of rows updated
+    def update_in_batches(table, set, where, params = [], batch: 5000, pause: 0.01, &progress)
+      params = batch_params(params)
+      if set.is_a?(Hash)
+        params = set.values + params
+        set = set.keys.map { |k| "#{quote_identifier(k)} = ?" }.join(', ')
+      end
+      sql = "#{BATCH_BOUNDS} update #{quote_identifier(table)} set #{set} where #{BATCH_CONDITION} and (#{where})"
+      run_in_batches(table, sql, params, batch, pause, progress)
+    end
+
+    # Writes a logical dump of the database to the given IO, as an SQL script
+    # equivalent to the output of the `sqlite3` shell's `.dump` command. The
+    # dump is made inside a read transaction (unless a transaction is already
+    # active), so it reflects a consistent snapshot. Table rows are formatted
+    # as `INSERT` statements of up to `batch_size` rows each, without holding
+    # the GVL, and written to the IO in chunks of about 1MB.
+    #
+    # If `tables` is given, only the given tables, along with their indexes and
+    # triggers, are dumped. Otherwise, all tables, indexes, triggers and views
+    # are dumped. Rows of virtual tables are dumped through the virtual table
+    # itself, and their shadow tables are skipped.
+    #
+    #     File.open('backup.sql', 'w') { |f| db.dump(f) }
+    #
+    # @param io [IO] IO (or any object responding to `#write`)
+    # @param tables [Array, nil] tables to dump (defaults to all tables)
+    # @param batch_size [Integer] maximum number of rows per `INSERT` statement
+    # @return [Integer] number of rows written
+    def dump(io, tables: nil, batch_size: 100)
+      dump_transaction do
+        io.write("PRAGMA foreign_keys=OFF;\nBEGIN TRANSACTION;\n")
+        rows = dump_tables(io, tables && tables.map(&:to_s), batch_size)
+        io.write("COMMIT;\n")
+        rows
+      end
+    end
+
+    # Restores a logical dump (or any SQL script) read from the given IO. The
+    # script is read in chunks of `chunk_size` bytes, and the complete
+    # statements in each chunk are executed without holding the GVL in a
+    # transaction of their own (unless a transaction is already active), so
+    # the whole script is never held in memory. Transaction control statements
+    # in the script (`BEGIN`, `COMMIT` etc.) are ignored. If an error occurs,
+    # the statements executed in previous chunks remain committed. Since the
+    # rows of a dump are not ordered by their references, foreign key
+    # constraints are not enforced while restoring, and the `foreign_keys`
+    # setting is restored afterwards. If a transaction is already active, in
+    # which case foreign keys cannot be disabled, foreign key checks are
+    # deferred to the end of the transaction instead.
+    #
+    #     File.open('backup.sql', 'r') { |f| db.restore(f) }
+    #
+    # @param io [IO] IO (or any object responding to `#read`)
+    # @param chunk_size [Integer] number of bytes read per chunk
+    # @return [Integer] number of statements executed
+    def restore(io, chunk_size: 1 << 20)
+      if transaction_active?
+        query('pragma defer_foreign_keys = on')
+        return restore_chunks(io, chunk_size)
+      end
+
+      foreign_keys = query_single_value('pragma foreign_keys') == 1
+      query('pragma foreign_keys = off') if foreign_keys
+      begin
+        restore_chunks(io, chunk_size)
+      ensure
+        query('pragma foreign_keys = on') if foreign_keys
+      end
+    end
+
+    # Returns the number of free pages in the database file.
+    #
+    # @return [Integer] number of free pages
+    def freelist_count
+      query_single_value('pragma freelist_count')
+    end
+
+    # Switches the database to `auto_vacuum=INCREMENTAL` mode, in which free
+    # pages are kept in the database file until reclaimed using
+    # `#incremental_vacuum`. For an existing database not already in `FULL`
+    # mode, this requires rebuilding the database using `VACUUM`, which holds an
+    # exclusive lock for the duration of the rebuild. Raises an error if a
+    # transaction is active. Returns false if incremental vacuuming is already
+    # enabled.
+    #
+    # @return [bool] true if the auto vacuum mode was changed
+    def enable_incremental_vacuum
+      raise Error, 'Cannot change auto vacuum mode in a transaction' if transaction_active?
+
+      mode = query_single_value('pragma auto_vacuum')
+      return false if mode == 2
+
+      query('pragma auto_vacuum = incremental')
+      # switching between FULL and INCREMENTAL does not require a rebuild
+      query('vacuum') if mode == 0 && query_single_value('pragma auto_vacuum') != 2
+      true
+    end
+
+    # Reclaims up to the given number of free pages (all free pages by default)
+    # by moving them to the end of the database file and truncating it. The
+    # database must be in `auto_vacuum=INCREMENTAL` mode (see
+    # `#enable_incremental_vacuum`). Returns the number of pages reclaimed.
+    #
+    # @param pages [Integer, nil] maximum number of pages to reclaim
+    # @return [Integer] number of pages reclaimed
+    def incremental_vacuum(pages = nil)
+      before = freelist_count
+      query("pragma incremental_vacuum(#{pages ? Integer(pages) : 0})")
+      before - freelist_count
+    end
+
+    # Starts a background thread reclaiming free pages of the database in small
+    # slices, during idle periods or when free pages make up a large part of
+    # the database file (see `Extralite::VacuumScheduler` for the available
+    # options). The scheduler uses a connection of its own. Returns the
+    # scheduler, which can be stopped using `#stop_vacuum_scheduler`.
+    #
+    #     db.enable_incremental_vacuum
+    #     db.start_vacuum_scheduler(interval: 10, idle: 5, slice_pages: 256)
+    #
+    # @param opts [Hash] scheduler options
+    # @return [Extralite::VacuumScheduler] scheduler
+    def start_vacuum_scheduler(**opts)
+      raise Error, 'Vacuum scheduler already started' if @vacuum_scheduler
+
+      @vacuum_scheduler = VacuumScheduler.new(filename, **opts).start
+    end
+
+    # Stops the background vacuum scheduler, if started.
+    #
+    # @return [Extralite::Database] self
+    def stop_vacuum_scheduler
+      @vacuum_scheduler&.stop
+      @vacuum_scheduler = nil
+      self
+    end
+
+    # @return [Extralite::VacuumScheduler, nil] vacuum scheduler, if started
+    attr_reader :vacuum_scheduler
+
+    # Warms up the database caches, moving the cost of cold reads into a
+    # controlled warm-up phase, e.g. right after a deploy or restart.
+    #
+    # With `into: :sqlite` (the default), the pages of the given tables (all
+    # tables by default) and, optionally, of their indexes are read through
+    # SQLite, filling the connection's page cache. Each table or index is
+    # scanned by a single statement step, without holding the GVL. For the
+    # warm-up to be effective, the page cache (see `pragma :cache_size`) should
+    # be big enough to hold the warmed pages. Overflow pages (large text and
+    # blob values) are not read.
+    #
+    # With `into: :os`, the entire database file (and its WAL file, if present)
+    # is read sequentially into the OS page cache, benefitting all connections
+    # and processes. The `tables` and `indexes` options are ignored.
+    #
+    # If a block is given, it is called with the name of the table, index or
+    # file just read, and the total number of bytes read so far.
+    #
+    #     db.warm(tables: ['users'], indexes: true) { |name, bytes| p [name, bytes] }
+    #
+    # @param tables [Array, nil] tables to warm (defaults to all tables)
+    # @param indexes [bool] whether to warm table indexes
+    # @param into [Symbol] `:sqlite` or `:os`
+    # @return [Integer] number of bytes read
+    def warm(tables: nil, indexes: true, into: :sqlite, &progress)
+      case into
+      when :sqlite
+        warm_page_cache(tables || self.tables, indexes, progress)
+      when :os
+        warm_os_cache(progress)
+      else
+        raise ArgumentError, "Invalid warm target: #{into.inspect}"
+      end
+    end
+
+    # Recommends indexes for the given queries. For each query, the columns the
+    # query planner would like to have indexed are found by preparing the query
+    # against virtual tables mirroring the database tables, and matching
+    # candidate indexes are created on a copy of the database schema (including
+    # `ANALYZE` statistics, if present). Candidates that are used by the
+    # resulting query plan are recommended. The queries are never run, and the
+    # database itself is not modified.
+    #
+    #     db.recommend_indexes('select * from users where email = ?')
+    #     #=> [{sql: 'select * from users where email = ?',
+    #     #     indexes: ['create index "users_email_idx" on "users" ("email")'],
+    #     #     plan_before: ['SCAN users'],
+    #     #     plan_after: ['SEARCH users USING INDEX users_email_idx (email=?)']}]
+    #
+    # @param sqls [String, Array<String>] queries to analyze
+    # @return [Array<Hash>] recommendations for each query
+    def recommend_indexes(sqls)
+      tables = self.tables.map do |table|
+        info = table_info(table)
+        defs = info.map { |c| "#{quote_identifier(c[:name])} #{c[:type]}" }
+        [table, info.map { _1[:name] }, defs]
+      end
+      views = query_single_column("select sql from sqlite_master where type = 'view'")
+      existing = tables.to_h { |(table)| [table, indexes(table).map { _1[:columns] }] }
+
+      schema = index_advisor_schema
+      Array(sqls).map { |sql| recommend_indexes_for(sql, schema, tables, views, existing) }
+    ensure
+      schema&.close
+    end
+
     private
 
+    def restore_chunks(io, chunk_size)
+      buffer = ''.b
+      count = 0
+      offset = state = 0
+      while (chunk = io.read(chunk_size))
+        buffer << chunk
+        length, offset, state = sql_complete_length(buffer, offset, state)
+        next if length == 0
+
+        script = buffer.byteslice(0, length)
+        buffer = buffer.byteslice(length..)
+        offset -= length
+        count += immediate_transaction { execute_script(script) }
+      end
+      raise Error, 'Incomplete SQL statement at end of script' unless buffer.strip.empty?
+
+      count
+    end
+
+    def index_advisor_schema
+      schema = Database.new(':memory:')
+      query_single_column(
+        "select sql from sqlite_master where sql is not null " \
+        "and type in ('table', 'index', 'view') and name not like 'sqlite_%'"
+      ).each do |sql|
+        schema.query(sql)
+      rescue Error
+        # tables using unavailable virtual table modules are skipped
+      end
+
+      if query_single_value("select count(*) from sqlite_master where name = 'sqlite_stat1'") > 0
+        # analyzing sqlite_master creates the sqlite_stat1 table, and running it
+        # again reloads the copied statistics
+        schema.query('analyze sqlite_master')
+        schema.execute_multi('insert into sqlite_stat1 values (?, ?, ?)', query_ary('select tbl, idx, stat from sqlite_stat1'))
+        schema.query('analyze sqlite_master')
+      end
+      schema
+    end
+
+    def recommend_indexes_for(sql, schema, tables, views, existing)
+      creates = index_usage(sql, tables, views).filter_map do |table, eq, range, order|
+        # descending columns are only needed for mixed order by directions
+        mixed = range.empty? && order.map(&:last).uniq.size > 1
+        columns = eq.map { [_1, false] }
+        columns += range.empty? ? order : [[range.first, false]]
+        columns.uniq!(&:first)
+        next if columns.empty?
+
+        names = columns.map(&:first)
+        next if existing[table].any? { |cols| cols.first(names.size) == names }
+
+        name = "#{table}_#{names.join('_')}_idx"
+        specs = columns.map { |c, desc| mixed && desc ? "#{quote_identifier(c)} desc" : quote_identifier(c) }
+        [name, "create index #{quote_identifier(name)} on #{quote_identifier(table)} (#{specs.join(', ')})"]
+      end.uniq
+
+      plan_before = query_plan(self, sql)
+      plan_after = nil
+      schema.query('begin')
+      begin
+        creates.each { |(_, create)| schema.query(create) }
+        plan_after = query_plan(schema, sql)
+      ensure
+        schema.query('rollback')
+      end
+
+      used = creates.select { |name, _| plan_after.any? { _1 =~ /INDEX #{Regexp.escape(name)}\b/ } }
+      {
+        sql: sql,
+        indexes: used.map(&:last),
+        plan_before: plan_before,
+        plan_after: used.empty? ? plan_before : plan_after
+      }
+    end
+
+    # The query is prepared as a single statement, so trailing statements are
+    # rejected rather than run.
+    def query_plan(db, sql)
+      stmt = db.prepare("explain query plan #{sql}")
+      stmt.query_ary.map(&:last)
+    ensure
+      stmt&.close
+    end
+
+    def warm_page_cache(tables, indexes, progress)
+      page_size = query_single_value('pragma page_size')
+      status(SQLITE_DBSTATUS_CACHE_MISS, true)
+      bytes_read = -> { status(SQLITE_DBSTATUS_CACHE_MISS).first * page_size }
+
+      tables.each do |table|
+        # the count(*) optimization reads every page of the table b-tree
+        query_single_value("select count(*) from #{quote_identifier(table)} not indexed")
+        progress&.call(table, bytes_read.())
+        next unless indexes
+
+        self.indexes(table).each do |index|
+          column = index[:columns].first
+          next if index[:partial] || !column
+          # the primary key index of a WITHOUT ROWID table is the table itself
+          next if index[:origin] == 'pk' && without_rowid?(table)
+
+          # counting the first indexed column forces a full scan of the index
+          query_single_value(
+            "select count(#{quote_identifier(column)}) from #{quote_identifier(table)} " \
+            "indexed by #{quote_identifier(index[:name])}"
+          )
+          progress&.call(index[:name], bytes_read.())
+        end
+      end
+      bytes_read.()
+    end
+
+    def warm_os_cache(progress)
+      path = filename
+      raise Error, 'Cannot warm an in-memory database' if path.nil? || path.empty?
+
+      files = { path => false }
+      files["#{path}-wal"] = true if query_single_value('pragma journal_mode') == 'wal'
+      files.inject(0) do |total, (fn, wal)|
+        total + warm_file(wal) { |bytes| progress&.call(fn, total + bytes) }
+      end
+    end
+
+    def upsert_sql(table, keys, conflict, update)
+      columns = keys.map { |k| quote_identifier(k) }
+      update_columns =
+        case update
+        when :all then keys.map(&:to_s) - conflict.map(&:to_s)
+        when nil then []
+        else
+          update = Array(update).map(&:to_s)
+          missing = update - keys.map(&:to_s)
+          raise ArgumentError, "Update columns missing from row: #{missing.join(', ')}" unless missing.empty?
+
+          update
+        end
+      action =
+        if update_columns.empty?
+          'nothing'
+        else
+          'update set ' + update_columns.map { |c| "#{quote_identifier(c)} = excluded.#{quote_identifier(c)}" }.join(', ')
+        end
+
+      "insert into #{quote_identifier(table)} (#{columns.join(', ')}) " \
+        "values (#{(['?'] * keys.size).join(', ')}) " \
+        "on conflict (#{conflict.map { |c| quote_identifier(c) }.join(', ')}) do #{action}"
+    end
+
+    # The chunk bounds are bound as the first two parameters, so positional
+    # parameters in the statement body keep their order.
+    BATCH_BOUNDS = 'with batch_bounds(lo, hi) as (select ?, ?)'
+    BATCH_CONDITION = 'rowid between (select lo from batch_bounds) and (select hi from batch_bounds)'
+    private_constant :BATCH_BOUNDS, :BATCH_CONDITION
+
+    def batch_params(params)
+      params.is_a?(Hash) ? [params] : Array(params)
+    end
+
+    def run_in_batches(table, sql, params, batch, pause, progress)
+      raise ArgumentError, 'batch must be positive' unless batch.positive?
+      raise Error, 'Cannot run batches in a transaction' if transaction_active?
+      raise Error, "Cannot run batches on WITHOUT ROWID table #{table}" if without_rowid?(table)
+
+      quoted = quote_identifier(table)
+      first, last = query_ary("select min(rowid), max(rowid) from #{quoted}").first
+      return 0 unless first
+
+      stmt = prepare_cached(sql)
+      next_rowid = prepare_cached("select min(rowid) from #{quoted} where rowid >= ?")
+      changes = 0
+      lo = first
+      while lo && lo <= last
+        hi = [lo + batch - 1, last].min
+        stmt.query(lo, hi, *params)
+        changes += self.changes
+        progress&.call(changes, (hi - first + 1).fdiv(last - first + 1))
+        break if hi == last
+
+        sleep pause if pause&.positive?
+        # skip over gaps in the rowid range
+        lo = next_rowid.query_single_value(hi + 1)
+      end
+      changes
+    end
+
+    def dump_transaction
+      return yield if transaction_active?
+
+      query('begin deferred')
+      begin
+        yield
+      ensure
+        query('rollback') if transaction_active?
+      end
+    end
+
+    def dump_tables(io, tables, batch_size)
+      schema = query_ary('select type, name, tbl_name, sql from sqlite_schema where sql is not null order by rowid')
+      shadow = shadow_tables
+      selected = schema.select { |(type, name)| type == 'table' && !shadow.include?(name) }.map { _1[1] }
+      selected &= tables if tables
+      rows = 0
+
+      selected.each do |name|
+        sql = schema.find { |(type, n)| type == 'table' && n == name }[3]
+        if name == 'sqlite_sequence'
+          io.write("DELETE FROM sqlite_sequence;\n")
+        elsif name.start_with?('sqlite_')
+          next
+        else
+          io.write("#{sql};\n")
+        end
+        columns = query_single_column('select name from pragma_table_xinfo(?) where hidden = 0', name)
+        rows += dump_rows(io, name, columns, batch_size)
+      end
+
+      schema.each do |(type, name, table, sql)|
+        next if type == 'table' || name.start_with?('sqlite_')
+        next if type == 'view' ? tables : !selected.include?(table)
+
+        io.write("#{sql};\n")
+      end
+      rows
+    end
+
+    def shadow_tables
+      query_single_column("select name from pragma_table_list where type = 'shadow'")
+    rescue SQLError
+      # pragma_table_list is not available before SQLite 3.37
+      []
+    end
+
+    def without_rowid?(table)
+      query("select rowid from #{quote_identifier(table)} limit 0")
+      false
+    rescue SQLError
+      true
+    end
+
+    def quote_identifier(name)
+      "\"#{name.to_s.gsub('"', '""')}\""
+    end
+
     def pragma_set(values)
       sql = values.inject(+'') { |s, (k, v)| s += "pragma #{k}=#{v}; " }
       query(sql)
@@ -0,0 +1,248 @@
+# frozen_string_literal: true
+
+require 'json'
+require 'zlib'
+
+module Extralite
+  # A key-value store backed by an SQLite table. Keys are strings, and values
+  # are binary strings, stored as blobs. Values larger than `compress` bytes
+  # are compressed using Zlib, when that makes them smaller. Entries can be
+  # given a time to live (in seconds), after which they are no longer returned
+  # and are removed by `#expire`.
+  #
+  #     kv = Extralite::KV.new(db, table: :cache)
+  #     kv.put('foo', 'bar', ttl: 60)
+  #     kv.get('foo') #=> "bar"
+  #     kv.put_many({ 'a' => '1', 'b' => '2' })
+  #     kv.get_many(['a', 'b', 'c']) #=> { 'a' => '1', 'b' => '2' }
+  #
+  # All operations use statements cached on the connection (see
+  # `Database#prepare_cached`). Multi-key reads and deletes are performed using
+  # a single statement execution, with the keys passed as a JSON array, and
+  # multi-key writes are stepped through without holding the GVL (see
+  # `Database#upsert`).
+  class KV
+    # Flag marking a compressed value
+    COMPRESSED = 1
+
+    # @return [Extralite::Database] database
+    attr_reader :db
+
+    # @return [String] table name
+    attr_reader :table
+
+    # Initializes a key-value store, creating its table if needed.
+    #
+    # @param db [Extralite::Database] database
+    # @param table [String, Symbol] table name
+    # @param compress [Integer, nil] minimum size of compressed values (nil to disable compression)
+    def initialize(db, table: :kv, compress: 1024)
+      @db = db
+      @table = table.to_s
+      @compress = compress
+      @quoted = quote(@table)
+      setup_table
+      prepare_sql
+    end
+
+    # Returns the value for the given key, or nil if not found or expired.
+    #
+    # @param key [String] key
+    # @return [String, nil] value
+    def get(key)
+      row = @db.prepare_cached(@get_sql).query_single_row(key.to_s, now)
+      row && decode(row[:value], row[:flags])
+    end
+    alias_method :[], :get
+
+    # Returns a hash mapping the given keys to their values. Keys that are not
+    # found or expired are omitted.
+    #
+    # @param keys [Array<String>] keys
+    # @return [Hash] values
+    def get_many(keys)
+      return {} if keys.empty?
+
+      @db.prepare_cached(@get_many_sql).query_ary(JSON.generate(keys.map(&:to_s)), now)
+        .to_h { |(key, value, flags)| [key, decode(value, flags)] }
+    end
+
+    # Sets the value for the given key.
+    #
+    # @param key [String] key
+    # @param value [String] value
+    # @param ttl [Numeric, nil] time to live in seconds
+    # @return [String] value
+    def put(key, value, ttl: nil)
+      @db.prepare_cached(@put_sql).query(key.to_s, *encode(value), expires_at(ttl))
+      value
+    end
+
+    # Sets the value for the given key, without an expiry time.
+    #
+    # @param key [String] key
+    # @param value [String] value
+    # @return [String] value
+    def []=(key, value)
+      put(key, value)
+    end
+
+    # Sets the values for the given keys in a single transaction.
+    #
+    # @param entries [Hash] hash mapping keys to values
+    # @param ttl [Numeric, nil] time to live in seconds
+    # @return [Integer] number of entries written
+    def put_many(entries, ttl: nil)
+      expires_at = expires_at(ttl)
+      rows = entries.map do |key, value|
+        data, flags = encode(value)
+        { key: key.to_s, value: data, flags: flags, expires_at: expires_at }
+      end
+      @db.immediate_transaction do
+        @db.prepare_cached(@put_sql).execute_rows(%i[key value flags expires_at], rows)
+      end
+      rows.size
+    end
+
+    # Deletes the given key.
+    #
+    # @param key [String] key
+    # @return [bool] true if the key was found
+    def delete(key)
+      !@db.prepare_cached(@delete_sql).query_single_value(key.to_s).nil?
+    end
+
+    # Deletes the given keys.
+    #
+    # @param keys [Array<String>] keys
+    # @return [Integer] number of deleted keys
+    def delete_many(keys)
+      return 0 if keys.empty?
+
+      @db.prepare_cached(@delete_many_sql).query_single_column(JSON.generate(keys.map(&:to_s))).size
+    end
+
+    # Sets the value for the given key only if its current value is equal to
+    # `expected`. If `expected` is nil, the value is set only if the key is not
+    # found or expired.
+    #
+    # @param key [String] key
+    # @param expected [String, nil] expected value
+    # @param value [String] new value
+    # @param ttl [Numeric, nil] time to live in seconds
+    # @return [bool] true if the value was set
+    def compare_and_swap(key, expected, value, ttl: nil)
+      data, flags = encode(value)
+      if expected.nil?
+        !@db.prepare_cached(@insert_absent_sql).query_single_value(key.to_s, data, flags, expires_at(ttl), now).nil?
+      else
+        expected_data, expected_flags = encode(expected)
+        !@db.prepare_cached(@swap_sql)
+          .query_single_value(data, flags, expires_at(ttl), key.to_s, expected_data, expected_flags, now).nil?
+      end
+    end
+
+    # Returns true if the given key is found and not expired.
+    #
+    # @param key [String] key
+    # @return [bool]
+    def key?(key)
+      !@db.prepare_cached(@key_sql).query_single_value(key.to_s, now).nil?
+    end
+
+    # Deletes expired entries in batches of the given size, each batch in its
+    # own transaction, so writers are not blocked for long.
+    #
+    # @param batch_size [Integer] maximum number of entries deleted per batch
+    # @return [Integer] number of deleted entries
+    def expire(batch_size: 1000)
+      total = 0
+      stmt = @db.prepare_cached(@expire_sql)
+      loop do
+        count = stmt.query_single_column(now, batch_size).size
+        total += count
+        break if count < batch_size
+      end
+      total
+    end
+
+    # Returns the number of entries, including expired entries not yet
+    # removed by `#expire`.
+    #
+    # @return [Integer]
+    def size
+      @db.query_single_value("select count(*) from #{@quoted}")
+    end
+
+    # Deletes all entries.
+    #
+    # @return [Extralite::KV] self
+    def clear
+      @db.query("delete from #{@quoted}")
+      self
+    end
+
+    private
+
+    def quote(name)
+      "\"#{name.gsub('"', '""')}\""
+    end
+
+    def setup_table
+      @db.query(<<~SQL)
+        create table if not exists #{@quoted} (
+          key text primary key, value blob, flags integer not null default 0, expires_at integer
+        ) without rowid
+      SQL
+      @db.query(
+        "create index if not exists #{quote("#{@table}_expires_at")} on #{@quoted} (expires_at) " \
+        'where expires_at is not null'
+      )
+    end
+
+    def prepare_sql
+      live = '(expires_at is null or expires_at > ?)'
+      @get_sql = "select value, flags from #{@quoted} where key = ? and #{live}"
+      @key_sql = "select 1 from #{@quoted} where key = ? and #{live}"
+      @get_many_sql = "select key, value, flags from #{@quoted} " \
+                      "where key in (select value from json_each(?)) and #{live}"
+      @put_sql = "insert into #{@quoted} (key, value, flags, expires_at) values (?, cast(? as blob), ?, ?) " \
+                 'on conflict (key) do update set ' \
+                 'value = excluded.value, flags = excluded.flags, expires_at = excluded.expires_at'
+      @insert_absent_sql = "insert into #{@quoted} (key, value, flags, expires_at) " \
+                           'values (?, cast(? as blob), ?, ?) ' \
+                           'on conflict (key) do update set ' \
+                           'value = excluded.value, flags = excluded.flags, expires_at = excluded.expires_at ' \
+                           "where #{@quoted}.expires_at <= ? returning 1"
+      @swap_sql = "update #{@quoted} set value = cast(? as blob), flags = ?, expires_at = ? " \
+                  "where key = ? and value = cast(? as blob) and flags = ? and #{live} returning 1"
+      @delete_sql = "delete from #{@quoted} where key = ? returning 1"
+      @delete_many_sql = "delete from #{@quoted} where key in (select value from json_each(?)) returning 1"
+      @expire_sql = "delete from #{@quoted} where key in (" \
+                    "select key from #{@quoted} where expires_at <= ? limit ?) returning 1"
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_REALTIME, :millisecond)
+    end
+
+    def expires_at(ttl)
+      ttl && now + (ttl * 1000).to_i
+    end
+
+    def encode(value)
+      value = value.to_s
+      if @compress && value.bytesize >= @compress
+        compressed = Zlib::Deflate.deflate(value)
+        return [compressed, COMPRESSED] if compressed.bytesize < value.bytesize
+      end
+      [value, 0]
+    end
+
+    def decode(value, flags)
+      return Zlib::Inflate.inflate(value) if flags & COMPRESSED != 0
+
+      value
+    end
+  end
+end
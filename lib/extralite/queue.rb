@@ -0,0 +1,276 @@
+# frozen_string_literal: true
+
+module Extralite
+  # A job queue backed by an SQLite table, which may hold multiple named
+  # queues. Consumers claim jobs for the duration of a lease, after which
+  # unacknowledged jobs become visible again, so jobs are not lost if a
+  # consumer dies.
+  #
+  #     queue = Extralite::Queue.new(db, :mailer)
+  #     queue.push(JSON.dump(to: 'foo@example.com'))
+  #
+  #     # in a consumer thread, with its own connection
+  #     queue = Extralite::Queue.new(consumer_db, :mailer)
+  #     queue.claim(10, lease: 60, wait: 5).each do |job|
+  #       deliver(JSON.parse(job.payload))
+  #       queue.ack(job)
+  #     end
+  #
+  # Jobs are claimed atomically using a single `UPDATE ... RETURNING`
+  # statement in an immediate transaction, so concurrent consumers never claim
+  # the same job and never hit a busy error midway through a claim. All
+  # statements are cached on the connection (see `Database#prepare_cached`).
+  #
+  # Consumers waiting for jobs in the same process are woken when a transaction
+  # pushing jobs to the queue commits (see `Database#on_commit`), rather than
+  # by polling. Jobs pushed by other processes, or becoming visible after a
+  # delay or an expired lease, are picked up by waiting consumers after at most
+  # `poll_interval` seconds.
+  class Queue
+    # A claimed job
+    Job = Struct.new(:id, :payload, :attempts)
+
+    # Wakes up consumers waiting on a queue
+    class Signal
+      attr_reader :key, :generation
+
+      # Number of open queues using the signal, protected by the signals lock
+      attr_accessor :refs
+
+      def initialize(key)
+        @key = key
+        @lock = Mutex.new
+        @cond = ConditionVariable.new
+        @generation = 0
+        @refs = 0
+      end
+
+      def broadcast
+        @lock.synchronize do
+          @generation += 1
+          @cond.broadcast
+        end
+      end
+
+      # Waits for a broadcast, unless one happened since `generation` was read.
+      def wait(generation, timeout)
+        @lock.synchronize do
+          @cond.wait(@lock, timeout) if @generation == generation
+        end
+      end
+    end
+
+    @signals = {}
+    @signals_lock = Mutex.new
+
+    # Returns the process-wide signal for the given database and queue. The
+    # signal is shared by all queues opened on the same database file and queue
+    # name, and is discarded once all of them are closed (see
+    # `.release_signal`).
+    #
+    # @param db [Extralite::Database] database
+    # @param name [String] queue name
+    # @return [Extralite::Queue::Signal]
+    def self.signal_for(db, name)
+      key = [db.filename.empty? ? db.object_id : db.filename, name]
+      @signals_lock.synchronize do
+        signal = (@signals[key] ||= Signal.new(key))
+        signal.refs += 1
+        signal
+      end
+    end
+
+    # Releases a signal returned by `.signal_for`, discarding it when it is no
+    # longer used by any queue.
+    #
+    # @param signal [Extralite::Queue::Signal] signal
+    # @return [void]
+    def self.release_signal(signal)
+      @signals_lock.synchronize do
+        signal.refs -= 1
+        @signals.delete(signal.key) if signal.refs.zero? && @signals[signal.key].equal?(signal)
+      end
+    end
+
+    # @return [Extralite::Database] database
+    attr_reader :db
+
+    # @return [String] queue name
+    attr_reader :name
+
+    # @return [String] table name
+    attr_reader :table
+
+    # Initializes a queue, creating its table if needed.
+    #
+    # @param db [Extralite::Database] database
+    # @param name [String, Symbol] queue name
+    # @param table [String, Symbol] table name
+    # @param poll_interval [Numeric] maximum time in seconds between checks by waiting consumers
+    def initialize(db, name, table: :jobs, poll_interval: 1)
+      @db = db
+      @name = name.to_s
+      @table = table.to_s
+      @poll_interval = poll_interval
+      @quoted = "\"#{@table.gsub('"', '""')}\""
+      @signal = Queue.signal_for(db, @name)
+      @pushed = false
+      setup_table
+      prepare_sql
+      @commit_hook = db.on_commit { notify }
+    end
+
+    # Pushes a job to the queue.
+    #
+    # @param payload [any] job payload
+    # @param delay [Numeric] time in seconds before the job becomes visible
+    # @return [Integer] job id
+    def push(payload, delay: 0)
+      # set before the statement runs, since the commit hooks are called on commit
+      @pushed = true
+      @db.prepare_cached(@push_sql).query_single_value(@name, payload, now + (delay * 1000).to_i)
+    end
+
+    # Pushes multiple jobs to the queue in a single transaction.
+    #
+    # @param payloads [Array] job payloads
+    # @param delay [Numeric] time in seconds before the jobs become visible
+    # @return [Integer] number of jobs pushed
+    def push_many(payloads, delay: 0)
+      visible_at = now + (delay * 1000).to_i
+      rows = payloads.map { |payload| { queue: @name, payload: payload, visible_at: visible_at } }
+      @pushed = true
+      @db.immediate_transaction do
+        @db.prepare_cached(@push_many_sql).execute_rows(%i[queue payload visible_at], rows)
+      end
+      rows.size
+    end
+
+    # Claims up to the given number of visible jobs, making them invisible to
+    # other consumers for `lease` seconds. The jobs that became visible first
+    # are claimed first (ties are broken by id), and the claimed jobs are
+    # returned ordered by id, since the claim statement returns the updated
+    # visibility times. If no jobs are available and `wait` is given, waits up
+    # to `wait` seconds for jobs to become available.
+    #
+    # @param count [Integer] maximum number of jobs to claim
+    # @param lease [Numeric] lease time in seconds
+    # @param wait [Numeric, nil] maximum time in seconds to wait for jobs
+    # @return [Array<Extralite::Queue::Job>] claimed jobs
+    def claim(count = 1, lease: 30, wait: nil)
+      deadline = wait && monotonic + wait
+      loop do
+        generation = @signal.generation
+        jobs = claim_visible(count, lease)
+        return jobs if !jobs.empty? || !deadline
+
+        timeout = deadline - monotonic
+        return jobs if timeout <= 0
+
+        next_at = @db.prepare_cached(@next_visible_sql).query_single_value(@name)
+        timeout = [timeout, @poll_interval, next_at && (next_at - now) / 1000.0].compact.min
+        @signal.wait(generation, timeout) if timeout > 0
+      end
+    end
+
+    # Acknowledges a claimed job, removing it from the queue. Returns false if
+    # the job's lease has expired and it was claimed again, or if it was
+    # already acknowledged.
+    #
+    # @param job [Extralite::Queue::Job] claimed job
+    # @return [bool] true if the job was removed
+    def ack(job)
+      !@db.prepare_cached(@ack_sql).query_single_value(job.id, job.attempts).nil?
+    end
+
+    # Releases a claimed job, making it visible again after the given delay.
+    # Returns false if the job's lease has expired and it was claimed again,
+    # or if it was acknowledged.
+    #
+    # @param job [Extralite::Queue::Job] claimed job
+    # @param delay [Numeric] time in seconds before the job becomes visible
+    # @return [bool] true if the job was released
+    def nack(job, delay: 0)
+      @pushed = true
+      !@db.prepare_cached(@nack_sql).query_single_value(now + (delay * 1000).to_i, job.id, job.attempts).nil?
+    end
+
+    # Returns the number of jobs in the queue, including claimed jobs.
+    #
+    # @return [Integer]
+    def size
+      @db.prepare_cached(@size_sql).query_single_value(@name)
+    end
+
+    # Deletes all jobs in the queue.
+    #
+    # @return [Extralite::Queue] self
+    def clear
+      @db.query("delete from #{@quoted} where queue = ?", @name)
+      self
+    end
+
+    # Removes the queue's commit hook from the database, and releases its
+    # signal.
+    #
+    # @return [Extralite::Queue] self
+    def close
+      return self unless @signal
+
+      @db.remove_on_commit(@commit_hook) unless @db.closed?
+      Queue.release_signal(@signal)
+      @signal = nil
+      self
+    end
+
+    private
+
+    def setup_table
+      @db.query(<<~SQL)
+        create table if not exists #{@quoted} (
+          id integer primary key, queue text not null, payload,
+          visible_at integer not null, attempts integer not null default 0
+        )
+      SQL
+      @db.query(
+        "create index if not exists \"#{@table.gsub('"', '""')}_queue_visible_at\" on #{@quoted} (queue, visible_at)"
+      )
+    end
+
+    def prepare_sql
+      @push_sql = "insert into #{@quoted} (queue, payload, visible_at) values (?, ?, ?) returning id"
+      @push_many_sql = "insert into #{@quoted} (queue, payload, visible_at) values (?, ?, ?)"
+      @claim_sql = "update #{@quoted} set visible_at = ?, attempts = attempts + 1 " \
+                   "where id in (select id from #{@quoted} where queue = ? and visible_at <= ? " \
+                   'order by visible_at, id limit ?) ' \
+                   'returning id, payload, attempts'
+      @next_visible_sql = "select min(visible_at) from #{@quoted} where queue = ?"
+      @ack_sql = "delete from #{@quoted} where id = ? and attempts = ? returning 1"
+      @nack_sql = "update #{@quoted} set visible_at = ? where id = ? and attempts = ? returning 1"
+      @size_sql = "select count(*) from #{@quoted} where queue = ?"
+    end
+
+    def claim_visible(count, lease)
+      t = now
+      rows = @db.immediate_transaction do
+        @db.prepare_cached(@claim_sql).query_ary(t + (lease * 1000).to_i, @name, t, count)
+      end
+      rows.sort_by!(&:first).map! { |(id, payload, attempts)| Job.new(id, payload, attempts) }
+    end
+
+    def notify
+      return unless @pushed
+
+      @pushed = false
+      @signal.broadcast
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_REALTIME, :millisecond)
+    end
+
+    def monotonic
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+  end
+end
@@ -0,0 +1,244 @@
+# frozen_string_literal: true
+
+require 'zlib'
+
+module Extralite
+  # A database split across multiple SQLite files (shards), allowing write
+  # throughput to scale with the number of shards. Queries with a named
+  # parameter matching the shard key are routed to a single shard, chosen by
+  # hashing the key value. Other queries are run on all shards in parallel
+  # (SQLite releases the GVL while running queries), and the results are
+  # concatenated. If the query ends with a simple `ORDER BY` clause (column
+  # names with optional `ASC`/`DESC`), optionally followed by a `LIMIT` with
+  # a literal value, the per-shard results are merged in order and the limit is
+  # applied to the merged result. Only clauses of the outer query are
+  # considered, so subqueries and CTEs may use `ORDER BY` and `LIMIT` freely
+  # (they are run on each shard separately).
+  #
+  #     db = Extralite::ShardedDatabase.new(['/data/0.db', '/data/1.db'], shard_key: :user_id)
+  #     db.query('insert into events values (:user_id, :name)', user_id: 42, name: 'foo')
+  #     db.query('select * from events where user_id = :user_id', user_id: 42)
+  #     db.query('select * from events order by created_at desc limit 10')
+  #
+  # Each shard connection is used by a single fan-out thread at a time. When
+  # the sharded database is used from multiple threads, pass `thread_safe:
+  # true`, which is passed on to the shard connections.
+  class ShardedDatabase
+    # @return [Array<Extralite::Database>] shard connections
+    attr_reader :shards
+
+    # @return [Symbol] name of the parameter used for routing queries
+    attr_reader :shard_key
+
+    # Initializes a sharded database.
+    #
+    # @param paths [Array<String>] shard file paths
+    # @param shard_key [Symbol, String] name of the parameter used for routing queries
+    # @param opts [Hash] options passed to `Extralite::Database.new`
+    def initialize(paths, shard_key:, **opts)
+      raise ArgumentError, 'No shard paths given' if paths.empty?
+
+      @shards = paths.map { |path| Database.new(path, **opts) }
+      @shard_key = shard_key.to_sym
+    end
+
+    # Returns the shard connection for the given shard key value.
+    #
+    # @param key [any] shard key value
+    # @return [Extralite::Database] shard connection
+    def shard_for(key)
+      @shards[Zlib.crc32(key.to_s) % @shards.size]
+    end
+
+    # Runs a query returning rows as hashes, either on the shard selected by
+    # the shard key parameter, or on all shards.
+    #
+    # @param sql [String] query
+    # @param params [Array] query parameters
+    # @return [Array<Hash>] rows
+    def query(sql, *params)
+      perform(:query, sql, params) { |row, column, columns| row[column] }
+    end
+    alias_method :query_hash, :query
+    alias_method :execute, :query
+
+    # Runs a query returning rows as arrays, either on the shard selected by the
+    # shard key parameter, or on all shards.
+    #
+    # @param sql [String] query
+    # @param params [Array] query parameters
+    # @return [Array<Array>] rows
+    def query_ary(sql, *params)
+      perform(:query_ary, sql, params) { |row, column, columns| row[columns.index(column)] }
+    end
+
+    # Runs a query returning the values of the first column, either on the
+    # shard selected by the shard key parameter, or on all shards.
+    #
+    # @param sql [String] query
+    # @param params [Array] query parameters
+    # @return [Array] column values
+    def query_single_column(sql, *params)
+      perform(:query_single_column, sql, params) do |value, column, columns|
+        raise ArgumentError, 'Fan-out queries must be ordered by the selected column' if column != columns.first
+
+        value
+      end
+    end
+
+    # Runs the given query once for each set of parameters, routing each to the
+    # shard selected by its shard key parameter.
+    #
+    # @param sql [String] query
+    # @param params_array [Array<Hash>] parameter sets
+    # @return [Integer] number of changes
+    def execute_multi(sql, params_array)
+      params_array.group_by { |params| shard_for(shard_key_value(params, true)) }
+        .sum { |shard, shard_params| shard.execute_multi(sql, shard_params) }
+    end
+
+    # Yields the shard selected by the given shard key value, e.g. for running
+    # a transaction.
+    #
+    # @param key [any] shard key value
+    # @return [any] block result
+    def with_shard(key)
+      yield shard_for(key)
+    end
+
+    # Closes all shard connections.
+    #
+    # @return [Extralite::ShardedDatabase] self
+    def close
+      @shards.each(&:close)
+      self
+    end
+
+    private
+
+    ORDER_LIMIT_RE = /\border\s+by\s+(.+?)(?:\s+limit\s+(\d+))?\s*;?\s*\z/im.freeze
+    ORDER_TERM_RE = /\A(?:[\w"]+\.)?("(?:[^"]|"")+"|\w+)(?:\s+(asc|desc))?\z/i.freeze
+    LIMIT_RE = /\blimit\s+/i.freeze
+    TOKEN_RE = %r{'(?:[^']|'')*'?|"(?:[^"]|"")*"?|--[^\n]*|/\*.*?(?:\*/|\z)|[()]|[^'"()\-/]+|.}m.freeze
+
+    def perform(method, sql, params, &extract)
+      key = shard_key_value(params.first)
+      return shard_for(key).send(method, sql, *params) unless key.nil?
+
+      results = @shards.map { |shard| Thread.new { shard.send(method, sql, *params) } }.map(&:value)
+      merge(results, sql, &extract)
+    end
+
+    def shard_key_value(params, required = false)
+      if params.is_a?(Hash)
+        return params[@shard_key] if params.key?(@shard_key)
+        return params[@shard_key.to_s] if params.key?(@shard_key.to_s)
+      end
+      raise ArgumentError, "Missing shard key parameter #{@shard_key.inspect}" if required
+
+      nil
+    end
+
+    def merge(results, sql, &extract)
+      order = parse_order(sql)
+      return results.flatten(1) unless order
+
+      terms, limit = order
+      columns = @shards.first.columns(sql)
+      missing = terms.map(&:first) - columns
+      raise ArgumentError, "Fan-out queries must select the ORDER BY columns (#{missing.join(', ')})" unless missing.empty?
+
+      merge_ordered(results, terms, columns, limit, &extract)
+    end
+
+    def parse_order(sql)
+      top = top_level_sql(sql)
+      m = top.match(ORDER_LIMIT_RE)
+      unless m
+        raise ArgumentError, 'LIMIT without ORDER BY is not supported for fan-out queries' if top =~ LIMIT_RE
+
+        return nil
+      end
+
+      clause = sql[m.begin(1)...m.end(1)]
+      terms = clause.split(',').map do |term|
+        t = term.strip.match(ORDER_TERM_RE)
+        raise ArgumentError, "Unsupported ORDER BY clause for fan-out query: #{clause}" unless t
+
+        [t[1].delete_prefix('"').delete_suffix('"').gsub('""', '"').to_sym, t[2]&.downcase == 'desc']
+      end
+      [terms, m[2]&.to_i]
+    end
+
+    # Returns the given SQL with string literals, comments and the contents of
+    # parentheses replaced by spaces, keeping the offsets of the outer query's
+    # clauses unchanged.
+    def top_level_sql(sql)
+      depth = 0
+      sql.gsub(TOKEN_RE) do |token|
+        case token
+        when '('
+          depth += 1
+          depth == 1 ? token : ' '
+        when ')'
+          depth -= 1 if depth > 0
+          depth == 0 ? token : ' '
+        when /\A(?:'|--|\/\*)/
+          ' ' * token.size
+        else
+          depth == 0 ? token : ' ' * token.size
+        end
+      end
+    end
+
+    # Merges per-shard results, each already sorted, by repeatedly taking the
+    # smallest head row, up to the given limit.
+    def merge_ordered(results, terms, columns, limit, &extract)
+      keys = results.map do |rows|
+        rows.map { |row| terms.map { |column, _| extract.(row, column, columns) } }
+      end
+      positions = Array.new(results.size, 0)
+      merged = []
+
+      until limit && merged.size >= limit
+        best = nil
+        results.each_index do |i|
+          next if positions[i] >= results[i].size
+          next if best && compare_keys(keys[i][positions[i]], keys[best][positions[best]], terms) >= 0
+
+          best = i
+        end
+        break unless best
+
+        merged << results[best][positions[best]]
+        positions[best] += 1
+      end
+      merged
+    end
+
+    def compare_keys(a, b, terms)
+      terms.each_with_index do |(_, desc), i|
+        c = compare_values(a[i], b[i])
+        return desc ? -c : c if c != 0
+      end
+      0
+    end
+
+    # Compares values using SQLite ordering: NULL < numbers < text/blobs.
+    def compare_values(a, b)
+      ra = value_rank(a)
+      rb = value_rank(b)
+      return ra <=> rb if ra != rb
+
+      ra == 0 ? 0 : a <=> b
+    end
+
+    def value_rank(value)
+      case value
+      when nil then 0
+      when Numeric then 1
+      else 2
+      end
+    end
+  end
+end
@@ -0,0 +1,281 @@
+# frozen_string_literal: true
+
+module Extralite
+  # Manages connections to a large number of per-tenant database files, stored
+  # in a single directory. Connections are opened on demand and kept in an LRU
+  # list bounded by `max_open`, so only recently used tenants hold open file
+  # descriptors and page caches. Pragmas and the setup block are applied once
+  # per open, and statements cached using `Database#prepare_cached` are kept
+  # for as long as the connection stays open. Connections idle for longer than
+  # `idle_timeout` seconds are closed by a background thread. If a `template`
+  # database is given, new tenant databases are created by cloning it (see
+  # `Extralite.clone_database`).
+  #
+  #     tenants = Extralite::TenantManager.new('/data/tenants', max_open: 256,
+  #       pragma: { journal_mode: :wal, synchronous: 1 }) { |db| db.load_extension('...') }
+  #
+  #     tenants.with_tenant(42) do |db|
+  #       db.prepare_cached('select * from orders where id = ?').query_single_row(id)
+  #     end
+  #
+  # A connection is used by a single thread at a time: concurrent calls to
+  # `#with_tenant` for the same tenant are serialized. Connections in use are
+  # never closed; if more than `max_open` connections are in use at once, the
+  # least recently used ones are closed as they are released. Connections are
+  # opened and closed without holding the manager's lock, so opening a tenant
+  # does not hold up threads using other tenants, while threads using the same
+  # tenant wait for it to be opened.
+  class TenantManager
+    TENANT_ID_RE = /\A[\w\-][\w.\-]*\z/.freeze
+
+    Entry = Struct.new(:db, :mutex, :users, :last_used, :error)
+
+    # @return [String] directory holding the tenant database files
+    attr_reader :dir
+
+    # @return [Integer] maximum number of open connections
+    attr_reader :max_open
+
+    # @return [Numeric, nil] idle time in seconds after which connections are closed
+    attr_reader :idle_timeout
+
+    # Initializes a tenant manager.
+    #
+    # @param dir [String] directory holding the tenant database files
+    # @param max_open [Integer] maximum number of open connections
+    # @param idle_timeout [Numeric, nil] idle time in seconds after which connections are closed
+    # @param options [Hash] options passed to `Extralite::Database.new`
+    # @param pragma [Hash] pragmas set on each opened connection
+    # @param template [String, nil] path of template database for new tenants
+    # @param setup [Proc] called with each opened connection
+    def initialize(dir, max_open: 64, idle_timeout: 300, options: {}, pragma: nil, template: nil, &setup)
+      raise ArgumentError, 'max_open must be positive' unless max_open.positive?
+
+      @dir = dir
+      @max_open = max_open
+      @idle_timeout = idle_timeout
+      @options = options
+      @pragma = pragma
+      @template = template
+      @setup = setup
+      @entries = {}
+      @lock = Mutex.new
+      @opened = ConditionVariable.new
+      @reaper_wakeup = ConditionVariable.new
+      @pid = Process.pid
+      @reaper = nil
+      @closed = false
+    end
+
+    # Returns the database file path for the given tenant id.
+    #
+    # @param tenant_id [String, Integer] tenant id
+    # @return [String] database path
+    def path_for(tenant_id)
+      id = tenant_id.to_s
+      raise ArgumentError, "Invalid tenant id: #{tenant_id.inspect}" unless id =~ TENANT_ID_RE
+
+      File.join(@dir, "#{id}.db")
+    end
+
+    # Yields the connection for the given tenant, opening it if needed.
+    #
+    # @param tenant_id [String, Integer] tenant id
+    # @return [any] block result
+    def with_tenant(tenant_id)
+      entry = checkout(tenant_id.to_s)
+      begin
+        return yield(entry.db) if entry.mutex.owned?
+
+        entry.mutex.synchronize { yield(entry.db) }
+      ensure
+        checkin(entry)
+      end
+    end
+
+    # Returns true if a connection to the given tenant is currently open.
+    #
+    # @param tenant_id [String, Integer] tenant id
+    # @return [bool]
+    def open?(tenant_id)
+      @lock.synchronize { @entries[tenant_id.to_s]&.db ? true : false }
+    end
+
+    # Returns the number of open connections.
+    #
+    # @return [Integer]
+    def size
+      @lock.synchronize { @entries.size }
+    end
+
+    # Closes connections that are not in use and have been idle for at least the
+    # given number of seconds. If no idle time is given and the manager has no
+    # `idle_timeout`, no connections are closed.
+    #
+    # @param max_idle [Numeric, nil] idle time in seconds
+    # @return [Integer] number of closed connections
+    def close_idle(max_idle = @idle_timeout)
+      return 0 unless max_idle
+
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      idle = @lock.synchronize do
+        @entries.select { |_, e| e.users.zero? && now - e.last_used >= max_idle }.each_key { |id| @entries.delete(id) }
+      end
+      close_entries(idle.values)
+      idle.size
+    end
+
+    # Closes all connections and stops the background thread, waiting for it to
+    # finish closing any idle connections.
+    #
+    # @return [Extralite::TenantManager] self
+    def close
+      entries, reaper = @lock.synchronize do
+        @closed = true
+        @reaper_wakeup.signal
+        [@entries.values.tap { @entries = {} }, @reaper.tap { @reaper = nil }]
+      end
+      reaper.join if reaper && !reaper.equal?(Thread.current)
+      close_entries(entries)
+      self
+    end
+
+    private
+
+    # Entries for tenants not yet open are added with a nil db, and other
+    # threads checking out the same tenant wait until it is opened.
+    def checkout(id)
+      path = path_for(id)
+      entry, opening, evicted = @lock.synchronize do
+        raise Error, 'Tenant manager is closed' if @closed
+
+        reset_after_fork if @pid != Process.pid
+        entry = @entries.delete(id)
+        opening = !entry
+        entry ||= Entry.new(nil, Mutex.new, 0, 0)
+        entry.users += 1
+        @entries[id] = entry
+        start_reaper if @idle_timeout && !@reaper
+        [entry, opening, evict]
+      end
+      close_entries(evicted)
+      return open_entry(id, entry, path) if opening
+
+      entry.db ? entry : wait_for_open(entry)
+    end
+
+    def open_entry(id, entry, path)
+      db = open_database(path)
+      @lock.synchronize do
+        entry.db = db unless @closed
+        @opened.broadcast
+      end
+      return entry if entry.db
+
+      db.close
+      raise Error, 'Tenant manager is closed'
+    rescue Exception => e
+      @lock.synchronize do
+        entry.error = e
+        entry.users -= 1
+        @entries.delete(id) if @entries[id].equal?(entry)
+        @opened.broadcast
+      end
+      raise
+    end
+
+    def wait_for_open(entry)
+      @lock.synchronize do
+        @opened.wait(@lock) until entry.db || entry.error
+        return entry if entry.db
+
+        entry.users -= 1
+      end
+      raise entry.error
+    end
+
+    def checkin(entry)
+      evicted = @lock.synchronize do
+        entry.users -= 1
+        entry.last_used = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        evict
+      end
+      close_entries(evicted)
+    end
+
+    # Called while holding the lock. Removes the least recently used entries
+    # not in use, and returns them to be closed after releasing the lock.
+    def evict
+      return [] if @entries.size <= @max_open
+
+      evicted = []
+      @entries.each do |id, e|
+        break if @entries.size - evicted.size <= @max_open
+        next if e.users.positive?
+
+        evicted << id
+      end
+      evicted.map { |id| @entries.delete(id) }
+    end
+
+    def close_entries(entries)
+      entries.each { |e| e.db.close if e.db && !e.db.closed? }
+    end
+
+    def open_database(path)
+      clone_template(path) if @template && !File.exist?(path)
+      db = Database.new(path, **@options)
+      db.pragma(@pragma) if @pragma && !@pragma.empty?
+      @setup&.(db)
+      db
+    rescue Exception
+      db&.close
+      raise
+    end
+
+    # The template is cloned into a temporary file, which is checkpointed so the
+    # database is held in a single file, and then linked into place. Other
+    # processes thus see either a complete database or none at all.
+    def clone_template(path)
+      tmp = "#{path}.#{Process.pid}-#{Thread.current.object_id}.tmp"
+      remove_database_files(tmp)
+      Extralite.clone_database(@template, tmp)
+      db = Database.new(tmp)
+      db.query('pragma wal_checkpoint(truncate)')
+      db.close
+      File.link(tmp, path)
+    rescue Errno::EEXIST
+      # created concurrently by another process
+    ensure
+      db&.close unless db&.closed?
+      remove_database_files(tmp)
+    end
+
+    def remove_database_files(path)
+      [path, "#{path}-wal", "#{path}-shm"].each { |fn| File.delete(fn) if File.exist?(fn) }
+    end
+
+    def start_reaper
+      interval = [@idle_timeout / 2.0, 1].max
+      @reaper = Thread.new do
+        close_idle while wait_for_reaping(interval)
+      end
+    end
+
+    # Waits for the given interval, returning false once the manager is closed.
+    def wait_for_reaping(interval)
+      @lock.synchronize do
+        @reaper_wakeup.wait(@lock, interval) unless @closed
+        !@closed
+      end
+    end
+
+    # Connections inherited from the parent process are dropped without being
+    # closed, and the reaper thread does not survive the fork.
+    def reset_after_fork
+      @entries = {}
+      @reaper = nil
+      @pid = Process.pid
+    end
+  end
+end
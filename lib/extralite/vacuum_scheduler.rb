@@ -0,0 +1,185 @@
+# frozen_string_literal: true
+
+module Extralite
+  # Reclaims free pages of a database in `auto_vacuum=INCREMENTAL` mode (see
+  # `Database#enable_incremental_vacuum`) from a background thread, using a
+  # connection of its own. Free pages are reclaimed by running `PRAGMA
+  # incremental_vacuum(N)` in small slices, each in its own short write
+  # transaction, so other connections are never locked out for long.
+  #
+  #     scheduler = db.start_vacuum_scheduler(interval: 10, slice_pages: 256)
+  #     db.query('delete from events where created_at < ?', cutoff)
+  #     scheduler.trigger # reclaim now instead of waiting for the database to be idle
+  #
+  # Every `interval` seconds, the scheduler checks the freelist. Pages are
+  # reclaimed once the database has been idle (not modified by other
+  # connections) for at least `idle` seconds, or regardless of activity when
+  # the free pages make up at least `max_free_ratio` of the database file.
+  # Reclaiming stops when the freelist holds no more than `min_free_pages`
+  # pages, when other connections start writing again, or when the database is
+  # busy.
+  class VacuumScheduler
+    # @return [String] database path
+    attr_reader :path
+
+    # @return [Integer] number of slices run
+    attr_reader :slices
+
+    # @return [Integer] total number of pages reclaimed
+    attr_reader :pages_reclaimed
+
+    # Initializes a vacuum scheduler. The scheduler is started by calling
+    # `#start`.
+    #
+    # @param path [String] database path
+    # @param interval [Numeric] time in seconds between freelist checks
+    # @param idle [Numeric] idle time in seconds after which pages are reclaimed
+    # @param slice_pages [Integer] number of pages reclaimed per slice
+    # @param pause [Numeric] time in seconds between slices
+    # @param min_free_pages [Integer] number of free pages left unreclaimed
+    # @param max_free_ratio [Float, nil] ratio of free pages above which pages are reclaimed even if not idle
+    # @param options [Hash] options passed to `Extralite::Database.new`
+    def initialize(path, interval: 10, idle: 5, slice_pages: 256, pause: 0.01, min_free_pages: 0,
+                   max_free_ratio: 0.25, options: {})
+      raise ArgumentError, 'Vacuum scheduler requires a database file' if path.nil? || path.empty? || path == ':memory:'
+      raise ArgumentError, 'slice_pages must be positive' unless slice_pages.positive?
+
+      @path = path
+      @interval = interval
+      @idle = idle
+      @slice_pages = slice_pages
+      @pause = pause
+      @min_free_pages = min_free_pages
+      @max_free_ratio = max_free_ratio
+      @options = options
+      @slices = 0
+      @pages_reclaimed = 0
+      @lock = Mutex.new
+      @wakeup = ConditionVariable.new
+      @triggered = false
+      @thread = nil
+    end
+
+    # Starts the background thread.
+    #
+    # @return [Extralite::VacuumScheduler] self
+    def start
+      @lock.synchronize do
+        return self if @thread
+
+        @stopping = false
+        @thread = Thread.new { run }
+      end
+      self
+    end
+
+    # Stops the background thread, waiting for a running slice to finish.
+    #
+    # @return [Extralite::VacuumScheduler] self
+    def stop
+      thread = @lock.synchronize do
+        @stopping = true
+        @wakeup.signal
+        @thread.tap { @thread = nil }
+      end
+      thread&.join
+      self
+    end
+
+    # Returns true if the background thread is running.
+    #
+    # @return [bool]
+    def running?
+      @lock.synchronize { !!@thread&.alive? }
+    end
+
+    # Wakes up the background thread to reclaim free pages right away,
+    # regardless of database activity, e.g. after a large delete.
+    #
+    # @return [Extralite::VacuumScheduler] self
+    def trigger
+      @lock.synchronize do
+        @triggered = true
+        @wakeup.signal
+      end
+      self
+    end
+
+    # Reclaims free pages in slices on the calling thread, using the given
+    # connection, until the freelist holds no more than `min_free_pages` pages.
+    # If `data_version` is given, stops when the database is modified by another
+    # connection. Stops without raising if the database is busy.
+    #
+    # @param db [Extralite::Database] connection to the database
+    # @param data_version [Integer, nil] data version at which to stop
+    # @return [Integer] number of pages reclaimed
+    def reclaim(db, data_version = nil)
+      reclaimed = 0
+      loop do
+        free = db.freelist_count - @min_free_pages
+        break if free <= 0 || @stopping
+        break if data_version && db.query_single_value('pragma data_version') != data_version
+
+        count = db.incremental_vacuum([free, @slice_pages].min)
+        @lock.synchronize do
+          @slices += 1
+          @pages_reclaimed += count
+        end
+        reclaimed += count
+        break if count.zero?
+
+        sleep @pause if @pause&.positive?
+      end
+      reclaimed
+    rescue BusyError
+      reclaimed
+    end
+
+    private
+
+    def run
+      db = Database.new(@path, **@options)
+      last_version = nil
+      last_change = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      until @stopping
+        triggered = wait
+        break if @stopping
+
+        version = db.query_single_value('pragma data_version')
+        now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        if version != last_version
+          last_version = version
+          last_change = now
+        end
+
+        begin
+          if triggered || over_ratio?(db)
+            reclaim(db)
+          elsif now - last_change >= @idle
+            reclaim(db, version)
+          end
+        rescue BusyError
+          # checked again on the next wakeup
+        end
+      end
+    ensure
+      db&.close
+    end
+
+    # Waits for the next check, returning true if triggered.
+    def wait
+      @lock.synchronize do
+        @wakeup.wait(@lock, @interval) unless @triggered || @stopping
+        @triggered.tap { @triggered = false }
+      end
+    end
+
+    def over_ratio?(db)
+      return false unless @max_free_ratio
+
+      pages = db.query_single_value('pragma page_count')
+      pages.positive? && db.freelist_count.fdiv(pages) >= @max_free_ratio
+    end
+  end
+end
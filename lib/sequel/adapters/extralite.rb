@@ -180,7 +180,45 @@ module Sequel
         end
       end
 
+      # Array of symbols specifying the table names in the current database.
+      # Uses the connection's schema cache unless filtering options are given.
+      def tables(opts=OPTS)
+        return super unless (opts.keys - [:server]).empty?
+
+        m = output_identifier_meth
+        synchronize(opts[:server]) { |conn| conn.tables.map { |t| m.call(t) } }
+      end
+
+      # Return a hash containing index information for the table. Uses the
+      # connection's schema cache.
+      def indexes(table, opts=OPTS)
+        m = output_identifier_meth
+        im = input_identifier_meth
+        table = table.value if table.is_a?(Sequel::SQL::Identifier)
+        list = synchronize(opts[:server]) { |conn| conn.indexes(im.call(table)) }
+
+        list.each_with_object({}) do |index, indexes|
+          if opts[:only_autocreated]
+            next unless index[:name] =~ /\Asqlite_autoindex_/
+          else
+            next if index[:origin] == 'pk' || index[:partial]
+          end
+
+          indexes[m.call(index[:name])] = {
+            unique: index[:unique],
+            columns: index[:columns].map { |c| m.call(c) }
+          }
+        end
+      end
+
       private
+
+      # Use the connection's schema cache for table info. Rows are dup'ed since
+      # they are modified when parsing the schema.
+      def _parse_pragma_ds(table_name, opts)
+        im = input_identifier_meth(opts[:dataset])
+        synchronize(opts[:server]) { |conn| conn.table_info(im.call(table_name)) }.map(&:dup)
+      end
       
       def adapter_initialize
         @conversion_procs = SQLITE_TYPES.dup
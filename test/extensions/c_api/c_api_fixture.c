@@ -0,0 +1,63 @@
+#include "extralite_api.h"
+
+static const extralite_api_t *extralite;
+static int resolved = 0;
+
+typedef struct {
+  VALUE db;
+  VALUE sql;
+  int argc;
+  VALUE *argv;
+  struct sqlite3_stmt *stmt;
+} query_args;
+
+static VALUE fixture_query_rows(VALUE ptr) {
+  query_args *args = (query_args *)ptr;
+  VALUE rows = rb_ary_new();
+
+  args->stmt = extralite->prepare(args->db, args->sql);
+  extralite->bind(args->stmt, args->argc, args->argv);
+  VALUE columns = extralite->column_names(args->stmt);
+  while (extralite->step(args->stmt))
+    rb_ary_push(rows, extralite->row_to_hash(args->stmt, columns));
+  return rows;
+}
+
+static VALUE fixture_query_cleanup(VALUE ptr) {
+  query_args *args = (query_args *)ptr;
+  if (args->stmt) extralite->finalize(args->stmt);
+  return Qnil;
+}
+
+static VALUE fixture_query_locked(VALUE ptr) {
+  return rb_ensure(fixture_query_rows, ptr, fixture_query_cleanup, ptr);
+}
+
+// CApiFixture.query(db, sql, *params) -> rows
+static VALUE fixture_query(int argc, VALUE *argv, VALUE self) {
+  rb_check_arity(argc, 2, UNLIMITED_ARGUMENTS);
+  query_args args = { argv[0], argv[1], argc - 2, argv + 2, NULL };
+  return extralite->synchronize(args.db, fixture_query_locked, (VALUE)&args);
+}
+
+// CApiFixture.resolved? -> whether the API table was found using rb_ext_resolve_symbol
+static VALUE fixture_resolved_p(VALUE self) {
+  return resolved ? Qtrue : Qfalse;
+}
+
+// CApiFixture.api -> address of the loaded API table
+static VALUE fixture_api(VALUE self) {
+  return ULL2NUM((uintptr_t)extralite);
+}
+
+void Init_c_api_fixture(void) {
+  extralite = extralite_api_load(EXTRALITE_API_VERSION);
+#ifdef HAVE_RB_EXT_RESOLVE_SYMBOL
+  resolved = rb_ext_resolve_symbol("extralite_ext", EXTRALITE_API_SYMBOL) == extralite;
+#endif
+
+  VALUE mFixture = rb_define_module("CApiFixture");
+  rb_define_module_function(mFixture, "query", fixture_query, -1);
+  rb_define_module_function(mFixture, "resolved?", fixture_resolved_p, 0);
+  rb_define_module_function(mFixture, "api", fixture_api, 0);
+}
@@ -0,0 +1,9 @@
+# frozen_string_literal: true
+
+# Builds a native extension using the Extralite C API, used by test_extralite.rb
+
+require 'mkmf'
+
+find_header('extralite_api.h', File.expand_path('../../../ext/extralite', __dir__)) or abort
+have_func('rb_ext_resolve_symbol', 'ruby.h')
+create_makefile('c_api_fixture')
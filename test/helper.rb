@@ -5,3 +5,21 @@ require 'extralite'
 require 'minitest/autorun'
 
 puts "sqlite3 version: #{Extralite.sqlite3_version}"
+
+# Returns true if the given database is locked for writing, as seen from another
+# process. A new process is used, since a forked process shares the lock state
+# kept by SQLite.
+def write_locked?(fn)
+  script = <<~RUBY
+    begin
+      db = Extralite::Database.new(ARGV[0])
+      db.busy_timeout = 0
+      db.query('begin immediate')
+      exit 1
+    rescue Extralite::BusyError
+      exit 0
+    end
+  RUBY
+  lib = File.expand_path('../lib', __dir__)
+  system(RbConfig.ruby, '-I', lib, '-rextralite', '-e', script, fn)
+end
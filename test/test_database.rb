@@ -1,6 +1,9 @@
 # frozen_string_literal: true
 
 require_relative 'helper'
+require 'fileutils'
+require 'tmpdir'
+require 'stringio'
 
 class DatabaseTest < MiniTest::Test
   def setup
@@ -44,6 +47,42 @@ class DatabaseTest < MiniTest::Test
     assert_equal [], r
   end
 
+  def test_query_rows
+    r = @db.query_rows('select * from t')
+    assert_equal 2, r.size
+    assert_kind_of Extralite::Row, r.first
+    assert_equal [{x: 1, y: 2, z: 3}, {x: 4, y: 5, z: 6}], r.map(&:to_h)
+    assert_equal [[1, 2, 3], [4, 5, 6]], r.map(&:to_a)
+
+    row = r.last
+    assert_equal [:x, :y, :z], row.columns
+    assert_equal 3, row.size
+    assert_equal 5, row[:y]
+    assert_equal 5, row['y']
+    assert_equal 5, row[1]
+    assert_equal 6, row[-1]
+    assert_nil row[:foo]
+    assert_nil row[3]
+
+    assert_equal 4, row.fetch(:x)
+    assert_equal 42, row.fetch(:foo, 42)
+    assert_equal :foo, row.fetch(:foo) { |k| k }
+    assert_raises(KeyError) { row.fetch(:foo) }
+
+    buf = []
+    @db.query_rows('select * from t') { |r| buf << r[:z] }
+    assert_equal [3, 6], buf
+
+    r = @db.query_rows('select * from t where x = 2')
+    assert_equal [], r
+  end
+
+  def test_query_rows_value_types
+    row = @db.query_rows("select 1 as a, 2.5 as b, 'foo' as c, x'0001' as d, null as e").first
+    assert_equal({ a: 1, b: 2.5, c: 'foo', d: "\x00\x01", e: nil }, row.to_h)
+    assert_same row[:c], row[:c]
+  end
+
   def test_query_single_row
     r = @db.query_single_row('select * from t order by x desc limit 1')
     assert_equal({ x: 4, y: 5, z: 6 }, r)
@@ -194,6 +233,101 @@ end
     assert_equal [], @db.tables
   end
 
+  def test_tables_cached
+    tables = @db.tables
+    tables << 'bar'
+    assert_equal ['t'], @db.tables
+
+    version = @db.schema_version
+    @db.query('create temp table tmp (x)')
+    assert_equal version, @db.schema_version
+    @db.query('create table foo (bar text)')
+    assert_equal version + 1, @db.schema_version
+    assert_equal ['t', 'foo'], @db.tables
+  end
+
+  def test_columns_cached
+    assert_equal [:x, :y, :z], @db.columns('select * from t')
+    @db.query('alter table t add column w')
+    assert_equal [:x, :y, :z, :w], @db.columns('select * from t')
+
+    @db.query('create temp table tmp (a)')
+    assert_equal [:a], @db.columns('select * from tmp')
+    @db.query('alter table tmp add column b')
+    assert_equal [:a, :b], @db.columns('select * from tmp')
+  end
+
+  def test_columns_cache_bounded
+    assert_equal [:x], @db.columns('select x from t')
+    assert_equal [:y], @db.columns('select y from t')
+    assert_equal [:x], @db.columns('select x from t')
+
+    # full column names do not change the schema version, so cached columns
+    # keep their short names until evicted
+    @db.query('pragma full_column_names = 1')
+    @db.query('pragma short_column_names = 0')
+    assert_equal [:'t.z'], @db.columns('select z from t')
+
+    # the cache holds 256 queries, the least recently used being evicted
+    254.times { |i| @db.columns("select x as c#{i} from t") }
+    assert_equal [:x], @db.columns('select x from t')
+    assert_equal [:'t.y'], @db.columns('select y from t')
+  end
+
+  def test_columns_multiple_statements
+    assert_raises(Extralite::Error) { @db.columns('drop table t; select 1') }
+    assert_equal [:x, :y, :z], @db.columns('select * from t')
+  end
+
+  def test_tables_sql
+    assert_equal @db.tables, @db.query_single_column(Extralite::Database::TABLES_SQL)
+  end
+
+  def test_table_info
+    @db.query('create table foo (id integer primary key, name text not null default \'bar\')')
+    info = @db.table_info(:foo)
+    assert info.frozen?
+    assert_equal [:id, :name], info.map { _1[:name].to_sym }
+    assert_equal({ cid: 1, name: 'name', type: 'TEXT', notnull: 1, dflt_value: "'bar'", pk: 0 },
+      info[1].reject { |k, _| k == :hidden })
+    assert_same info, @db.table_info('foo')
+
+    @db.query('alter table foo add column baz')
+    assert_equal 3, @db.table_info('foo').size
+    assert_equal [], @db.table_info('nonexistent')
+  end
+
+  def test_indexes
+    @db.query('create table foo (a text unique, b, c)')
+    @db.query('create index foo_bc on foo (b, c) where b > 0')
+    indexes = @db.indexes('foo')
+    assert indexes.frozen?
+    assert_equal [
+      { name: 'foo_bc', unique: false, origin: 'c', partial: true, columns: ['b', 'c'] },
+      { name: 'sqlite_autoindex_foo_1', unique: true, origin: 'u', partial: false, columns: ['a'] }
+    ], indexes.sort_by { _1[:name] }
+
+    @db.query('drop index foo_bc')
+    assert_equal ['sqlite_autoindex_foo_1'], @db.indexes(:foo).map { _1[:name] }
+  end
+
+  def test_foreign_keys
+    @db.query('create table foo (id integer primary key)')
+    @db.query('create table bar (foo_id integer references foo(id) on delete cascade)')
+    fks = @db.foreign_keys('bar')
+    assert fks.frozen?
+    assert_equal 1, fks.size
+    assert_equal({ table: 'foo', from: 'foo_id', to: 'id', on_delete: 'CASCADE' },
+      fks[0].slice(:table, :from, :to, :on_delete))
+    assert_equal [], @db.foreign_keys('foo')
+  end
+
+  def test_schema_cache_after_close
+    @db.tables
+    @db.close
+    assert_raises(Extralite::Error) { @db.tables }
+  end
+
   def test_pragma
     assert_equal [{journal_mode: 'memory'}], @db.pragma('journal_mode')
     assert_equal [{synchronous: 2}], @db.pragma('synchronous')
@@ -268,6 +402,47 @@ end
     assert_operator 0, :<, @db.status(Extralite::SQLITE_DBSTATUS_SCHEMA_USED).first
   end
 
+  def test_shared_cache
+    fn = "/tmp/shared-#{rand(86400)}.db"
+    db1 = Extralite::Database.new(fn, shared_cache: true)
+    db1.query('create table foo (x integer, y text)')
+    db1.execute_multi('insert into foo values (?, ?)', (1..1000).map { |i| [i, "#{i}" * 20] })
+
+    db2 = Extralite::Database.new(fn, shared_cache: true)
+    assert_equal 1000, db2.query_single_value('select count(*) from foo')
+    assert_equal 1000, db1.query_single_value('select count(*) from foo')
+
+    # with a shared cache, the cache memory is split between the connections
+    used = db1.status(Extralite::SQLITE_DBSTATUS_CACHE_USED).first
+    shared = db1.status(Extralite::SQLITE_DBSTATUS_CACHE_USED_SHARED).first
+    assert_operator shared, :<, used
+  ensure
+    db1&.close
+    db2&.close
+    FileUtils.rm_f(fn)
+  end
+
+  def test_shared_cache_schema_locked
+    fn = "/tmp/shared-#{rand(86400)}.db"
+    db1 = Extralite::Database.new(fn, shared_cache: true)
+    db2 = Extralite::Database.new(fn, shared_cache: true)
+    db1.query('create table foo (x)')
+
+    # a pending schema change holds the schema lock, so preparing fails
+    db1.query('begin')
+    db1.query('create table bar (y)')
+    assert_raises(Extralite::BusyError) { db2.prepare('select * from foo') }
+    assert_raises(Extralite::BusyError) { db2.query('select * from foo') }
+    assert_raises(Extralite::BusyError) { db2.restore(StringIO.new('select * from foo;')) }
+
+    db1.query('commit')
+    assert_equal [], db2.query('select * from bar')
+  ensure
+    db1&.close
+    db2&.close
+    FileUtils.rm_f(fn)
+  end
+
   def test_database_limit
     result = @db.limit(Extralite::SQLITE_LIMIT_ATTACHED)
     assert_equal 10, result
@@ -363,6 +538,80 @@ end
   end
 end
 
+class FrozenResultsTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:', frozen: true)
+    @db.query('create table t (x, y)')
+    @db.query("insert into t values (1, 'foo'), (2, 'bar')")
+  end
+
+  def test_frozen_results?
+    assert_equal true, @db.frozen_results?
+    assert_equal false, Extralite::Database.new(':memory:').frozen_results?
+  end
+
+  def test_frozen_results
+    r = @db.query('select * from t')
+    assert_equal [{ x: 1, y: 'foo' }, { x: 2, y: 'bar' }], r
+    assert r.frozen?
+    assert r.all? { |h| h.frozen? && h[:y].frozen? }
+
+    r = @db.query_ary('select * from t')
+    assert_equal [[1, 'foo'], [2, 'bar']], r
+    assert r.frozen?
+    assert r.all? { |a| a.frozen? && a[1].frozen? }
+
+    r = @db.query_single_column('select y from t')
+    assert r.frozen?
+    assert r.all?(&:frozen?)
+
+    assert @db.query_single_value('select y from t').frozen?
+    assert @db.query_single_row('select * from t').frozen?
+
+    row = @db.query_rows('select * from t').first
+    assert row.frozen?
+    assert row[:y].frozen?
+    assert_equal({ x: 1, y: 'foo' }, row.to_h)
+
+    stmt = @db.prepare('select * from t')
+    assert stmt.query.all?(&:frozen?)
+  end
+
+  def test_frozen_results_shareable
+    skip unless defined?(Ractor)
+
+    assert Ractor.shareable?(@db.query('select * from t'))
+    assert Ractor.shareable?(@db.query_ary('select * from t'))
+    assert Ractor.shareable?(@db.query_rows('select * from t'))
+  end
+
+  def test_ractor
+    skip unless defined?(Ractor)
+
+    fn = "/tmp/extralite-ractor-#{rand(10000)}.db"
+    db = Extralite::Database.new(fn)
+    db.query('create table t (x, y)')
+    db.query("insert into t values (1, 'foo'), (2, 'bar')")
+    db.close
+
+    warn_level = Warning[:experimental]
+    Warning[:experimental] = false
+    ractors = 2.times.map do
+      Ractor.new(fn) do |path|
+        ractor_db = Extralite::Database.new(path, frozen: true)
+        [ractor_db.tables, ractor_db.query('select * from t order by x')]
+      ensure
+        ractor_db&.close
+      end
+    end
+    ractors.each do |r|
+      assert_equal [['t'], [{ x: 1, y: 'foo' }, { x: 2, y: 'bar' }]], r.take
+    end
+  ensure
+    Warning[:experimental] = warn_level
+  end
+end
+
 class ScenarioTest < MiniTest::Test
   def setup
     @db = Extralite::Database.new('/tmp/extralite.db')
@@ -454,6 +703,609 @@ class ScenarioTest < MiniTest::Test
   end
 end
 
+class ThreadSafeTest < MiniTest::Test
+  def setup
+    @fn = "/tmp/extralite-threads-#{rand(10000)}.db"
+    @db = Extralite::Database.new(@fn, thread_safe: true)
+    @db.query('create table if not exists t (x, y)')
+    @db.query('delete from t')
+  end
+
+  def teardown
+    @db.close
+    FileUtils.rm(@fn) rescue nil
+  end
+
+  def test_thread_safe?
+    assert_equal true, @db.thread_safe?
+    assert_equal false, Extralite::Database.new(':memory:').thread_safe?
+  end
+
+  def test_shared_database
+    insert = @db.prepare('insert into t values (?, ?)')
+    select = @db.prepare('select y from t where x = ?')
+
+    threads = 4.times.map do |i|
+      Thread.new do
+        50.times do |j|
+          x = i * 100 + j
+          insert.query(x, "#{i}-#{j}")
+          raise "mismatch" unless select.query_single_value(x) == "#{i}-#{j}"
+          raise "mismatch" unless @db.query_single_value('select y from t where x = ?', x) == "#{i}-#{j}"
+        end
+      end
+    end
+    threads.each(&:join)
+
+    assert_equal 200, @db.query_single_value('select count(*) from t')
+  end
+
+  def test_nested_queries
+    @db.query('insert into t values (1, 2), (3, 4)')
+    result = []
+    @db.query('select x from t order by x') do |r|
+      result << @db.query_single_value('select y from t where x = ?', r[:x])
+    end
+    assert_equal [2, 4], result
+  end
+
+  def test_connection_methods_wait_for_running_query
+    # the query is stepped without holding the GVL
+    slow = 'with recursive s(v) as (select 1 union all select v + 1 from s where v < 3000000) select count(*) from s'
+    t = Thread.new { @db.query_single_value(slow) }
+    sleep 0.05
+
+    @db.query('insert into t values (1, 2)')
+    assert_equal 1, @db.changes
+    assert_equal 1, @db.last_insert_rowid
+    assert_equal false, @db.transaction_active?
+    assert_equal 0, @db.errcode
+    assert_kind_of Array, @db.status(Extralite::SQLITE_DBSTATUS_CACHE_USED)
+    @db.busy_timeout = 1
+    assert_equal 3000000, t.value
+  end
+end
+
+class ForkTest < MiniTest::Test
+  def setup
+    skip unless Process.respond_to?(:fork)
+
+    @fn = "/tmp/extralite-fork-#{rand(10000)}.db"
+    FileUtils.rm(@fn) rescue nil
+  end
+
+  def fork_and_wait
+    r, w = IO.pipe
+    pid = fork do
+      r.close
+      w << Marshal.dump(yield)
+    rescue => e
+      w << Marshal.dump(e.class)
+    ensure
+      w.close
+      exit!
+    end
+    w.close
+    result = Marshal.load(r.read)
+    Process.wait(pid)
+    result
+  ensure
+    r&.close
+  end
+
+  def test_fork_raise
+    db = Extralite::Database.new(@fn)
+    db.query('create table t (x)')
+    db.query('insert into t values (1)')
+    stmt = db.prepare('select x from t')
+
+    assert_equal Extralite::Error, fork_and_wait { db.query_single_value('select x from t') }
+    assert_equal Extralite::Error, fork_and_wait { stmt.query_single_value }
+    assert_equal true, fork_and_wait { db.close; db.closed? }
+
+    # parent connection is still usable
+    assert_equal 1, db.query_single_value('select x from t')
+    assert_equal [1], stmt.query_single_column
+  end
+
+  def test_fork_reopen
+    db = Extralite::Database.new(@fn, on_fork: :reopen)
+    db.busy_timeout = 1
+    db.query('create table t (x)')
+    db.query('insert into t values (1)')
+    stmt = db.prepare('select x from t')
+
+    assert_equal [1, 2], fork_and_wait {
+      db.query('insert into t values (2)')
+      stmt.query_single_column
+    }
+
+    assert_equal [1, 2], stmt.query_single_column
+    assert_equal [1, 2], db.query_single_column('select x from t')
+  end
+end
+
+class WarmTest < MiniTest::Test
+  def setup
+    @fn = "/tmp/extralite-warm-#{rand(10000)}.db"
+    FileUtils.rm(@fn) rescue nil
+
+    db = Extralite::Database.new(@fn)
+    db.query('create table foo (x integer, y text)')
+    db.query('create index foo_y on foo (y)')
+    db.query('create table bar (z)')
+    db.execute_multi('insert into foo values (?, ?)', (1..2000).map { |i| [i, "value #{i}" * 10] })
+    db.close
+
+    @db = Extralite::Database.new(@fn)
+  end
+
+  def teardown
+    @db.close
+    FileUtils.rm(@fn) rescue nil
+  end
+
+  def test_warm_sqlite
+    progress = []
+    bytes = @db.warm { |name, bytes| progress << [name, bytes] }
+    assert_equal ['foo', 'foo_y', 'bar'], progress.map(&:first)
+    assert_equal bytes, progress.last.last
+    assert_operator bytes, :>, File.size(@fn) / 2
+
+    # pages are now cached
+    assert_equal 0, @db.warm
+  end
+
+  def test_warm_sqlite_primary_keys
+    @db.query('create table baz (id text primary key, v)')
+    @db.query('create table qux (id text primary key, v) without rowid')
+    @db.execute_multi('insert into baz values (?, ?)', (1..100).map { |i| ["key #{i}", i] })
+    @db.execute_multi('insert into qux values (?, ?)', (1..100).map { |i| ["key #{i}", i] })
+
+    progress = []
+    @db.warm(tables: ['baz', 'qux']) { |name, _| progress << name }
+    assert_equal ['baz', 'sqlite_autoindex_baz_1', 'qux'], progress
+  end
+
+  def test_warm_sqlite_without_indexes
+    progress = []
+    @db.warm(tables: ['foo'], indexes: false) { |name, _| progress << name }
+    assert_equal ['foo'], progress
+  end
+
+  def test_warm_os
+    progress = []
+    bytes = @db.warm(into: :os) { |name, bytes| progress << [name, bytes] }
+    assert_equal File.size(@fn), bytes
+    assert_equal [@fn, bytes], progress.last
+  end
+
+  def test_warm_os_wal
+    @db.query('pragma journal_mode = wal')
+    @db.query('pragma wal_autocheckpoint = 0')
+    @db.query('update foo set y = ?', 'bar')
+
+    progress = []
+    bytes = @db.warm(into: :os) { |name, bytes| progress << [name, bytes] }
+    assert_equal File.size(@fn) + File.size("#{@fn}-wal"), bytes
+    assert_equal ["#{@fn}-wal", bytes], progress.last
+  ensure
+    FileUtils.rm_f(["#{@fn}-wal", "#{@fn}-shm"])
+  end
+
+  def test_warm_os_keeps_locks
+    @db.query('begin immediate')
+    @db.warm(into: :os)
+    assert write_locked?(@fn)
+  ensure
+    @db.query('rollback')
+  end
+
+  def test_warm_invalid
+    assert_raises(ArgumentError) { @db.warm(into: :foo) }
+    assert_raises(Extralite::Error) { Extralite::Database.new(':memory:').warm(into: :os) }
+  end
+end
+
+class ScanReportTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query('create table foo (x integer primary key, y)')
+    @db.execute_multi('insert into foo (y) values (?)', (1..100).map { [_1] })
+    @db.reset_scan_report
+  end
+
+  def test_scan_report
+    assert_equal [], @db.scan_report
+
+    @db.query('select * from foo where x = 1')
+    assert_equal [], @db.scan_report
+
+    sql = 'select * from foo where y = ?'
+    @db.query(sql, 1)
+    @db.query(sql, 2)
+    @db.query('select * from foo order by y desc limit 1')
+
+    report = @db.scan_report
+    assert_equal 2, report.size
+    assert_equal({ sql: sql, fullscan_steps: 198, sorts: 0, autoindexes: 0, runs: 2 }, report[0])
+    assert_equal 'select * from foo order by y desc limit 1', report[1][:sql]
+    assert_equal 1, report[1][:sorts]
+
+    assert_equal [sql], @db.scan_report(1).map { _1[:sql] }
+    @db.reset_scan_report
+    assert_equal [], @db.scan_report
+  end
+
+  def test_scan_report_prepared_statement
+    stmt = @db.prepare('select count(*) from foo where y > ?')
+    stmt.query_single_value(50)
+    stmt.query_single_value(90)
+    assert_equal [{ sql: stmt.sql, fullscan_steps: 198, sorts: 0, autoindexes: 0, runs: 2 }], @db.scan_report
+
+    # prepared statement counters are not reset
+    assert_equal 198, stmt.status(Extralite::SQLITE_STMTSTATUS_FULLSCAN_STEP, true)
+    stmt.query_single_value(90)
+    stmt.close
+    assert_equal 297, @db.scan_report.first[:fullscan_steps]
+  end
+
+  def test_scan_report_autoindex
+    @db.query('create table bar (y)')
+    @db.execute_multi('insert into bar values (?)', (1..100).map { [_1] })
+    @db.query('select * from foo join bar on foo.y = bar.y')
+
+    entry = @db.scan_report.find { _1[:sql] =~ /join/ }
+    assert_operator entry[:autoindexes], :>, 0
+  end
+end
+
+class IndexAdvisorTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query('create table users (id integer primary key, email text, name text)')
+    @db.query('create table posts (id integer primary key, user_id integer, created_at integer)')
+    @db.query('create index users_name on users (name)')
+  end
+
+  def test_recommend_indexes
+    sql = 'select * from users where email = ?'
+    assert_equal [{
+      sql: sql,
+      indexes: ['create index "users_email_idx" on "users" ("email")'],
+      plan_before: ['SCAN users'],
+      plan_after: ['SEARCH users USING INDEX users_email_idx (email=?)']
+    }], @db.recommend_indexes(sql)
+
+    # the database is not modified
+    assert_equal ['users_name'], @db.indexes(:users).map { _1[:name] }
+  end
+
+  def test_recommend_indexes_order_by
+    result = @db.recommend_indexes(['select * from posts where user_id = ? order by created_at'])
+    assert_equal ['create index "posts_user_id_created_at_idx" on "posts" ("user_id", "created_at")'], result[0][:indexes]
+    assert_includes result[0][:plan_before].join, 'TEMP B-TREE'
+    refute_includes result[0][:plan_after].join, 'TEMP B-TREE'
+  end
+
+  def test_recommend_indexes_existing_index
+    result = @db.recommend_indexes(['select * from users where name = ?'])
+    assert_equal [], result[0][:indexes]
+    assert_equal result[0][:plan_before], result[0][:plan_after]
+  end
+
+  def test_recommend_indexes_invalid_sql
+    assert_raises(Extralite::SQLError) { @db.recommend_indexes('select * from nonexistent where x = 1') }
+  end
+
+  def test_recommend_indexes_multiple_statements
+    assert_raises(Extralite::Error) do
+      @db.recommend_indexes(['select * from users where name = 1; create table evil (x)'])
+    end
+    refute_includes @db.tables, 'evil'
+
+    result = @db.recommend_indexes(["select * from users where email = ?; -- lookup\n"])
+    assert_equal ['create index "users_email_idx" on "users" ("email")'], result[0][:indexes]
+  end
+end
+
+class SpaceUsageTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    begin
+      @db.query('select 1 from dbstat limit 1')
+    rescue Extralite::SQLError
+      skip 'dbstat virtual table not available'
+    end
+  end
+
+  def test_space_usage
+    @db.query('create table foo (x integer, y text)')
+    @db.query('create index foo_y on foo (y)')
+    @db.execute_multi('insert into foo values (?, ?)', (1..1000).map { |i| [i, "#{i}" * 20] })
+
+    usage = @db.space_usage
+    assert_equal ['foo', 'foo_y'], usage.map { _1[:name] }.grep_v(/^sqlite_/).sort
+
+    foo = usage.find { _1[:name] == 'foo' }
+    page_size = @db.query_single_value('pragma page_size')
+    assert_operator foo[:pages], :>, 1
+    assert_equal foo[:pages] * page_size, foo[:size]
+    assert_operator foo[:payload], :>, 1000 * 40
+    assert_operator foo[:unused], :<, foo[:size]
+    assert_kind_of Float, foo[:fragmentation]
+    assert_operator foo[:fragmentation], :>=, 0.0
+    assert_operator foo[:fragmentation], :<=, 1.0
+  end
+
+  def test_space_usage_schema
+    @db.query('create temp table bar (x)')
+    assert_includes @db.space_usage(:temp).map { _1[:name] }, 'bar'
+    refute_includes @db.space_usage.map { _1[:name] }, 'bar'
+  end
+end
+
+class UringVFSTest < MiniTest::Test
+  def setup
+    skip 'io_uring VFS not available' unless RUBY_PLATFORM =~ /linux/
+
+    @fn = "/tmp/uring-#{rand(86400)}.db"
+    @db = Extralite::Database.new(@fn, vfs: 'extralite-uring')
+  end
+
+  def teardown
+    @db&.close
+    FileUtils.rm_f([@fn, "#{@fn}-wal", "#{@fn}-shm", "#{@fn}-journal"]) if @fn
+  end
+
+  def test_io_uring_available?
+    assert_includes [true, false], Extralite.io_uring_available?
+  end
+
+  def test_unknown_vfs
+    assert_raises(Extralite::Error) { Extralite::Database.new(':memory:', vfs: 'foobar') }
+  end
+
+  def test_uring_vfs_rollback_journal
+    @db.query('create table foo (x integer, y text)')
+    @db.query('begin')
+    @db.execute_multi('insert into foo values (?, ?)', (1..5000).map { |i| [i, "#{i}" * 20] })
+    @db.query('commit')
+    @db.execute_multi('insert into foo values (?, ?)', (5001..6000).map { |i| [i, "#{i}" * 20] })
+
+    other = Extralite::Database.new(@fn)
+    assert_equal 6000, other.query_single_value('select count(*) from foo')
+    assert_equal '4242' * 20, other.query_single_value('select y from foo where x = 4242')
+    other.close
+
+    @db.close
+    @db = Extralite::Database.new(@fn, vfs: 'extralite-uring')
+    assert_equal '5555' * 20, @db.query_single_value('select y from foo where x = 5555')
+    assert_equal 'ok', @db.query_single_value('pragma integrity_check')
+  end
+
+  def test_uring_vfs_wal
+    @db.query('pragma journal_mode = wal')
+    @db.query('create table foo (x integer, y blob)')
+    other = Extralite::Database.new(@fn)
+    @db.query('begin')
+    (1..2000).each { |i| @db.query('insert into foo values (?, ?)', i, 'x' * 1000) }
+    @db.query('commit')
+
+    # the other connection reads committed WAL frames
+    assert_equal 2000, other.query_single_value('select count(*) from foo')
+    @db.query('update foo set y = ? where x % 2 = 0', 'y' * 500)
+    assert_equal 1000, other.query_single_value('select count(*) from foo where length(y) = 500')
+
+    @db.query('pragma wal_checkpoint(truncate)')
+    assert_equal 'ok', other.query_single_value('pragma integrity_check')
+    other.close
+  end
+
+  def test_uring_vfs_wal_synchronous_normal
+    @db.query('pragma journal_mode = wal')
+    @db.query('pragma synchronous = normal')
+    @db.query('create table foo (x integer, y blob)')
+    other = Extralite::Database.new(@fn)
+
+    # WAL frames are not synced on commit, but must still be written before the
+    # WAL index is updated
+    (1..10).each do |i|
+      @db.query('begin')
+      100.times { |j| @db.query('insert into foo values (?, ?)', i * 100 + j, 'x' * 1000) }
+      @db.query('commit')
+      assert_equal i * 100, other.query_single_value('select count(*) from foo')
+    end
+    assert_equal 'ok', other.query_single_value('pragma integrity_check')
+    other.close
+  end
+
+  def test_uring_vfs_close_keeps_locks
+    @db.query('create table foo (x)')
+    @db.close
+    @db = Extralite::Database.new(@fn)
+    @db.query('begin exclusive')
+
+    # closing a connection must not release the locks held by other
+    # connections in the same process
+    Extralite::Database.new(@fn, vfs: 'extralite-uring').close
+    assert write_locked?(@fn)
+  ensure
+    @db.query('rollback') if @db&.transaction_active?
+  end
+
+  def test_uring_direct_vfs
+    @db.close
+    @db = Extralite::Database.new(@fn, vfs: 'extralite-uring-direct')
+    @db.query('create table foo (x integer, y text)')
+    @db.query('begin')
+    (1..1000).each { |i| @db.query('insert into foo values (?, ?)', i, "#{i}" * 20) }
+    @db.query('commit')
+    @db.close
+
+    @db = Extralite::Database.new(@fn)
+    assert_equal 1000, @db.query_single_value('select count(*) from foo')
+    assert_equal 'ok', @db.query_single_value('pragma integrity_check')
+  end
+end
+
+class CloneDatabaseTest < MiniTest::Test
+  def setup
+    @dir = Dir.mktmpdir('extralite-clone')
+    @template = File.join(@dir, 'template.db')
+    @db = Extralite::Database.new(@template)
+    @db.query('create table foo (x integer, y text)')
+    @db.execute_multi('insert into foo values (?, ?)', (1..1000).map { |i| [i, "#{i}" * 20] })
+  end
+
+  def teardown
+    @db.close
+    FileUtils.rm_rf(@dir)
+  end
+
+  def test_clone_database
+    fn = File.join(@dir, 'new.db')
+    method = Extralite.clone_database(@template, fn)
+    assert_includes [:reflink, :copy_file_range, :copy], method
+
+    db = Extralite::Database.new(fn)
+    assert_equal 1000, db.query_single_value('select count(*) from foo')
+    db.query('delete from foo')
+    db.close
+    assert_equal 1000, @db.query_single_value('select count(*) from foo')
+  end
+
+  def test_clone_database_wal
+    @db.query('pragma journal_mode = wal')
+    @db.query('pragma wal_autocheckpoint = 0')
+    @db.query('insert into foo values (1001, ?)', 'bar')
+
+    fn = File.join(@dir, 'new.db')
+    Extralite.clone_database(@template, fn)
+    db = Extralite::Database.new(fn)
+    assert_equal 'bar', db.query_single_value('select y from foo where x = 1001')
+    assert_equal 'ok', db.query_single_value('pragma integrity_check')
+    db.close
+  end
+
+  def test_clone_database_existing
+    fn = File.join(@dir, 'new.db')
+    File.write(fn, 'foo')
+    assert_raises(Errno::EEXIST) { Extralite.clone_database(@template, fn) }
+    assert_equal 'foo', File.read(fn)
+  end
+
+  def test_clone_database_keeps_locks
+    @db.query('begin immediate')
+    Extralite.clone_database(@template, File.join(@dir, 'new.db'))
+    assert write_locked?(@template)
+  ensure
+    @db.query('rollback')
+  end
+
+  def test_clone_database_busy
+    @db.query('begin exclusive')
+    assert_raises(Extralite::BusyError) { Extralite.clone_database(@template, File.join(@dir, 'new.db')) }
+    refute File.exist?(File.join(@dir, 'new.db'))
+  ensure
+    @db.query('rollback')
+  end
+end
+
+class UpsertTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query('create table users (id integer primary key, name text, score float, active)')
+    @db.query('insert into users values (1, ?, 1.5, 1)', 'foo')
+  end
+
+  def test_upsert
+    result = @db.upsert(:users, [
+      { id: 1, name: 'bar', score: 2.5 },
+      { id: 2, name: 'baz', score: nil, active: true },
+      { id: 3, name: 'qux', active: false }
+    ])
+    assert_equal({ changes: 3, inserted: 2, updated: 1 }, result)
+    assert_equal [
+      { id: 1, name: 'bar', score: 2.5, active: 1 },
+      { id: 2, name: 'baz', score: nil, active: 1 },
+      { id: 3, name: 'qux', score: nil, active: 0 }
+    ], @db.query('select * from users order by id')
+  end
+
+  def test_upsert_update_columns
+    result = @db.upsert(:users, { id: 1, name: 'bar', score: 3.0 }, update: [:score])
+    assert_equal({ changes: 1, inserted: 0, updated: 1 }, result)
+    assert_equal({ id: 1, name: 'foo', score: 3.0, active: 1 }, @db.query_single_row('select * from users'))
+
+    assert_raises(ArgumentError) { @db.upsert(:users, { id: 1, name: 'bar' }, update: [:score]) }
+  end
+
+  def test_upsert_do_nothing
+    result = @db.upsert(:users, [{ id: 1, name: 'bar' }, { id: 2, name: 'baz' }], update: nil)
+    assert_equal({ changes: 1, inserted: 1, updated: 0 }, result)
+    assert_equal ['foo', 'baz'], @db.query_single_column('select name from users order by id')
+  end
+
+  def test_upsert_batches
+    rows = (1..2500).map { |i| { id: i, name: "user#{i}" } }
+    statements = []
+    @db.trace { |sql| statements << sql }
+    result = @db.upsert(:users, rows, batch_size: 1000)
+    assert_equal({ changes: 2500, inserted: 2499, updated: 1 }, result)
+    assert_equal 2500, @db.query_single_value('select count(*) from users')
+    assert_equal 3, statements.count { _1 =~ /^insert/ }
+    assert_equal 3, statements.count('begin immediate')
+
+    # statements are cached per column set
+    sql = statements.find { _1 =~ /^insert/ }
+    assert_equal 1, statements.uniq.count { _1 =~ /^insert/ }
+    assert_same @db.prepare_cached(sql), @db.prepare_cached(sql)
+  end
+
+  def test_upsert_in_transaction
+    @db.query('begin')
+    @db.upsert(:users, { id: 2, name: 'bar' })
+    assert @db.transaction_active?
+    @db.query('rollback')
+    assert_equal 1, @db.query_single_value('select count(*) from users')
+  end
+
+  def test_immediate_transaction
+    statements = []
+    @db.trace { |sql| statements << sql }
+    assert_equal 42, @db.immediate_transaction { @db.query('delete from users'); 42 }
+    assert_equal ['begin immediate', 'delete from users', 'commit'], statements
+    refute @db.transaction_active?
+
+    assert_raises(RuntimeError) do
+      @db.immediate_transaction { @db.query('insert into users (id) values (2)'); raise 'foo' }
+    end
+    refute @db.transaction_active?
+    assert_equal 0, @db.query_single_value('select count(*) from users')
+  end
+
+  def test_upsert_error_rolls_back_batch
+    @db.query('create table foo (id integer primary key, name text not null)')
+    assert_raises(Extralite::Error) do
+      @db.upsert(:foo, [{ id: 1, name: 'foo' }, { id: 2, name: nil }])
+    end
+    refute @db.transaction_active?
+    assert_equal 0, @db.query_single_value('select count(*) from foo')
+
+    assert_raises(Extralite::Error) { @db.upsert(:foo, [{ id: 1, name: Object.new }]) }
+    refute @db.transaction_active?
+  end
+
+  def test_upsert_without_rowid
+    @db.query('create table kv (k text primary key, v) without rowid')
+    @db.upsert(:kv, { k: 'a', v: 1 }, conflict: [:k])
+    result = @db.upsert(:kv, [{ k: 'a', v: 2 }, { k: 'b', v: 3 }], conflict: [:k])
+    assert_equal({ changes: 2, inserted: nil, updated: nil }, result)
+    assert_equal [['a', 2], ['b', 3]], @db.query_ary('select * from kv order by k')
+  end
+end
+
 class BackupTest < MiniTest::Test
   def setup
     @src = Extralite::Database.new(':memory:')
@@ -489,3 +1341,570 @@ class BackupTest < MiniTest::Test
     assert_equal [[1, 2, 3], [4, 5, 6]], db.query_ary('select * from t')
   end
 end
+
+class DumpTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query(<<~SQL)
+      create table t (id integer primary key autoincrement, name text, score float, data blob, extra);
+      create index t_name on t (name);
+      create table u (a, b as (a * 2));
+      create view v as select name from t;
+      create trigger t_delete after delete on t begin delete from u where a = old.id; end;
+    SQL
+    @db.query('insert into t (name, score, data, extra) values (?, ?, ?, ?)', "it's", 1.0 / 3, "\x00\xff".b, nil)
+    @db.query('insert into t (name, score, data, extra) values (?, ?, ?, ?)', "line\nbreak", -2.5e100, nil, 42)
+    @db.query('insert into u (a) values (1), (2), (3)')
+  end
+
+  def dump_restore(**opts)
+    io = StringIO.new
+    rows = @db.dump(io, **opts)
+    io.rewind
+    db = Extralite::Database.new(':memory:')
+    [rows, db.restore(io), db, io.string]
+  end
+
+  def test_dump_restore
+    rows, _count, db, sql = dump_restore
+    assert_equal 6, rows
+    assert_match(/^INSERT INTO "t"\("id","name","score","data","extra"\) VALUES$/, sql)
+    assert_equal @db.query('select * from t'), db.query('select * from t')
+    assert_equal [[1, 2], [2, 4], [3, 6]], db.query_ary('select * from u')
+    assert_equal ['t_name'], db.query_single_column("select name from sqlite_schema where type = 'index'")
+    assert_equal ["it's", "line\nbreak"], db.query_single_column('select * from v')
+    assert_equal 2, db.query_single_value('select seq from sqlite_sequence')
+
+    db.query('delete from t where id = 1')
+    assert_equal [2, 3], db.query_single_column('select a from u')
+  end
+
+  def test_dump_tables
+    rows, _count, db, sql = dump_restore(tables: [:u])
+    assert_equal 3, rows
+    refute_match(/"t"/, sql)
+    assert_equal ['u'], db.tables
+    assert_equal 0, db.query_single_value("select count(*) from sqlite_schema where type != 'table'")
+  end
+
+  def test_dump_batch_size
+    (4..10).each { |i| @db.query('insert into u (a) values (?)', i) }
+    _rows, _count, db, sql = dump_restore(batch_size: 3)
+    assert_equal 4, sql.scan('INSERT INTO "u"').size
+    assert_equal (1..10).map { _1 * 2 }, db.query_single_column('select b from u')
+  end
+
+  def test_restore_chunks
+    @db.query('insert into t (name) values (?)', 'sémi;cölon' * 100)
+    io = StringIO.new
+    @db.dump(io)
+    io.rewind
+
+    db = Extralite::Database.new(':memory:')
+    db.restore(io, chunk_size: 7)
+    assert_equal @db.query('select * from t'), db.query('select * from t')
+    assert_equal 1, db.query_single_value("select count(*) from sqlite_schema where type = 'trigger'")
+  end
+
+  def test_restore_script
+    db = Extralite::Database.new(':memory:')
+    count = db.restore(StringIO.new("begin; create table x (a);\n-- comment\ninsert into x values (1);\ncommit;\n"))
+    assert_equal 2, count
+    assert_equal [1], db.query_single_column('select a from x')
+    refute db.transaction_active?
+
+    assert_raises(Extralite::Error) { db.restore(StringIO.new('insert into x values (2); insert into x')) }
+    assert_equal [1, 2], db.query_single_column('select a from x')
+    assert_raises(Extralite::SQLError) { db.restore(StringIO.new('insert into y values (1);')) }
+  end
+
+  def test_restore_transaction_control
+    db = Extralite::Database.new(':memory:')
+    count = db.restore(StringIO.new("create table x (a);\n-- start\n/* x */ BEGIN;\ninsert into x values (1); /* done */ end;\n"))
+    assert_equal 2, count
+    assert_equal [1], db.query_single_column('select a from x')
+    refute db.transaction_active?
+
+    # only whole keywords are matched
+    assert_raises(Extralite::SQLError) { db.restore(StringIO.new('endpoint;')) }
+  end
+
+  def test_restore_chunk_boundaries
+    script = "create table x (a, [b;c]);\n/* ; */ insert into x values ('a;''b', \"c\"); -- ;\n" \
+      "create trigger x_t after insert on x begin select 1; select 2; end;\n"
+    (1..script.bytesize).each do |chunk_size|
+      db = Extralite::Database.new(':memory:')
+      assert_equal 3, db.restore(StringIO.new(script), chunk_size: chunk_size)
+      assert_equal [["a;'b", 'c']], db.query_ary('select * from x')
+    end
+  end
+
+  def test_restore_foreign_keys
+    src = Extralite::Database.new(':memory:')
+    src.query('create table node (id integer primary key, parent integer references node (id))')
+    src.query('insert into node values (1, 3), (2, null), (3, 2)')
+    io = StringIO.new
+    src.dump(io)
+
+    db = Extralite::Database.new(':memory:')
+    db.query('pragma foreign_keys = on')
+    io.rewind
+    db.restore(io, chunk_size: 16)
+    assert_equal [[1, 3], [2, nil], [3, 2]], db.query_ary('select * from node')
+    assert_equal 1, db.query_single_value('pragma foreign_keys')
+
+    # in a transaction, checks are deferred to the end of the transaction
+    db = Extralite::Database.new(':memory:')
+    db.query('pragma foreign_keys = on')
+    io.rewind
+    db.query('begin')
+    db.restore(io, chunk_size: 16)
+    db.query('commit')
+    assert_equal 3, db.query_single_value('select count(*) from node')
+
+    db.query('begin')
+    db.restore(StringIO.new('insert into node values (4, 5);'))
+    assert_raises(Extralite::Error) { db.query('commit') }
+    db.query('rollback')
+    assert_equal 3, db.query_single_value('select count(*) from node')
+  end
+
+  def test_dump_in_transaction
+    @db.query('begin')
+    @db.dump(StringIO.new)
+    assert @db.transaction_active?
+    @db.query('commit')
+  end
+end
+
+class IncrementalVacuumTest < MiniTest::Test
+  def setup
+    @dir = Dir.mktmpdir('extralite-vacuum')
+    @fn = File.join(@dir, 'test.db')
+    @db = Extralite::Database.new(@fn)
+    @db.busy_timeout = 5
+    @db.query('create table foo (x integer, y text)')
+    @db.query('begin')
+    @db.execute_multi('insert into foo values (?, ?)', (1..2000).map { |i| [i, 'x' * 200] })
+    @db.query('commit')
+  end
+
+  def teardown
+    @db.stop_vacuum_scheduler
+    @db.close
+    FileUtils.rm_rf(@dir)
+  end
+
+  def test_enable_incremental_vacuum
+    assert_equal 0, @db.query_single_value('pragma auto_vacuum')
+    assert_equal true, @db.enable_incremental_vacuum
+    assert_equal 2, @db.query_single_value('pragma auto_vacuum')
+    assert_equal 2000, @db.query_single_value('select count(*) from foo')
+    assert_equal false, @db.enable_incremental_vacuum
+
+    @db.query('begin')
+    assert_raises(Extralite::Error) { @db.enable_incremental_vacuum }
+    @db.query('rollback')
+  end
+
+  def test_incremental_vacuum
+    @db.enable_incremental_vacuum
+    assert_equal 0, @db.freelist_count
+    @db.query('delete from foo where x > 100')
+    free = @db.freelist_count
+    assert_operator free, :>, 50
+    size = File.size(@fn)
+
+    assert_equal 10, @db.incremental_vacuum(10)
+    assert_equal free - 10, @db.freelist_count
+    assert_equal free - 10, @db.incremental_vacuum
+    assert_equal 0, @db.freelist_count
+    assert_operator File.size(@fn), :<, size
+  end
+
+  def test_vacuum_scheduler_reclaim
+    @db.enable_incremental_vacuum
+    @db.query('delete from foo where x > 100')
+    free = @db.freelist_count
+
+    scheduler = Extralite::VacuumScheduler.new(@fn, slice_pages: 8, pause: 0, min_free_pages: 4)
+    assert_equal free - 4, scheduler.reclaim(@db)
+    assert_equal 4, @db.freelist_count
+    assert_equal (free - 4).fdiv(8).ceil, scheduler.slices
+    assert_equal free - 4, scheduler.pages_reclaimed
+  end
+
+  def test_vacuum_scheduler_trigger
+    @db.enable_incremental_vacuum
+    scheduler = @db.start_vacuum_scheduler(interval: 60, idle: 60, max_free_ratio: nil, slice_pages: 16, pause: 0)
+    assert_same scheduler, @db.vacuum_scheduler
+    assert scheduler.running?
+    assert_raises(Extralite::Error) { @db.start_vacuum_scheduler }
+
+    @db.query('delete from foo where x > 100')
+    assert_operator @db.freelist_count, :>, 0
+    scheduler.trigger
+    100.times { break if @db.freelist_count == 0; sleep 0.05 }
+    assert_equal 0, @db.freelist_count
+    assert_operator scheduler.slices, :>, 1
+
+    @db.stop_vacuum_scheduler
+    refute scheduler.running?
+    assert_nil @db.vacuum_scheduler
+  end
+
+  def test_vacuum_scheduler_idle
+    @db.enable_incremental_vacuum
+    @db.start_vacuum_scheduler(interval: 0.02, idle: 0.05, max_free_ratio: nil)
+    @db.query('delete from foo where x > 100')
+    100.times { break if @db.freelist_count == 0; sleep 0.05 }
+    assert_equal 0, @db.freelist_count
+  end
+
+  def test_vacuum_scheduler_memory_database
+    db = Extralite::Database.new(':memory:')
+    assert_raises(ArgumentError) { db.start_vacuum_scheduler }
+  end
+end
+
+class MemoryDatabaseTest < MiniTest::Test
+  def setup
+    @name = "test-#{rand(1 << 32)}"
+    @db = Extralite::Database.new_memory(@name, busy_timeout: 1)
+    @db.query('create table t (x integer, y text)')
+    @db.query('insert into t values (1, ?), (2, ?)', 'foo', 'bar')
+  end
+
+  def teardown
+    @db.close
+  end
+
+  def test_new_memory_shared
+    db2 = Extralite::Database.new_memory(@name, busy_timeout: 1)
+    assert_equal [1, 2], db2.query_single_column('select x from t')
+
+    values = (1..4).map do
+      Thread.new do
+        db = Extralite::Database.new_memory(@name, busy_timeout: 1)
+        db.query('insert into t values (3, ?)', 'baz')
+        db.query_single_value('select count(*) from t').tap { db.close }
+      end
+    end.map(&:value)
+    assert values.all? { _1.between?(3, 6) }
+    assert_equal 6, db2.query_single_value('select count(*) from t')
+
+    other = Extralite::Database.new_memory("#{@name}-other")
+    assert_equal [], other.tables
+  ensure
+    db2&.close
+    other&.close
+  end
+
+  def test_new_memory_lifetime
+    @db.close
+    @db = Extralite::Database.new_memory(@name)
+    assert_equal [], @db.tables
+  end
+
+  def test_new_memory_from_file
+    dir = Dir.mktmpdir('extralite-memdb')
+    fn = File.join(dir, 'ref.db')
+    Extralite::Database.new(fn).tap { |db| db.query('create table ref (code text)') }.close
+    src = Extralite::Database.new(fn)
+    src.query("insert into ref values ('a'), ('b')")
+
+    db = Extralite::Database.new_memory("#{@name}-ref", from: fn)
+    db2 = Extralite::Database.new_memory("#{@name}-ref")
+    assert_equal %w[a b], db2.query_single_column('select code from ref')
+
+    db3 = Extralite::Database.new_memory("#{@name}-ref2", from: src)
+    assert_equal %w[a b], db3.query_single_column('select code from ref')
+
+    assert_raises(Extralite::Error) { Extralite::Database.new_memory("#{@name}-x", from: File.join(dir, 'nope.db')) }
+    assert_raises(ArgumentError) { Extralite::Database.new_memory('') }
+  ensure
+    [src, db, db2, db3].each { _1&.close }
+    FileUtils.rm_rf(dir)
+  end
+
+  def test_serialize_deserialize
+    data = @db.serialize
+    assert_equal Encoding::ASCII_8BIT, data.encoding
+    assert data.start_with?("SQLite format 3\0")
+
+    db = Extralite::Database.new(':memory:')
+    assert_same db, db.deserialize(data)
+    assert_equal [{ x: 1, y: 'foo' }, { x: 2, y: 'bar' }], db.query('select * from t')
+    db.query('insert into t values (3, ?)', 'baz')
+    assert_equal 2, @db.query_single_value('select count(*) from t')
+
+    db.deserialize(data, read_only: true)
+    assert_raises(Extralite::Error) { db.query('insert into t values (3, ?)', 'baz') }
+
+    db.query("attach ':memory:' as aux")
+    db.deserialize(db.serialize, :aux)
+    assert_equal 2, db.query_single_value('select count(*) from aux.t')
+  end
+end
+
+class CommitHookTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query('create table t (x)')
+  end
+
+  def test_on_commit
+    commits = []
+    hook = @db.on_commit { commits << @db.query_single_value('select count(*) from t') }
+    @db.query('insert into t values (1)')
+    assert_equal [1], commits
+
+    @db.query('begin')
+    @db.query('insert into t values (2)')
+    @db.query('insert into t values (3)')
+    assert_equal [1], commits
+    @db.query('commit')
+    assert_equal [1, 3], commits
+
+    @db.query('begin')
+    @db.query('insert into t values (4)')
+    @db.query('rollback')
+    @db.query('select * from t')
+    assert_equal [1, 3], commits
+
+    # called once after an operation committing multiple transactions
+    @db.prepare('insert into t values (?)').execute_multi([[5], [6]])
+    assert_equal [1, 3, 5], commits
+
+    @db.prepare('insert into t values (?) returning x').query_single_value(7)
+    assert_equal [1, 3, 5, 6], commits
+
+    assert_same @db, @db.remove_on_commit(hook)
+    @db.query('insert into t values (8)')
+    assert_equal [1, 3, 5, 6], commits
+  end
+
+  def test_on_commit_multiple
+    a = b = 0
+    @db.on_commit { a += 1 }
+    @db.on_commit { b += 1 }
+    @db.query('insert into t values (1)')
+    assert_equal [1, 1], [a, b]
+    assert_raises(ArgumentError) { @db.on_commit }
+  end
+end
+
+class RowConversionTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query('create table t (a, b, c, d)')
+    @db.query(<<~SQL)
+      insert into t values
+        (1, 'foo', 1.5, 10), (2, 'bar', 2.5, 20), (null, 'baz', 3.5, 30), (4, x'00ff', 4, 'qux')
+    SQL
+  end
+
+  def test_specialized_shapes
+    assert_equal [[1], [2], [nil], [4]], @db.query_ary('select a from t')
+    assert_equal [[1, 'foo'], [2, 'bar']], @db.query_ary('select a, b from t limit 2')
+    assert_equal [['foo', 1], ['bar', 2]], @db.query_ary('select b, a from t limit 2')
+    assert_equal [[1, 'foo', 1.5], [2, 'bar', 2.5]], @db.query_ary('select a, b, c from t limit 2')
+    assert_equal [{ a: 1, b: 'foo', d: 10 }, { a: 2, b: 'bar', d: 20 }], @db.query('select a, b, d from t limit 2')
+    assert_equal [{ a: 1, x: 1, y: 1, z: 1 }], @db.query('select a, a as x, a as y, a as z from t limit 1')
+  end
+
+  def test_type_change
+    assert_equal [
+      [1, 'foo', 1.5, 10], [2, 'bar', 2.5, 20], [nil, 'baz', 3.5, 30], [4, "\x00\xff".b, 4, 'qux']
+    ], @db.query_ary('select * from t')
+    assert_equal [
+      { a: 1, b: 'foo' }, { a: 2, b: 'bar' }, { a: nil, b: 'baz' }, { a: 4, b: "\x00\xff".b }
+    ], @db.query('select a, b from t')
+    assert_equal [[1, 1.5], [2, 2.5], [nil, 3.5], [4, 4]], @db.query_ary('select a, c from t')
+  end
+
+  def test_frozen_results
+    db = Extralite::Database.new(':memory:', frozen: true)
+    rows = db.query_ary("select 1, 'foo' union all select 2, 'bar'")
+    assert_equal [[1, 'foo'], [2, 'bar']], rows
+    assert rows.all? { _1.frozen? && _1.last.frozen? }
+  end
+end
+
+class BatchWriteTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @db.query('create table t (x, y)')
+    @db.query(<<~SQL)
+      with recursive s(v) as (select 1 union all select v + 1 from s where v < 100)
+      insert into t select v, v % 3 from s
+    SQL
+  end
+
+  def test_delete_in_batches
+    progress = []
+    changes = @db.delete_in_batches(:t, 'y = ? and x > ?', [0, 10], batch: 30, pause: 0) do |c, f|
+      progress << [c, f]
+    end
+    assert_equal 30, changes
+    assert_equal [[7, 0.3], [17, 0.6], [27, 0.9], [30, 1.0]], progress
+    assert_equal 0, @db.query_single_value('select count(*) from t where y = 0 and x > 10')
+    assert_equal 70, @db.query_single_value('select count(*) from t')
+
+    assert_equal 1, @db.delete_in_batches(:t, 'x = :x', { x: 3 }, pause: 0)
+    assert_equal 0, @db.delete_in_batches(:t, 'x > 1000', pause: 0)
+  end
+
+  def test_delete_in_batches_gaps
+    @db.query('insert into t (rowid, x) values (1000000000, 0)')
+    progress = []
+    assert_equal 101, @db.delete_in_batches(:t, 'true', batch: 50, pause: 0) { |c, _| progress << c }
+    assert_equal [50, 100, 101], progress
+    assert_equal 0, @db.query_single_value('select count(*) from t')
+  end
+
+  def test_update_in_batches
+    assert_equal 34, @db.update_in_batches(:t, { y: 10 }, 'y = ?', [1], batch: 7, pause: 0)
+    assert_equal 34, @db.query_single_value('select count(*) from t where y = 10')
+
+    assert_equal 2, @db.update_in_batches(:t, 'x = x + ?', 'x in (?, ?)', [1000, 1, 2], pause: 0)
+    assert_equal [1001, 1002], @db.query_single_column('select x from t where x > 1000')
+  end
+
+  def test_stop_in_block
+    changes = 0
+    @db.delete_in_batches(:t, 'true', batch: 10, pause: 0) do |c, _|
+      changes = c
+      break
+    end
+    assert_equal 10, changes
+    assert_equal 90, @db.query_single_value('select count(*) from t')
+  end
+
+  def test_errors
+    assert_raises(ArgumentError) { @db.delete_in_batches(:t, 'true', batch: 0) }
+
+    @db.query('begin')
+    assert_raises(Extralite::Error) { @db.delete_in_batches(:t, 'true') }
+    @db.query('rollback')
+
+    @db.query('create table w (k primary key, v) without rowid')
+    assert_raises(Extralite::Error) { @db.delete_in_batches(:w, 'true') }
+  end
+end
+
+class ImmutableDatabaseTest < MiniTest::Test
+  def setup
+    @fn = "/tmp/extralite-immutable-#{rand(10000)}?.db"
+    FileUtils.rm(@fn) rescue nil
+    db = Extralite::Database.new(@fn)
+    db.query('create table t (x)')
+    db.query('insert into t values (1), (2), (3)')
+    db.close
+  end
+
+  def teardown
+    FileUtils.rm(@fn) rescue nil
+  end
+
+  def test_open_immutable
+    db = Extralite::Database.open_immutable(@fn)
+    assert_equal @fn, db.filename
+    assert_equal [1, 2, 3], db.query_single_column('select x from t')
+    assert_equal [{ mmap_size: File.size(@fn) }], db.pragma(:mmap_size)
+    assert_equal [{ cache_size: 16 }], db.pragma(:cache_size)
+    assert_raises(Extralite::Error) { db.query('insert into t values (4)') }
+
+    # no locks are taken, so a writer is never blocked by readers
+    writer = Extralite::Database.new(@fn)
+    db.query('begin')
+    db.query('select * from t')
+    writer.query('begin exclusive')
+    writer.query('rollback')
+    db.query('rollback')
+
+    assert_raises(Extralite::Error) { Extralite::Database.open_immutable('/tmp/extralite-nonexistent.db') }
+  end
+
+  def test_open_immutable_fork
+    skip unless Process.respond_to?(:fork)
+
+    db = Extralite::Database.open_immutable(@fn)
+    stmt = db.prepare('select x from t where x > ?')
+    r, w = IO.pipe
+    pid = fork do
+      r.close
+      w << Marshal.dump([stmt.query_single_column(1), db.pragma(:mmap_size)])
+    ensure
+      w.close
+      exit!
+    end
+    w.close
+    assert_equal [[2, 3], [{ mmap_size: File.size(@fn) }]], Marshal.load(r.read)
+    Process.wait(pid)
+    assert_equal [3], stmt.query_single_column(2)
+  ensure
+    r&.close
+  end
+end
+
+class IOStatsTest < MiniTest::Test
+  def setup
+    @fn = "/tmp/extralite-io-stats-#{rand(10000)}.db"
+    FileUtils.rm_f([@fn, "#{@fn}-wal", "#{@fn}-shm", "#{@fn}-journal"])
+    @db = Extralite::Database.new(@fn, io_stats: true)
+  end
+
+  def teardown
+    @db.close
+    FileUtils.rm_f([@fn, "#{@fn}-wal", "#{@fn}-shm", "#{@fn}-journal"])
+  end
+
+  def test_io_stats
+    @db.query('create table t (x)')
+    @db.query('insert into t values (1)')
+
+    stats = @db.io_stats
+    assert_equal %i[main wal journal temp], stats.keys
+    assert_operator stats[:main][:writes], :>, 0
+    assert_operator stats[:main][:syncs], :>, 0
+    assert_equal stats[:main][:writes] * 4096, stats[:main][:writes_bytes]
+    assert_equal stats[:main][:writes], stats[:main][:writes_latency].sum
+    assert_equal 24, stats[:main][:writes_latency].size
+    assert_kind_of Float, stats[:main][:writes_time]
+    assert_operator stats[:journal][:writes], :>, 0
+    assert_equal 0, stats[:wal][:writes]
+
+    @db.reset_io_stats
+    assert_equal 0, @db.io_stats[:main][:writes]
+
+    @db.pragma(journal_mode: :wal)
+    @db.query('insert into t values (2)')
+    assert_operator @db.io_stats[:wal][:writes], :>, 0
+    assert_operator @db.io_stats[:wal][:syncs], :>, 0
+  end
+
+  def test_io_stats_temp
+    @db.query('pragma temp.cache_size = 2')
+    @db.query('create temp table t (x)')
+    @db.query(<<~SQL)
+      with recursive s(v) as (select 1 union all select v + 1 from s where v < 1000)
+      insert into t select randomblob(500) from s
+    SQL
+    assert_operator @db.io_stats[:temp][:writes], :>, 0
+  end
+
+  def test_io_stats_per_connection
+    db2 = Extralite::Database.new(@fn, io_stats: true)
+    db2.query('create table t (x)')
+    assert_operator db2.io_stats[:main][:writes], :>, 0
+    assert_equal 0, @db.io_stats[:main][:writes]
+  ensure
+    db2&.close
+  end
+
+  def test_io_stats_disabled
+    assert_nil Extralite::Database.new(':memory:').io_stats
+    assert_raises(ArgumentError) { Extralite::Database.new(@fn, io_stats: true, vfs: 'extralite-uring') }
+  end
+end
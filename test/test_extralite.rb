@@ -1,12 +1,78 @@
 # frozen_string_literal: true
 
 require_relative 'helper'
+require 'tmpdir'
 
 class ExtraliteTest < MiniTest::Test
   def test_sqlite3_version
     assert_match /^3\.\d+\.\d+$/, Extralite.sqlite3_version
   end
 
+  def test_c_api
+    assert_equal 1, Extralite::C_API_VERSION
+    assert_kind_of Integer, Extralite::C_API
+    assert_operator Extralite::C_API, :>, 0
+  end
+
+  # Builds the extension in test/extensions/c_api, returning its path
+  def c_api_fixture
+    @@c_api_fixture ||= begin
+      src = File.join(__dir__, 'extensions/c_api')
+      dir = Dir.mktmpdir('extralite-c-api')
+      quiet = { chdir: dir, out: File::NULL, err: File::NULL }
+      built = system(RbConfig.ruby, File.join(src, 'extconf.rb'), **quiet) && system('make', **quiet)
+      built ? File.join(dir, "c_api_fixture.#{RbConfig::CONFIG['DLEXT']}") : false
+    end
+  end
+
+  def test_c_api_query
+    skip 'Failed to build C API fixture' unless c_api_fixture
+    require c_api_fixture
+
+    db = Extralite::Database.new(':memory:')
+    db.query('create table t (x, y)')
+    db.query('insert into t values (1, 2), (3, 4)')
+    assert_equal [{ x: 3, y: 4 }], CApiFixture.query(db, 'select * from t where x > ?', 1)
+    assert_equal Extralite::C_API, CApiFixture.api
+    assert_raises(Extralite::SQLError) { CApiFixture.query(db, 'select foo') }
+
+    db.close
+    assert_raises(Extralite::Error) { CApiFixture.query(db, 'select 1') }
+
+    # lib is on the load path, so the table is found by rb_ext_resolve_symbol
+    assert CApiFixture.resolved? if RUBY_VERSION >= '3.3'
+  end
+
+  def test_c_api_load_without_load_path
+    skip 'Failed to build C API fixture' unless c_api_fixture
+
+    # extralite is loaded by path, so the table is found using Extralite::C_API
+    script = <<~RUBY
+      require ARGV[0]
+      require ARGV[1]
+      db = Extralite::Database.new(':memory:')
+      exit(!CApiFixture.resolved? && CApiFixture.query(db, 'select 42 as x') == [{ x: 42 }])
+    RUBY
+    lib = File.expand_path('../lib/extralite', __dir__)
+    assert system(RbConfig.ruby, '--disable-gems', '-e', script, lib, c_api_fixture)
+  end
+
+  def test_soft_heap_limit
+    orig = Extralite.soft_heap_limit
+    Extralite.soft_heap_limit = 64 << 20
+    assert_equal 64 << 20, Extralite.soft_heap_limit
+    assert_raises(ArgumentError) { Extralite.soft_heap_limit = -1 }
+  ensure
+    Extralite.soft_heap_limit = orig
+  end
+
+  def test_hard_heap_limit
+    skip unless Extralite.respond_to?(:hard_heap_limit=)
+
+    assert_raises(ArgumentError) { Extralite.hard_heap_limit = -1 }
+    assert_kind_of Integer, Extralite.hard_heap_limit
+  end
+
   def test_status
     db = Extralite::Database.new(':memory:')
     db.query('create table if not exists t (x,y,z)')
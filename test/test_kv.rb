@@ -0,0 +1,93 @@
+# frozen_string_literal: true
+
+require_relative 'helper'
+
+class KVTest < MiniTest::Test
+  def setup
+    @db = Extralite::Database.new(':memory:')
+    @kv = Extralite::KV.new(@db, table: :cache, compress: 100)
+  end
+
+  def test_get_put
+    assert_nil @kv.get('foo')
+    assert_equal 'bar', @kv.put('foo', 'bar')
+    assert_equal 'bar', @kv.get('foo')
+    assert_equal Encoding::ASCII_8BIT, @kv.get('foo').encoding
+
+    @kv['foo'] = 'baz'
+    assert_equal 'baz', @kv['foo']
+    assert_equal 1, @kv.size
+    assert_equal ['cache'], @db.tables
+  end
+
+  def test_binary_values
+    value = (0..255).map(&:chr).join.b * 2
+    @kv.put('bin', value)
+    assert_equal value, @kv.get('bin')
+  end
+
+  def test_compression
+    value = 'abc' * 1000
+    @kv.put('big', value)
+    assert_equal value, @kv.get('big')
+    assert_equal 1, @db.query_single_value('select flags from cache where key = ?', 'big')
+    assert_operator @db.query_single_value('select length(value) from cache'), :<, 100
+
+    kv = Extralite::KV.new(@db, table: :plain, compress: nil)
+    kv.put('big', value)
+    assert_equal 0, @db.query_single_value('select flags from plain')
+  end
+
+  def test_get_many_put_many
+    assert_equal 3, @kv.put_many({ 'a' => '1', 'b' => '2', c: 'x' * 500 })
+    assert_equal({ 'a' => '1', 'c' => 'x' * 500 }, @kv.get_many(['a', 'c', 'd']))
+    assert_equal({}, @kv.get_many([]))
+  end
+
+  def test_delete
+    @kv.put_many({ 'a' => '1', 'b' => '2', 'c' => '3' })
+    assert_equal true, @kv.delete('a')
+    assert_equal false, @kv.delete('a')
+    assert_equal 1, @kv.delete_many(['b', 'd'])
+    assert_equal({ 'c' => '3' }, @kv.get_many(['a', 'b', 'c']))
+  end
+
+  def test_ttl
+    @kv.put('a', '1', ttl: 60)
+    @kv.put('b', '2', ttl: -1)
+    @kv.put_many({ 'c' => '3', 'd' => '4' }, ttl: -1)
+    assert_equal '1', @kv.get('a')
+    assert_nil @kv.get('b')
+    assert @kv.key?('a')
+    refute @kv.key?('b')
+    assert_equal({ 'a' => '1' }, @kv.get_many(%w[a b c d]))
+
+    assert_equal 4, @kv.size
+    assert_equal 3, @kv.expire(batch_size: 2)
+    assert_equal 1, @kv.size
+  end
+
+  def test_compare_and_swap
+    assert_equal true, @kv.compare_and_swap('a', nil, '1')
+    assert_equal false, @kv.compare_and_swap('a', nil, '2')
+    assert_equal false, @kv.compare_and_swap('a', '2', '3')
+    assert_equal true, @kv.compare_and_swap('a', '1', '3')
+    assert_equal '3', @kv.get('a')
+
+    # expired entries are treated as absent
+    @kv.put('b', '1', ttl: -1)
+    assert_equal false, @kv.compare_and_swap('b', '1', '2')
+    assert_equal true, @kv.compare_and_swap('b', nil, '2')
+    assert_equal '2', @kv.get('b')
+
+    big = 'y' * 1000
+    @kv.put('c', big)
+    assert_equal true, @kv.compare_and_swap('c', big, 'z')
+  end
+
+  def test_clear
+    @kv.put_many({ 'a' => '1', 'b' => '2' })
+    @kv.clear
+    assert_equal 0, @kv.size
+  end
+end
@@ -42,6 +42,25 @@ class PreparedStatementTest < MiniTest::Test
     assert_equal Extralite::Error, error.class
   end
 
+  def test_prepare_cached
+    stmt = @db.prepare_cached('select * from t where x = ?')
+    assert_same stmt, @db.prepare_cached('select * from t where x = ?')
+    refute_same stmt, @db.prepare_cached('select * from t where y = ?')
+    assert_equal [{ x: 4, y: 5, z: 6 }], stmt.query(4)
+
+    stmt.close
+    stmt2 = @db.prepare_cached('select * from t where x = ?')
+    refute_same stmt, stmt2
+    refute stmt2.closed?
+  end
+
+  def test_prepare_cached_eviction
+    first = @db.prepare_cached('select 0')
+    (1..Extralite::Database::STATEMENT_CACHE_SIZE).each { |i| @db.prepare_cached("select #{i}") }
+    assert first.closed?
+    refute @db.prepare_cached('select 1').closed?
+  end
+
   def test_prepared_statement_query_hash
     r = @stmt.query_hash(4)
     assert_equal [{x: 4, y: 5, z: 6}], r
@@ -50,6 +69,15 @@ class PreparedStatementTest < MiniTest::Test
     assert_equal [], r
   end
 
+  def test_prepared_statement_query_rows
+    r = @stmt.query_rows(4)
+    assert_equal [{x: 4, y: 5, z: 6}], r.map(&:to_h)
+    assert_equal 5, r.first[:y]
+
+    r = @stmt.query_rows(5)
+    assert_equal [], r
+  end
+
   def test_prepared_statement_query_ary
     r = @stmt.query_ary(1)
     assert_equal [[1, 2, 3]], r
@@ -89,6 +117,11 @@ end
     }
   end
 
+  def test_prepared_statement_trailing_comments
+    assert_equal [1], @db.prepare("select 1; ; -- done\n/* really */ ").query_single_column
+    assert_raises(Extralite::Error) { @db.prepare('select 1; ; select 2') }
+  end
+
   def test_prepared_statement_multiple_statements_with_bad_sql
     error = nil
     begin
@@ -206,6 +239,14 @@ end
     ], @db.query('select * from foo')
   end  
 
+  def test_prepared_statement_execute_rows
+    @db.query('create table foo (a primary key, b)')
+    p = @db.prepare('insert into foo values (?, ?) on conflict (a) do update set b = excluded.b')
+    assert_equal [2, 0], p.execute_rows([:a, :b], [{ a: 1, b: 'x' }, { a: 2, b: 'y' }])
+    assert_equal [1, 1], p.execute_rows([:a, :b], [{ b: 'z', a: 2 }, { a: 3, b: nil }])
+    assert_equal [[1, 'x'], [2, 'z'], [3, nil]], @db.query_ary('select * from foo order by a')
+  end
+
   def test_prepared_statement_status
     assert_equal 0, @stmt.status(Extralite::SQLITE_STMTSTATUS_RUN)
     @stmt.query
@@ -0,0 +1,156 @@
+# frozen_string_literal: true
+
+require_relative 'helper'
+require 'fileutils'
+require 'tmpdir'
+
+class QueueTest < MiniTest::Test
+  def setup
+    @dir = Dir.mktmpdir('extralite-queue')
+    @fn = File.join(@dir, 'queue.db')
+    @db = Extralite::Database.new(@fn)
+    @db.busy_timeout = 5
+    @db.pragma(journal_mode: :wal)
+    @queue = Extralite::Queue.new(@db, :mailer)
+  end
+
+  def teardown
+    @queue.close
+    @db.close
+    FileUtils.rm_rf(@dir)
+  end
+
+  def test_push_claim_ack
+    id = @queue.push('foo')
+    assert_kind_of Integer, id
+    assert_equal 1, @queue.size
+
+    jobs = @queue.claim(5)
+    assert_equal 1, jobs.size
+    job = jobs.first
+    assert_equal [id, 'foo', 1], [job.id, job.payload, job.attempts]
+    assert_equal [], @queue.claim
+
+    assert_equal true, @queue.ack(job)
+    assert_equal false, @queue.ack(job)
+    assert_equal 0, @queue.size
+  end
+
+  def test_push_many
+    assert_equal 3, @queue.push_many(%w[a b c])
+    other = Extralite::Queue.new(@db, :other)
+    other.push('x')
+
+    assert_equal %w[a b], @queue.claim(2).map(&:payload)
+    assert_equal %w[c], @queue.claim(2).map(&:payload)
+    assert_equal %w[x], other.claim(2).map(&:payload)
+    assert_equal ['jobs'], @db.tables
+  ensure
+    other&.close
+  end
+
+  def test_claim_order
+    @queue.push_many(%w[a b c])
+    job = @queue.claim(1).first
+    @queue.nack(job)
+
+    # jobs visible first are claimed first, and returned ordered by id
+    assert_equal %w[b], @queue.claim(1).map(&:payload)
+    assert_equal %w[a c], @queue.claim(5).map(&:payload)
+  end
+
+  def test_delay
+    @queue.push('later', delay: 0.1)
+    assert_equal [], @queue.claim
+    sleep 0.15
+    assert_equal ['later'], @queue.claim.map(&:payload)
+  end
+
+  def test_lease_expiry
+    @queue.push('foo')
+    job = @queue.claim(1, lease: 0.05).first
+    assert_equal [], @queue.claim
+    sleep 0.1
+
+    job2 = @queue.claim.first
+    assert_equal [job.id, 2], [job2.id, job2.attempts]
+    assert_equal false, @queue.ack(job)
+    assert_equal false, @queue.nack(job)
+    assert_equal true, @queue.ack(job2)
+  end
+
+  def test_nack
+    @queue.push('foo')
+    job = @queue.claim.first
+    assert_equal true, @queue.nack(job, delay: 0.05)
+    assert_equal [], @queue.claim
+    sleep 0.1
+    assert_equal [[job.id, 2]], @queue.claim.map { [_1.id, _1.attempts] }
+  end
+
+  def test_claim_wait
+    consumer_db = Extralite::Database.new(@fn)
+    consumer_db.busy_timeout = 5
+    consumer = Extralite::Queue.new(consumer_db, :mailer, poll_interval: 10)
+
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    thread = Thread.new { consumer.claim(1, wait: 5) }
+    sleep 0.05
+    @queue.push('foo')
+    jobs = thread.value
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0
+    assert_equal ['foo'], jobs.map(&:payload)
+    assert_operator elapsed, :<, 1
+
+    # woken on commit, not on push
+    thread = Thread.new { consumer.claim(1, wait: 5) }
+    sleep 0.05
+    @db.query('begin')
+    @queue.push('bar')
+    sleep 0.05
+    assert thread.alive?
+    @db.query('commit')
+    assert_equal ['bar'], thread.value.map(&:payload)
+
+    assert_equal [], consumer.claim(1, wait: 0.05)
+  ensure
+    consumer&.close
+    consumer_db&.close
+  end
+
+  def test_concurrent_consumers
+    @queue.push_many((1..200).to_a)
+    claimed = (1..4).map do
+      Thread.new do
+        db = Extralite::Database.new(@fn)
+        db.busy_timeout = 5
+        queue = Extralite::Queue.new(db, :mailer)
+        ids = []
+        while !(jobs = queue.claim(7)).empty?
+          jobs.each { |job| ids << job.payload if queue.ack(job) }
+        end
+        queue.close
+        db.close
+        ids
+      end
+    end.map(&:value)
+    assert_equal (1..200).to_a, claimed.flatten.sort
+  end
+
+  def test_close_releases_signal
+    signals = Extralite::Queue.instance_variable_get(:@signals)
+    key = [@fn, 'mailer']
+    db = Extralite::Database.new(@fn)
+    queue = Extralite::Queue.new(db, :mailer)
+    assert_equal 2, signals[key].refs
+
+    queue.close
+    queue.close
+    assert signals.key?(key)
+
+    @queue.close
+    refute signals.key?(key)
+  ensure
+    db&.close
+  end
+end
@@ -0,0 +1,79 @@
+# frozen_string_literal: true
+
+require_relative 'helper'
+require 'fileutils'
+
+class ShardedDatabaseTest < MiniTest::Test
+  def setup
+    @paths = (0..2).map { |i| "/tmp/extralite-shard-#{i}-#{rand(10000)}.db" }
+    @paths.each { |fn| FileUtils.rm(fn) rescue nil }
+
+    @db = Extralite::ShardedDatabase.new(@paths, shard_key: :user_id)
+    @db.query('create table events (user_id integer, seq integer, name text)')
+    @db.execute_multi(
+      'insert into events values (:user_id, :seq, :name)',
+      (1..30).map { |i| { user_id: i % 10, seq: i, name: "event #{i}" } }
+    )
+  end
+
+  def teardown
+    @db.close
+    @paths.each { |fn| FileUtils.rm(fn) rescue nil }
+  end
+
+  def test_routing
+    assert_equal 3, @db.shards.size
+    @db.shards.each { |shard| assert_equal ['events'], shard.tables }
+
+    shard = @db.shard_for(3)
+    assert_equal [3, 13, 23], shard.query_single_column('select seq from events where user_id = 3 order by seq')
+    assert_equal [3, 13, 23], @db.query_single_column('select seq from events where user_id = :user_id order by seq', user_id: 3)
+    assert_equal [3, 13, 23], @db.query_single_column('select seq from events where user_id = :user_id order by seq', 'user_id' => 3)
+
+    @db.shards.each do |s|
+      next if s == shard
+
+      assert_equal 0, s.query_single_value('select count(*) from events where user_id = 3')
+    end
+  end
+
+  def test_fan_out
+    assert_equal 30, @db.query('select * from events').size
+    assert_equal (1..30).to_a, @db.query_single_column('select seq from events').sort
+    assert_equal 3, @db.query_single_column('select count(*) from events').size
+  end
+
+  def test_ordered_merge
+    assert_equal (1..30).to_a, @db.query_single_column('select seq from events order by seq')
+    assert_equal [30, 29, 28], @db.query_single_column('select seq from events order by seq desc limit 3')
+
+    rows = @db.query('select user_id, seq from events order by user_id, seq desc limit 4')
+    assert_equal [{ user_id: 0, seq: 30 }, { user_id: 0, seq: 20 }, { user_id: 0, seq: 10 }, { user_id: 1, seq: 21 }], rows
+
+    rows = @db.query_ary('select seq, user_id from events order by "user_id" desc, events.seq limit 2')
+    assert_equal [[9, 9], [19, 9]], rows
+  end
+
+  def test_nested_order_and_limit
+    # subqueries and CTEs are run on each shard
+    assert_equal 9, @db.query('with e as (select * from events order by seq limit 3) select * from e').size
+    assert_equal 9, @db.query_single_column('select seq from events where seq in (select seq from events limit 3)').size
+    assert_equal [1, 2, 3], @db.query_single_column(
+      "select seq from (select seq, 'limit 1' from events order by seq) -- limit 2\norder by seq limit 3"
+    )
+    assert_raises(ArgumentError) { @db.query('select * from (select * from events) limit 3') }
+  end
+
+  def test_unsupported_fan_out
+    assert_raises(ArgumentError) { @db.query('select * from events limit 3') }
+    assert_raises(ArgumentError) { @db.query('select * from events order by seq + 1') }
+    assert_raises(ArgumentError) { @db.query('select name from events order by seq') }
+    assert_raises(ArgumentError) { @db.execute_multi('insert into events values (?, ?, ?)', [[1, 2, 3]]) }
+  end
+
+  def test_with_shard
+    @db.with_shard(5) do |shard|
+      assert_equal @db.shard_for(5), shard
+    end
+  end
+end
@@ -0,0 +1,189 @@
+# frozen_string_literal: true
+
+require_relative 'helper'
+require 'fileutils'
+require 'tmpdir'
+
+class TenantManagerTest < MiniTest::Test
+  def setup
+    @dir = Dir.mktmpdir('extralite-tenants')
+    @setups = 0
+    @tenants = Extralite::TenantManager.new(@dir, max_open: 3, idle_timeout: nil, pragma: { user_version: 42 }) do |db|
+      @setups += 1
+      db.query('create table if not exists kv (k text primary key, v)')
+    end
+  end
+
+  def teardown
+    @tenants.close
+    FileUtils.rm_rf(@dir)
+  end
+
+  def test_with_tenant
+    @tenants.with_tenant(1) { |db| db.query('insert into kv values (?, ?)', 'foo', 1) }
+    @tenants.with_tenant('2') { |db| db.query('insert into kv values (?, ?)', 'foo', 2) }
+
+    assert_equal 1, @tenants.with_tenant(1) { |db| db.query_single_value('select v from kv') }
+    assert_equal 2, @tenants.with_tenant(2) { |db| db.query_single_value('select v from kv') }
+    assert_equal 42, @tenants.with_tenant(2) { |db| db.pragma(:user_version).first[:user_version] }
+    assert_equal 2, @setups
+    assert_equal 2, @tenants.size
+    assert File.exist?(File.join(@dir, '1.db'))
+  end
+
+  def test_invalid_tenant_id
+    assert_raises(ArgumentError) { @tenants.with_tenant('../foo') {} }
+    assert_raises(ArgumentError) { @tenants.with_tenant('a/b') {} }
+  end
+
+  def test_lru_eviction
+    dbs = (1..3).map { |i| @tenants.with_tenant(i) { _1 } }
+    @tenants.with_tenant(1) {}
+    @tenants.with_tenant(4) {}
+
+    assert_equal 3, @tenants.size
+    assert @tenants.open?(1)
+    refute @tenants.open?(2)
+    assert dbs[1].closed?
+    refute dbs[0].closed?
+
+    # reopening a tenant runs setup again
+    @tenants.with_tenant(2) {}
+    assert_equal 5, @setups
+  end
+
+  def test_in_use_connections_not_evicted
+    @tenants.with_tenant(1) do |db1|
+      (2..5).each { |i| @tenants.with_tenant(i) {} }
+      refute db1.closed?
+      assert @tenants.open?(1)
+    end
+    assert_equal 3, @tenants.size
+  end
+
+  def test_statement_cache_survives
+    stmt = @tenants.with_tenant(1) { |db| db.prepare_cached('select count(*) from kv') }
+    assert_same stmt, @tenants.with_tenant(1) { |db| db.prepare_cached('select count(*) from kv') }
+    assert_equal 0, stmt.query_single_value
+  end
+
+  def test_close_idle
+    @tenants.with_tenant(1) {}
+    @tenants.with_tenant(2) {}
+    assert_equal 0, @tenants.close_idle(60)
+    assert_equal 2, @tenants.close_idle(0)
+    assert_equal 0, @tenants.size
+  end
+
+  def test_close_idle_without_timeout
+    @tenants.with_tenant(1) {}
+    assert_equal 0, @tenants.close_idle
+    assert @tenants.open?(1)
+  end
+
+  def test_template
+    template = File.join(@dir, 'template.sqlite')
+    db = Extralite::Database.new(template)
+    db.query('create table foo (x)')
+    db.query('insert into foo values (42)')
+    db.close
+
+    tenants = Extralite::TenantManager.new(@dir, template: template)
+    assert_equal 42, tenants.with_tenant(1) { |db| db.query_single_value('select x from foo') }
+    tenants.with_tenant(1) { |db| db.query('update foo set x = 43') }
+    tenants.close
+
+    tenants = Extralite::TenantManager.new(@dir, template: template)
+    assert_equal 43, tenants.with_tenant(1) { |db| db.query_single_value('select x from foo') }
+  ensure
+    tenants&.close
+  end
+
+  def test_template_concurrent
+    template = File.join(@dir, 'template.sqlite')
+    src = Extralite::Database.new(template)
+    src.pragma(journal_mode: :wal, wal_autocheckpoint: 0)
+    src.query('create table foo (x)')
+    src.query('insert into foo values (42)')
+
+    # separate managers provision the same tenant, as separate processes would
+    managers = 4.times.map { Extralite::TenantManager.new(@dir, template: template) }
+    values = managers.map do |tenants|
+      Thread.new { tenants.with_tenant(1) { |db| db.query_single_value('select x from foo') } }
+    end.map(&:value)
+    assert_equal [42] * 4, values
+    assert_equal [], Dir[File.join(@dir, '*.tmp*')]
+  ensure
+    managers&.each(&:close)
+    src&.close
+  end
+
+  def test_reaper
+    tenants = Extralite::TenantManager.new(@dir, idle_timeout: 0.1)
+    db = tenants.with_tenant(1) { _1 }
+    sleep 1.5
+    assert db.closed?
+    refute tenants.open?(1)
+  ensure
+    tenants.close
+  end
+
+  def test_close_while_reaping
+    tenants = Extralite::TenantManager.new(@dir, idle_timeout: 0.1) do |db|
+      def db.close
+        sleep 0.5
+        super
+      end
+    end
+    db = tenants.with_tenant(1) { _1 }
+
+    # the reaper wakes up after a second, and is still closing the connection
+    sleep 1.2
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    tenants.close
+    assert db.closed?
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0, :<, 1
+  end
+
+  def test_open_outside_lock
+    opened = Queue.new
+    tenants = Extralite::TenantManager.new(@dir) do |db|
+      sleep 0.5 if db.filename.end_with?('slow.db')
+      opened << db.filename
+    end
+
+    slow = 2.times.map { Thread.new { tenants.with_tenant('slow') { _1 } } }
+    sleep 0.1
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    tenants.with_tenant('fast') {}
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0, :<, 0.3
+
+    # threads using the same tenant wait for it to be opened
+    dbs = slow.map(&:value)
+    assert_same dbs[0], dbs[1]
+    assert_equal 2, opened.size
+  ensure
+    tenants&.close
+  end
+
+  def test_open_error
+    tenants = Extralite::TenantManager.new(@dir) { raise 'foo' }
+    assert_raises(RuntimeError) { tenants.with_tenant(1) {} }
+    refute tenants.open?(1)
+    assert_equal 0, tenants.size
+  ensure
+    tenants&.close
+  end
+
+  def test_concurrent_access
+    threads = 8.times.map do |i|
+      Thread.new do
+        20.times { |j| @tenants.with_tenant(j % 5) { |db| db.query('insert or replace into kv values (?, ?)', "#{i}", j) } }
+      end
+    end
+    threads.each(&:join)
+    (0..4).each do |t|
+      assert_equal 8, @tenants.with_tenant(t) { |db| db.query_single_value('select count(*) from kv') }
+    end
+  end
+end